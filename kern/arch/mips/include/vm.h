@@ -123,7 +123,7 @@ paddr_t ram_getfirstfree(void);
 
 struct tlbshootdown {
 	vaddr_t v_page_num;
-	pid_t pid;
+	uint32_t asid;
 };
 
 #define TLBSHOOTDOWN_MAX 16
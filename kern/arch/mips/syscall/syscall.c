@@ -157,6 +157,10 @@ syscall(struct trapframe *tf)
 		err = sys_fork(tf, &retval0);
 		break;
 
+		case SYS_vfork:
+		err = sys_vfork(tf, &retval0);
+		break;
+
 		case SYS_getpid:
 		err = sys_getpid(&retval0);
 		break;
@@ -165,6 +169,24 @@ syscall(struct trapframe *tf)
 		err = sys_execv((const char *) tf->tf_a0, (char **) tf->tf_a1);
 		break;
 
+		case SYS_spawn:
+		err = sys_spawn((const char *) tf->tf_a0, (char **) tf->tf_a1,
+				(const struct spawn_action *) tf->tf_a2,
+				(int) tf->tf_a3, &retval0);
+		break;
+
+		case SYS_getrusage:
+		err = sys_getrusage((int) tf->tf_a0, (userptr_t) tf->tf_a1);
+		break;
+
+		case SYS_getrlimit:
+		err = sys_getrlimit((int) tf->tf_a0, (userptr_t) tf->tf_a1);
+		break;
+
+		case SYS_setrlimit:
+		err = sys_setrlimit((int) tf->tf_a0, (const_userptr_t) tf->tf_a1);
+		break;
+
 		case SYS_waitpid:
 		err = sys_waitpid((pid_t)tf->tf_a0, (int32_t *) tf->tf_a1, (int32_t) tf->tf_a2);
 		break;
@@ -179,6 +201,45 @@ syscall(struct trapframe *tf)
 		err = sys_sbrk((ssize_t) tf->tf_a0, &retval0);
 		break;
 
+		case SYS_mmap: ;
+		int mmap_fd;
+		off_t mmap_offset;
+		err = copyin((const_userptr_t) tf->tf_sp + 16, &mmap_fd, sizeof(int));
+		if (err) {
+			break;
+		}
+		err = copyin((const_userptr_t) tf->tf_sp + 24, &mmap_offset, sizeof(off_t));
+		if (err) {
+			break;
+		}
+		err = sys_mmap((void *)tf->tf_a0, (size_t)tf->tf_a1, (int)tf->tf_a2,
+			       (int)tf->tf_a3, mmap_fd, mmap_offset, &retval0);
+		break;
+
+		case SYS_munmap:
+		err = sys_munmap((void *)tf->tf_a0, (size_t)tf->tf_a1);
+		break;
+
+		case SYS_msync:
+		err = sys_msync((void *)tf->tf_a0, (size_t)tf->tf_a1, (int)tf->tf_a2);
+		break;
+
+		case SYS_madvise:
+		err = sys_madvise((void *)tf->tf_a0, (size_t)tf->tf_a1, (int)tf->tf_a2);
+		break;
+
+		case SYS_mincore:
+		err = sys_mincore((void *)tf->tf_a0, (size_t)tf->tf_a1, (userptr_t)tf->tf_a2);
+		break;
+
+		case SYS_mlock:
+		err = sys_mlock((void *)tf->tf_a0, (size_t)tf->tf_a1);
+		break;
+
+		case SYS_munlock:
+		err = sys_munlock((void *)tf->tf_a0, (size_t)tf->tf_a1);
+		break;
+
 	    default:
 		kprintf("Unknown syscall %d\n", callno);
 		err = ENOSYS;
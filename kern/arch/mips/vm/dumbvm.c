@@ -103,6 +103,13 @@ free_kpages(vaddr_t addr)
 	(void)addr;
 }
 
+bool
+vm_zero_idle(void)
+{
+	/* no zeroed page pool */
+	return false;
+}
+
 void
 vm_tlbshootdown_all(void)
 {
@@ -271,10 +278,16 @@ as_deactivate(void)
 
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+		 struct vnode *v, off_t offset, size_t filesize,
 		 int readable, int writeable, int executable)
 {
 	size_t npages;
 
+	/* Segments are loaded eagerly by load_elf */
+	(void)v;
+	(void)offset;
+	(void)filesize;
+
 	/* Align the region. First, the base... */
 	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
 	vaddr &= PAGE_FRAME;
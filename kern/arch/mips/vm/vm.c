@@ -15,14 +15,39 @@
 #include <kern/fcntl.h>
 #include <uio.h>
 #include <vnode.h>
+#include <stat.h>
 #include <cpu.h>
+#include <synch.h>
+#include <platform/maxcpus.h>
+#include <pagecache.h>
+#include <zswap.h>
+#include <ksm.h>
 
 struct lock *global_lock;
-struct cv *global_cv;
 
 struct coremap *cm;
 struct spinlock cm_spinlock = SPINLOCK_INITIALIZER;
 volatile size_t cm_counter = 0;
+volatile size_t swap_counter = 0; /* Number of swap pages in use */
+static size_t vm_committed = 0; /* Number of heap pages committed by sbrk */
+static size_t mlocked_pages = 0; /* Number of frames pinned by mlock */
+static size_t mlock_max_pages;
+
+/* Free page watermarks, set from the size of RAM; see vm.h. Shared with pagecache.c */
+size_t free_min_pages;
+size_t free_low_pages;
+size_t free_high_pages;
+
+/*
+The paging daemon sleeps on daemon_wchan, and threads waiting for free frames on free_wchan.
+Both are used with the cm_spinlock. daemon_passes counts the reclaim passes of the daemon, so a
+waiter can tell that the daemon tried and could not free enough.
+*/
+static struct wchan *daemon_wchan;
+static struct wchan *free_wchan;
+static unsigned free_waiters = 0;
+static unsigned daemon_passes = 0;
+static unsigned compact_wanted = 0; /* Order of a block alloc_kpages could not find, or 0 */
 
 /* Variable indicating paging bounds. Shared with msyscall.c */
 p_page_t first_alloc_page; /* First physical page that can be dynamically allocated */
@@ -30,8 +55,46 @@ p_page_t last_page; /* One page past the last free physical page in RAM */
 p_page_t first_page_swap; /* First physical page number that is allocated to swap */
 p_page_t last_page_swap; /* One page past the last free physical page SWAP */
 
+/*
+The l2 page table of the address space active on each CPU. Read by the TLB refill fast path
+in exception-mips1.S, so it must only point to a live l2 page table or be NULL.
+*/
+struct l2_pt *utlb_l2_pt[MAXCPUS];
+
+/*
+Address space IDs. An address space's as_asid holds the generation it was handed out in, above
+the 6 bit hardware ASID. Within a generation, hardware ASIDs are handed out once each, so the TLB
+entries of different address spaces never match each other. When they run out, a new generation
+starts. Each CPU flushes its TLB the first time it activates an address space of a newer
+generation than the one it last flushed for, so a TLB is only flushed on rollover.
+ASID 0 is never handed out; an as_asid of 0 means the address space has no ASID.
+
+Each CPU also records the address space it last activated and the ASID it did so with, which
+stays in its EntryHi until it activates another. A CPU that keeps running one address space
+across a rollover never activates it again, so it still holds TLB entries of the address space
+under an ASID of an older generation; TLB shootdowns find it through this record.
+*/
+#define ASID_GEN_SHIFT       6
+#define ASID_HW(asid)        ((asid) & (NUM_ASIDS - 1))
+#define ASID_GEN(asid)       ((asid) >> ASID_GEN_SHIFT)
+
+static struct spinlock asid_spinlock = SPINLOCK_INITIALIZER;
+static uint32_t asid_generation = 1;
+static uint32_t asid_next = 1;
+static uint32_t cpu_asid_generation[MAXCPUS];
+static struct addrspace *cpu_as[MAXCPUS];
+static uint32_t cpu_asid[MAXCPUS];
+
 static struct vnode *swap_disk;
 static const char swap_dir[] = "lhd0raw:";
+static struct swapmap swapmap;
+static struct rmap *rmap_pool; /* Free rmap entries */
+static p_page_t zero_page; /* Shared frame of zeros; see vm.h */
+
+/* Pool of zeroed free frames, filled by idle CPUs; see vm.h */
+static p_page_t zero_pool;
+static size_t zero_pool_count = 0;
+static size_t zero_pool_target = 0;
 static volatile p_page_t swapclock;
 
 /////////////////////////////////////////////////////////////////////////////////////////
@@ -56,12 +119,37 @@ in_all_memory(p_page_t p_page)
     return in_all_memory;
 }
 
+/*
+Gets the coremap entry of a page frame, or the swap map entry of a swap slot.
+*/
+static
+cm_entry_t *
+cm_entry(p_page_t p_page)
+{
+    if (in_swap(p_page)) {
+        return &swapmap.sm_entries[p_page - first_page_swap];
+    }
+
+    return &cm->cm_frames[p_page].cf_entry;
+}
+
+static
+struct rmap **
+cm_rmap(p_page_t p_page)
+{
+    if (in_swap(p_page)) {
+        return &swapmap.sm_rmap[p_page - first_page_swap];
+    }
+
+    return &cm->cm_frames[p_page].cf_rmap;
+}
+
 static
 void
 kalloc_ppage(p_page_t p_page)
 {
     v_page_t v_page = PPAGE_TO_KVPAGE(p_page);
-    cm->cm_entries[p_page] = 0 | PP_USED | v_page;
+    cm->cm_frames[p_page].cf_entry = 0 | PP_USED | v_page;
     cm_counter++;
 }
 
@@ -69,668 +157,2744 @@ static
 bool
 p_page_used(p_page_t p_page)
 {
-    cm_entry_t entry = cm->cm_entries[p_page];
+    cm_entry_t entry = *cm_entry(p_page);
     bool used = entry & PP_USED;
     return used;
 }
 
+/*
+Finds the lowest set bit of a nonzero word.
+*/
 static
-int
-find_free(size_t npages, p_page_t *start)
+unsigned
+lowest_bit(uint32_t bits)
 {
-    while (*start < last_page - npages) {
-        if (!p_page_used(*start)) {
-            size_t offset;
-            for (offset = 0; offset < npages; offset++) {
-                if (p_page_used(*start + offset)) {
-                    break;
-                }
-            }
+    KASSERT(bits != 0);
 
-            if (offset == npages) {
-                break;
-            }
+    unsigned bit = 0;
+    for (unsigned width = 16; width > 0; width /= 2) {
+        if ((bits & ((1U << width) - 1)) == 0) {
+            bits >>= width;
+            bit += width;
         }
-
-        (*start)++;
-    }
-
-    if (*start == last_page - npages) {
-        return ENOMEM;
     }
 
-    return 0;
-}
-
-void
-free_ppage(p_page_t p_page)
-{
-    KASSERT(in_ram(p_page));
-
-    cm->cm_entries[p_page] = 0;
-    cm->pids8_entries[p_page] = 0;
-    cm_counter--;
-}
-
-void
-free_ppage_swap(p_page_t p_page)
-{
-    KASSERT(in_swap(p_page));
-
-    cm->cm_entries[p_page] = 0;
-    cm->pids8_entries[p_page] = 0;
+    return bit;
 }
 
-size_t
-cm_getref(p_page_t p_page)
+static
+bool
+buddy_isfree(p_page_t p_page, unsigned order)
 {
-    KASSERT(in_all_memory(p_page));
-
-    return GET_REF(cm->cm_entries[p_page]);
+    size_t bit = p_page >> order;
+    return cm->bd_map[order][bit / 32] & (1U << (bit % 32));
 }
 
+static
 void
-cm_incref(p_page_t p_page)
+buddy_push(p_page_t p_page, unsigned order)
 {
-    KASSERT(in_all_memory(p_page));
-
-    size_t curref = GET_REF(cm->cm_entries[p_page]);
-    curref++;
-    SET_REF(cm->cm_entries[p_page], curref);
+    KASSERT(p_page % (1U << order) == 0);
+
+    size_t bit = p_page >> order;
+    cm->bd_map[order][bit / 32] |= 1U << (bit % 32);
+    cm->cm_frames[p_page].cf_prev = 0;
+    cm->cm_frames[p_page].cf_next = cm->bd_head[order];
+    if (cm->bd_head[order] != 0) {
+        cm->cm_frames[cm->bd_head[order]].cf_prev = p_page;
+    }
+    cm->bd_head[order] = p_page;
 }
 
+static
 void
-cm_decref(p_page_t p_page)
+buddy_remove(p_page_t p_page, unsigned order)
 {
-    KASSERT(in_all_memory(p_page));
+    KASSERT(buddy_isfree(p_page, order));
 
-    size_t curref = GET_REF(cm->cm_entries[p_page]);
-    curref--;
-    SET_REF(cm->cm_entries[p_page], curref);
+    size_t bit = p_page >> order;
+    cm->bd_map[order][bit / 32] &= ~(1U << (bit % 32));
+    if (cm->cm_frames[p_page].cf_prev != 0) {
+        cm->cm_frames[cm->cm_frames[p_page].cf_prev].cf_next = cm->cm_frames[p_page].cf_next;
+    } else {
+        cm->bd_head[order] = cm->cm_frames[p_page].cf_next;
+    }
+    if (cm->cm_frames[p_page].cf_next != 0) {
+        cm->cm_frames[cm->cm_frames[p_page].cf_next].cf_prev = cm->cm_frames[p_page].cf_prev;
+    }
 }
 
+/*
+Gives a block of 2^order page frames back to the buddy allocator, merging it with its buddy
+for as long as the buddy is free.
+*/
+static
 void
-set_pid8(p_page_t p_page, pid_t pid, uint32_t pos)
+buddy_free(p_page_t p_page, unsigned order)
 {
-    KASSERT(pos < NUM_CM_PIDS);
-    KASSERT(in_all_memory(p_page));
-
-    pid_t pid_to_add = 0;
+    while (order + 1 < BUDDY_ORDERS) {
+        p_page_t buddy = p_page ^ (1U << order);
+        if (!in_ram(buddy) || !buddy_isfree(buddy, order)) {
+            break;
+        }
 
-    if (pid < MAX_CM_PID) {
-        pid_to_add = pid;
+        buddy_remove(buddy, order);
+        p_page = p_page & buddy;
+        order++;
     }
 
-    cm->pids8_entries[p_page] = cm->pids8_entries[p_page] & (~(0x000000ff << pos*8));
-    cm->pids8_entries[p_page] = cm->pids8_entries[p_page] | (pid_to_add << pos*8);
-}
-
-pid_t
-get_pid8(p_page_t p_page, uint32_t pos)
-{
-    KASSERT(pos < NUM_CM_PIDS);
-    KASSERT(in_all_memory(p_page));
-
-    return (cm->pids8_entries[p_page] & (0x000000ff << pos*8)) >> pos*8;
+    buddy_push(p_page, order);
 }
 
+/*
+Gives the frames of the zero pool back to the buddy allocator.
+*/
+static
 void
-add_pid8(p_page_t p_page, pid_t pid)
+zero_pool_drain()
 {
-    KASSERT(in_all_memory(p_page));
+    KASSERT(spinlock_do_i_hold(&cm_spinlock));
 
-    if (!(pid < MAX_CM_PID)) {
-        return;
+    while (zero_pool != 0) {
+        p_page_t p_page = zero_pool;
+        zero_pool = cm->cm_frames[p_page].cf_next;
+        buddy_free(p_page, 0);
     }
+    zero_pool_count = 0;
+}
 
-    for (uint32_t pos = 0; pos < NUM_CM_PIDS; pos++) {
-        if (get_pid8(p_page, pos) == 0) {
-            set_pid8(p_page, pid, pos);
-            return;
-        }
+/*
+Smallest order of a buddy block of at least npages frames.
+*/
+static
+unsigned
+npages_order(size_t npages)
+{
+    unsigned order = 0;
+    while ((1U << order) < npages) {
+        order++;
     }
 
-    return;
+    return order;
 }
 
-void
-rem_pid8(p_page_t p_page, pid_t pid)
+/*
+Takes npages contiguous free page frames out of the buddy allocator, and returns the first in
+start. The block is split from the smallest free block large enough, and the pages past npages
+are given back. The caller must mark the frames used before releasing the cm_spinlock.
+*/
+static
+int
+find_free(size_t npages, p_page_t *start)
 {
-    KASSERT(in_all_memory(p_page));
+    KASSERT(spinlock_do_i_hold(&cm_spinlock));
+    KASSERT(npages > 0);
 
-    if (!(pid < MAX_CM_PID)) {
-        return;
+    unsigned order = npages_order(npages);
+    unsigned k = order;
+    while (k < BUDDY_ORDERS && cm->bd_head[k] == 0) {
+        k++;
     }
 
-    uint32_t pos = 0;
-    while (pos < NUM_CM_PIDS) {
-        pid_t cur_pid = get_pid8(p_page, pos);
-        if (cur_pid == pid) {
-            set_pid8(p_page, 0, pos);
-            break;
+    /* The zero pool is only kept while there are other free frames. */
+    if (k >= BUDDY_ORDERS && zero_pool_count > 0) {
+        zero_pool_drain();
+
+        k = order;
+        while (k < BUDDY_ORDERS && cm->bd_head[k] == 0) {
+            k++;
         }
-        pos++;
     }
 
-    while (pos < NUM_CM_PIDS - 1) {
-        set_pid8(p_page, get_pid8(p_page, pos + 1), pos);
-        set_pid8(p_page, 0, pos + 1);
-        pos++;
+    if (k >= BUDDY_ORDERS) {
+        return ENOMEM;
     }
 
-    return;
-}
-////////////////////////////////////////////////////////////////////////////////////
-
-void
-vm_bootstrap()
-{
-    paddr_t cm_paddr = ram_stealmem(COREMAP_PAGES);
-    KASSERT(cm_paddr != 0);
-
-    cm = (struct coremap *) PADDR_TO_KVADDR(cm_paddr);
-
-    KASSERT(ram_stealmem(0) % PAGE_SIZE == 0);
-    first_alloc_page = ADDR_TO_PAGE(ram_stealmem(0));
-    swapclock = first_alloc_page;
-    last_page = ADDR_TO_PAGE(ram_getsize());
-
-    size_t pages_used = first_alloc_page;
-    for (p_page_t p_page = 0; p_page < pages_used; p_page++) {
-        kalloc_ppage(p_page);
-    }
+    p_page_t block = cm->bd_head[k];
+    buddy_remove(block, k);
 
-    global_lock = lock_create("global_lock");
-    if (global_lock == NULL) {
-        panic("couldn't initialize global lock\n");
+    while (k > order) {
+        k--;
+        buddy_push(block + (1U << k), k);
     }
 
-    global_cv = cv_create("global_cv");
-    if (global_cv == NULL) {
-        panic("couldn't initialize global cv\n");
+    /* The tail past npages goes back as the largest aligned blocks it is made of. */
+    size_t offset = npages;
+    while (offset < (1U << order)) {
+        unsigned tail_order = lowest_bit(offset);
+        buddy_push(block + offset, tail_order);
+        offset += 1U << tail_order;
     }
-}
 
-void
-swap_bootstrap()
-{
-    int ret;
-    char dir[sizeof(swap_dir)];
-    strcpy(dir, swap_dir);
+    *start = block;
 
-    ret = vfs_open(dir, O_RDWR, 0, &swap_disk);
-    if (ret) {
-        panic("swap disk wasn't able to open\n");
+    /* Start reclaiming in the background before frames run out. */
+    if (daemon_wchan != NULL && last_page - cm_counter - npages < free_low_pages) {
+        wchan_wakeone(daemon_wchan, &cm_spinlock);
     }
 
-    first_page_swap = last_page;
-    last_page_swap = 0x400;
-
-    KASSERT(kproc != NULL);
-
-    if (SWAP_ON)
-    thread_fork("Paging Daemon", kproc, paging_daemon, NULL, 0);
+    return 0;
 }
 
-vaddr_t
-alloc_kpages(size_t npages)
+/*
+Takes a free page frame, from the zero pool if it has one. Sets zeroed if the frame is known to
+be zeroed; otherwise the caller has to zero it.
+*/
+static
+int
+find_free_zeroed(p_page_t *p_page, bool *zeroed)
 {
-    int result;
-    bool acquired = spinlock_do_i_hold(&cm_spinlock);
+    KASSERT(spinlock_do_i_hold(&cm_spinlock));
 
-    if (!acquired) {
-        spinlock_acquire(&cm_spinlock);
-    }
+    if (zero_pool != 0) {
+        *p_page = zero_pool;
+        zero_pool = cm->cm_frames[*p_page].cf_next;
+        zero_pool_count--;
+        *zeroed = true;
 
-    p_page_t start = first_alloc_page;
-    result = find_free(npages, &start);
-    if (result) {
-        if (!acquired) {
-            spinlock_release(&cm_spinlock);
+        if (daemon_wchan != NULL && last_page - cm_counter - 1 < free_low_pages) {
+            wchan_wakeone(daemon_wchan, &cm_spinlock);
         }
-        return 0;
-    }
-
-    for (p_page_t p_page = start; p_page < start + npages; p_page++) {
-        kalloc_ppage(p_page);
-    }
 
-    cm->cm_entries[start + npages - 1] = cm->cm_entries[start + npages - 1] | KMALLOC_END;
-
-    if (!acquired) {
-        spinlock_release(&cm_spinlock);
+        return 0;
     }
 
-    return PADDR_TO_KVADDR(PAGE_TO_ADDR(start));
+    *zeroed = false;
+    return find_free(1, p_page);
 }
 
+/*
+Frees a page frame. The busy bit is kept, so a frame that is being evicted is not reallocated
+until the evicting thread notices it was freed.
+*/
 void
-free_kpages(vaddr_t addr)
+free_ppage(p_page_t p_page)
 {
-    p_page_t curr = ADDR_TO_PAGE(KVADDR_TO_PADDR(addr));
-    bool end;
-    bool acquired = spinlock_do_i_hold(&cm_spinlock);
+    KASSERT(in_ram(p_page));
+    KASSERT(spinlock_do_i_hold(&cm_spinlock));
 
-    if (!acquired) {
-        spinlock_acquire(&cm_spinlock);
+    if (swapmap.sm_cached != NULL && swapmap.sm_cached[p_page] != 0) {
+        free_ppage_swap(swapmap.sm_cached[p_page]);
+        swapmap.sm_cached[p_page] = 0;
     }
 
-    while (p_page_used(curr)) {
-        end = cm->cm_entries[curr] & KMALLOC_END;
-        free_ppage(curr);
-        if (end) {
-            if (!acquired) {
-                spinlock_release(&cm_spinlock);
-            }
-            return;
-        }
-        curr++;
-    }
+    KASSERT(cm->cm_frames[p_page].cf_pins == 0);
 
-    if (!acquired) {
-        spinlock_release(&cm_spinlock);
-    }
-}
+    cm->cm_frames[p_page].cf_entry = cm->cm_frames[p_page].cf_entry & PP_BUSY;
+    cm->cm_frames[p_page].cf_rmap = NULL;
+    cm->cm_frames[p_page].cf_referenced = 0;
+    cm->cm_frames[p_page].cf_age = 0;
+    cm_counter--;
 
-//////////////////////////////////////////////////////////////////////////////////////////
+    if (!(cm->cm_frames[p_page].cf_entry & PP_BUSY)) {
+        buddy_free(p_page, 0);
+    }
 
-void
-vm_tlbshootdown_all()
-{
-    for (int i = 0; i < NUM_TLB; i++){
-        tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+    if (free_waiters > 0 && enough_free()) {
+        wchan_wakeall(free_wchan, &cm_spinlock);
     }
 }
 
-
+/*
+Clears the busy bit of a page frame, and gives the frame back to the buddy allocator if it was
+freed while it was busy.
+*/
+static
 void
-vm_tlbshootdown(const struct tlbshootdown *tlbsd)
+cm_unbusy(p_page_t p_page)
 {
-    vaddr_t v_page = tlbsd->v_page_num;
-    pid_t pid = tlbsd->pid;
-    uint32_t entryhi = 0 | (v_page & PAGE_FRAME) | pid << 6;
-    int32_t index = tlb_probe(entryhi, 0);
+    KASSERT(spinlock_do_i_hold(&cm_spinlock));
 
-    if (index > -1) {
-        tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+    cm->cm_frames[p_page].cf_entry = cm->cm_frames[p_page].cf_entry & (~PP_BUSY);
+    if (!(cm->cm_frames[p_page].cf_entry & PP_USED)) {
+        buddy_free(p_page, 0);
     }
 }
 
-/////////////////////////////////////////////////////////////////////////////////////////////
-
 /*
-Swapable pages are user data pages and l1 page tables.
+Finds the first free swap slot at or after slot from.
 */
 static
 bool
-entry_swappable(p_page_t p_page)
+swapmap_find(size_t from, size_t *slot)
 {
-    if (!p_page_used(p_page)) {
-        return false;
-    }
+    size_t nwords = DIVROUNDUP(swapmap.sm_nslots, 32);
+    size_t nsummary = DIVROUNDUP(nwords, 32);
 
-    size_t ref = cm_getref(p_page);
-    if (ref > NUM_CM_PIDS) {
+    size_t word = from / 32;
+    if (word >= nwords) {
         return false;
     }
 
-    if (ref == 0) {
-        return false;
+    uint32_t bits = swapmap.sm_free[word] & (~0U << (from % 32));
+    if (bits != 0) {
+        *slot = word * 32 + lowest_bit(bits);
+        return true;
     }
 
-    for (uint32_t pos = 0; pos < ref; pos++) {
-        pid_t pid = get_pid8(p_page, pos);
-        if (pid == 0) {
-            return false;
+    word++;
+    for (size_t s = word / 32; s < nsummary; s++) {
+        uint32_t summary = swapmap.sm_summary[s];
+        if (s == word / 32) {
+            summary = summary & (~0U << (word % 32));
+        }
+
+        if (summary != 0) {
+            size_t free_word = s * 32 + lowest_bit(summary);
+            *slot = free_word * 32 + lowest_bit(swapmap.sm_free[free_word]);
+            return true;
         }
     }
 
-    return true;
+    return false;
 }
 
 static
-bool
-entry_recently_used(p_page_t p_page)
+void
+swapmap_setfree(size_t slot, bool free)
 {
-    KASSERT(in_ram(p_page));
+    size_t word = slot / 32;
+    uint32_t bit = 1U << (slot % 32);
 
-    if (cm->cm_entries[p_page] & REF_BIT) {
-        return true;
+    if (free) {
+        swapmap.sm_free[word] = swapmap.sm_free[word] | bit;
+        swapmap.sm_summary[word / 32] = swapmap.sm_summary[word / 32] | (1U << (word % 32));
+    } else {
+        swapmap.sm_free[word] = swapmap.sm_free[word] & (~bit);
+        if (swapmap.sm_free[word] == 0) {
+            swapmap.sm_summary[word / 32] = swapmap.sm_summary[word / 32] & (~(1U << (word % 32)));
+        }
     }
+}
 
-    int spl = splhigh();
+/*
+Takes back the slot of a swap cache copy, for when every slot is in use. Copies of dirty frames
+go first, since they are stale anyway. Frames being evicted keep their copies.
+*/
+static
+bool
+swapcache_reclaim(size_t *slot_ret)
+{
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t slot = 0; slot < swapmap.sm_nslots; slot++) {
+            cm_entry_t entry = swapmap.sm_entries[slot];
+            if (!(entry & SWAP_CACHED)) {
+                continue;
+            }
 
-    uint32_t entryhi;
-    uint32_t entrylo;
-    uint32_t index;
+            p_page_t frame = entry & VP_MASK;
+            if (cm->cm_frames[frame].cf_entry & PP_BUSY) {
+                continue;
+            }
+
+            if (pass == 0 && !(cm->cm_frames[frame].cf_entry & DIRTY)) {
+                continue;
+            }
 
-    for (index = 0; index < NUM_TLB; index++) {
-    tlb_read(&entryhi, &entrylo, index);
-        if (p_page == TLBADDR_TO_PAGE(entrylo & TLBLO_PPAGE)) {
-            splx(spl);
+            swapmap.sm_cached[frame] = 0;
+            cm->cm_frames[frame].cf_entry = cm->cm_frames[frame].cf_entry | DIRTY;
+            *slot_ret = slot;
             return true;
         }
     }
 
-    splx(spl);
-
     return false;
 }
 
+/*
+Takes a free swap slot, searching next fit from where the last search left off.
+*/
 static
 int
 find_free_swap(p_page_t *p_page)
 {
-    p_page_t page;
-    for (page = first_page_swap; page < last_page_swap; page++) {
-        if (!p_page_used(page)) {
-            *p_page = page;
-            return 0;
-        }
+    KASSERT(spinlock_do_i_hold(&cm_spinlock));
+
+    size_t slot;
+    if (swapmap_find(swapmap.sm_hint, &slot) || swapmap_find(0, &slot)) {
+        swapmap_setfree(slot, false);
+        swapmap.sm_hint = (slot + 1) % swapmap.sm_nslots;
+        swap_counter++;
+    } else if (!swapcache_reclaim(&slot)) {
+        return SWAPNOMEM;
     }
 
-    return SWAPNOMEM;
-}
+    swapmap.sm_entries[slot] = PP_USED;
+    *p_page = first_page_swap + slot;
 
-static
-off_t
-swap_offset(p_page_t p_page)
+    return 0;
+}
+
+void
+free_ppage_swap(p_page_t p_page)
 {
     KASSERT(in_swap(p_page));
-    return PAGE_TO_ADDR(p_page - first_page_swap);
+
+    size_t slot = p_page - first_page_swap;
+
+    zswap_drop(p_page);
+    swapmap.sm_entries[slot] = 0;
+    swapmap.sm_rmap[slot] = NULL;
+    swapmap_setfree(slot, true);
+    swap_counter--;
 }
 
+/*
+Takes an rmap entry from the pool, adding a page of entries to the pool if it is empty.
+*/
 static
-struct uio *
-swap_evict_uio(p_page_t p_page)
+struct rmap *
+rmap_alloc(void)
 {
-    KASSERT(in_swap(p_page));
+    KASSERT(spinlock_do_i_hold(&cm_spinlock));
 
-    struct iovec *iov = kmalloc(sizeof(struct iovec));
-    if (iov == NULL) {
-        return NULL;
-    }
+    if (rmap_pool == NULL) {
+        vaddr_t kvaddr = alloc_kpages(1);
+        if (kvaddr == 0) {
+            return NULL;
+        }
 
-    struct uio *u = kmalloc(sizeof(struct uio));
-    if (u == NULL) {
-        kfree(iov);
-        return NULL;
+        struct rmap *entries = (struct rmap *) kvaddr;
+        for (size_t i = 0; i < PAGE_SIZE / sizeof(struct rmap); i++) {
+            entries[i].rm_next = rmap_pool;
+            rmap_pool = &entries[i];
+        }
     }
 
-    void *kbase = (void *) PAGE_TO_ADDR(PPAGE_TO_KVPAGE(swapclock));
-    uio_kinit(iov, u, kbase, PAGE_SIZE, swap_offset(p_page), UIO_WRITE);
+    struct rmap *rm = rmap_pool;
+    rmap_pool = rm->rm_next;
 
-    return u;
+    return rm;
 }
 
 static
-struct uio *
-swap_load_uio(p_page_t p_page, p_page_t old_p_page)
+void
+rmap_free(struct rmap *rm)
 {
-    KASSERT(in_ram(p_page));
+    KASSERT(spinlock_do_i_hold(&cm_spinlock));
 
-    struct iovec *iov = kmalloc(sizeof(struct iovec));
-    if (iov == NULL) {
-        return NULL;
-    }
+    rm->rm_as = NULL;
+    rm->rm_next = rmap_pool;
+    rmap_pool = rm;
+}
 
-    struct uio *u = kmalloc(sizeof(struct uio));
-    if (u == NULL) {
-        kfree(iov);
-        return NULL;
+static
+size_t
+rmap_count(p_page_t p_page)
+{
+    size_t count = 0;
+    for (struct rmap *rm = *cm_rmap(p_page); rm != NULL; rm = rm->rm_next) {
+        count++;
     }
 
-    void *kbase = (void *) PAGE_TO_ADDR(PPAGE_TO_KVPAGE(p_page));
-    uio_kinit(iov, u, kbase, PAGE_SIZE, swap_offset(old_p_page), UIO_READ);
-
-    return u;
+    return count;
 }
 
-
+/*
+Counts a reference of an address space to a user page, as resident or swapped out depending on
+where the page is; see vm.h. The cm_spinlock must be held.
+*/
 static
 void
-swap_uio_cleanup(struct uio *u)
+rss_count(p_page_t p_page, struct addrspace *as, bool add)
+{
+    if ((*cm_entry(p_page) & VP_MASK) >= 0x00080000) {
+        return;
+    }
+
+    if (in_swap(p_page)) {
+        as->as_swap_pages = add ? as->as_swap_pages + 1 : as->as_swap_pages - 1;
+        return;
+    }
+
+    as->as_rss_pages = add ? as->as_rss_pages + 1 : as->as_rss_pages - 1;
+    if (as->as_rss_pages > as->as_rss_max) {
+        as->as_rss_max = as->as_rss_pages;
+    }
+}
+
+size_t
+cm_getref(p_page_t p_page)
 {
-    KASSERT(u != NULL);
-    KASSERT(u->uio_iov != NULL);
+    KASSERT(in_all_memory(p_page));
 
-    kfree(u->uio_iov);
-    kfree(u);
+    if (p_page == zero_page) {
+        return REF_MAX;
+    }
+
+    size_t ref = GET_REF(*cm_entry(p_page));
+    if (ref == REF_MAX) {
+        return rmap_count(p_page);
+    }
+
+    return ref;
 }
 
 /*
-Updates the location of a page in the page tables of other processes.
+Adds a reference to the page from the address space as, where it is mapped at vaddr. The
+cm_spinlock must be held.
 */
-static
 int
-update_pt_entries(p_page_t swap_to_page, p_page_t old_page)
+cm_addref(p_page_t p_page, struct addrspace *as, vaddr_t vaddr)
 {
+    KASSERT(in_all_memory(p_page));
     KASSERT(spinlock_do_i_hold(&cm_spinlock));
 
-    size_t refs = cm_getref(swap_to_page);
-    v_page_t v_page = cm->cm_entries[swap_to_page] & VP_MASK;
-    bool is_l1 = v_page >= 0x00080000;
-    int result;
+    if (p_page == zero_page) {
+        return 0;
+    }
 
-    for (uint32_t pos = 0; pos < refs; pos++) {
-        pid_t pid = get_pid8(swap_to_page, pos);
-        KASSERT(pid != 0);
+    struct rmap *rm = rmap_alloc();
+    if (rm == NULL) {
+        return ENOMEM;
+    }
 
-        spinlock_release(&cm_spinlock);
+    struct rmap **head = cm_rmap(p_page);
+    rm->rm_as = as;
+    rm->rm_vaddr = vaddr;
+    rm->rm_next = *head;
+    *head = rm;
 
-        struct proc *proc = get_pid(pid);
-        KASSERT(proc != NULL);
+    cm_entry_t *entry = cm_entry(p_page);
+    size_t curref = GET_REF(*entry);
+    if (curref < REF_MAX) {
+        SET_REF(*entry, curref + 1);
+    }
 
-        spinlock_acquire(&cm_spinlock);
+    rss_count(p_page, as, true);
 
-        struct addrspace *as = proc->p_addrspace;
-        KASSERT(as != NULL);
+    return 0;
+}
 
-        struct l2_pt *l2_pt = as->l2_pt;
+/*
+Drops the reference to the page from the address space as at vaddr. The cm_spinlock must be
+held. The page is not freed, even if this was its last reference.
+*/
+void
+cm_remref(p_page_t p_page, struct addrspace *as, vaddr_t vaddr)
+{
+    KASSERT(in_all_memory(p_page));
+    KASSERT(spinlock_do_i_hold(&cm_spinlock));
 
-        if (is_l1) {
-            for (v_page_l2_t v_l2 = 0; v_l2 < NUM_L2PT_ENTRIES; v_l2++) {
-                p_page_t cur_p_page = l2_pt->l2_entries[v_l2] & PAGE_MASK;
-                if (cur_p_page == old_page) {
-                    l2_pt->l2_entries[v_l2] = l2_pt->l2_entries[v_l2] & (~PAGE_MASK);
-                    l2_pt->l2_entries[v_l2] = l2_pt->l2_entries[v_l2] | swap_to_page;
-                    break;
-                }
-            }
-        } else {
-            v_page_l2_t v_l2 = L2_PNUM(PAGE_TO_ADDR(v_page));
-            v_page_l1_t v_l1 = L1_PNUM(PAGE_TO_ADDR(v_page));
+    if (p_page == zero_page) {
+        return;
+    }
 
-            l2_entry_t l2_entry = l2_pt->l2_entries[v_l2];
+    struct rmap **link = cm_rmap(p_page);
+    while (*link != NULL && ((*link)->rm_as != as || (*link)->rm_vaddr != vaddr)) {
+        link = &(*link)->rm_next;
+    }
 
-            KASSERT(l2_entry & ENTRY_VALID);
+    KASSERT(*link != NULL);
+    struct rmap *rm = *link;
+    *link = rm->rm_next;
+    rmap_free(rm);
 
-            p_page_t p_page = l2_entry & PAGE_MASK;
+    rss_count(p_page, as, false);
 
-            if (in_swap(p_page)) {
-                result = swap_in_data(&p_page);
-                if (result) {
-                    return result;
-                }
-            }
+    cm_entry_t *entry = cm_entry(p_page);
+    size_t curref = GET_REF(*entry);
+    if (curref < REF_MAX) {
+        SET_REF(*entry, curref - 1);
+    } else {
+        size_t count = rmap_count(p_page);
+        SET_REF(*entry, count < REF_MAX ? count : REF_MAX);
+    }
+}
 
-            struct l1_pt *l1_pt = (struct l1_pt *) PADDR_TO_KVADDR(PAGE_TO_ADDR(p_page));
+void
+cm_pin(p_page_t p_page)
+{
+    KASSERT(in_ram(p_page));
 
-            l1_pt->l1_entries[v_l1] = l1_pt->l1_entries[v_l1] & (~PAGE_MASK);
-            l1_pt->l1_entries[v_l1] = l1_pt->l1_entries[v_l1] | swap_to_page;
-        }
-    }
-    return 0;
+    cm->cm_frames[p_page].cf_entry = cm->cm_frames[p_page].cf_entry | PP_PINNED;
+}
+
+void
+cm_unpin(p_page_t p_page)
+{
+    KASSERT(in_ram(p_page));
+
+    cm->cm_frames[p_page].cf_entry = cm->cm_frames[p_page].cf_entry & (~PP_PINNED);
 }
 
+/*
+Adds a pin of a locked l1 entry to a page frame. The zero page is pinned for good, so its pins
+are not counted.
+*/
 static
 void
-swapclock_tick()
+cm_mlock(p_page_t p_page)
 {
-    KASSERT(in_ram(swapclock));
+    KASSERT(in_ram(p_page));
+    KASSERT(spinlock_do_i_hold(&cm_spinlock));
 
-    if (swapclock == last_page - 1) {
-        swapclock = first_alloc_page;
-    } else {
-        swapclock++;
+    if (p_page == zero_page) {
+        return;
+    }
+
+    if (cm->cm_frames[p_page].cf_pins == 0) {
+        cm_pin(p_page);
+        mlocked_pages++;
     }
+    cm->cm_frames[p_page].cf_pins++;
 }
 
-int
-swap_out()
+/*
+Drops the pin of a locked l1 entry from a page frame, which can be evicted again once the last
+one is gone.
+*/
+void
+cm_munlock(p_page_t p_page)
 {
-    size_t free_pages = last_page - cm_counter;
+    KASSERT(in_ram(p_page));
+    KASSERT(spinlock_do_i_hold(&cm_spinlock));
 
-    if (free_pages >= NUM_FREE_PPAGES) {
-        return ENOUGHFREE;
+    if (p_page == zero_page) {
+        return;
     }
 
-    p_page_t first_clock = swapclock;
-    int cycles = 0;
-    int result;
+    KASSERT(cm->cm_frames[p_page].cf_pins > 0);
+    cm->cm_frames[p_page].cf_pins--;
+    if (cm->cm_frames[p_page].cf_pins == 0) {
+        cm_unpin(p_page);
+        mlocked_pages--;
+    }
+}
 
-    spinlock_acquire(&cm_spinlock);
+////////////////////////////////////////////////////////////////////////////////////
 
-    /* We iterate for 2 cycles, since after the first cycle, the reference bits are cleared */
-    while (cycles < 2) {
-        if (entry_swappable(swapclock) && !entry_recently_used(swapclock)) {
-            p_page_t swap_to_page;
+void
+vm_bootstrap()
+{
+    /* Layout the TLB refill in exception-mips1.S relies on. */
+    COMPILE_ASSERT(sizeof(struct cm_frame) == 24);
+    COMPILE_ASSERT(offsetof(struct cm_frame, cf_entry) == 0);
+    COMPILE_ASSERT(offsetof(struct cm_frame, cf_referenced) == 16);
+    COMPILE_ASSERT(offsetof(struct coremap, cm_frames) == 0);
 
-            result = find_free_swap(&swap_to_page);
-            if (result) {
-                spinlock_release(&cm_spinlock);
-                return result;
-            }
+    /* The coremap, its frames and the buddy bitmaps are sized from RAM and stolen together. */
+    last_page = ADDR_TO_PAGE(ram_getsize());
+    KASSERT(last_page <= (1U << (BUDDY_ORDERS - 1)));
+    KASSERT(PPAGE_TO_KVPAGE(last_page) <= VP_FILE_BASE);
+
+    size_t map_words[BUDDY_ORDERS];
+    size_t cm_size = sizeof(struct coremap) + last_page * sizeof(struct cm_frame);
+    for (unsigned order = 0; order < BUDDY_ORDERS; order++) {
+        map_words[order] = DIVROUNDUP((last_page >> order) + 1, 32);
+        cm_size += map_words[order] * sizeof(uint32_t);
+    }
 
-            cm->cm_entries[swap_to_page] = cm->cm_entries[swapclock];
-            cm->pids8_entries[swap_to_page] = cm->pids8_entries[swapclock];
+    paddr_t cm_paddr = ram_stealmem(DIVROUNDUP(cm_size, PAGE_SIZE));
+    if (cm_paddr == 0) {
+        panic("couldn't allocate the coremap\n");
+    }
 
-            struct uio *u = swap_evict_uio(swap_to_page);
-            if (u == NULL) {
-                spinlock_release(&cm_spinlock);
-                return ENOMEM;
-            }
+    cm = (struct coremap *) PADDR_TO_KVADDR(cm_paddr);
+    bzero(cm, cm_size);
 
-            spinlock_release(&cm_spinlock);
+    cm->cm_frames = (struct cm_frame *) (cm + 1);
+    uint32_t *map = (uint32_t *) (cm->cm_frames + last_page);
+    for (unsigned order = 0; order < BUDDY_ORDERS; order++) {
+        cm->bd_map[order] = map;
+        map += map_words[order];
+    }
+
+    KASSERT(ram_stealmem(0) % PAGE_SIZE == 0);
+    first_alloc_page = ADDR_TO_PAGE(ram_stealmem(0));
+    swapclock = first_alloc_page;
 
-            VOP_WRITE(swap_disk, u);
+    size_t pages_used = first_alloc_page;
+    for (p_page_t p_page = 0; p_page < pages_used; p_page++) {
+        kalloc_ppage(p_page);
+    }
 
-            spinlock_acquire(&cm_spinlock);
-            update_pt_entries(swap_to_page, swapclock);
-            free_ppage(swapclock);
-            spinlock_release(&cm_spinlock);
+    for (p_page_t p_page = first_alloc_page; p_page < last_page; p_page++) {
+        buddy_free(p_page, 0);
+    }
 
-            swap_uio_cleanup(u);
-            swapclock_tick();
-            return 0;
-        }
+    vaddr_t zero_kvaddr = alloc_kpages(1);
+    if (zero_kvaddr == 0) {
+        panic("couldn't allocate the zero page\n");
+    }
 
-        cm->cm_entries[swapclock] = cm->cm_entries[swapclock] & (~REF_BIT);
+    bzero((void *) zero_kvaddr, PAGE_SIZE);
+    zero_page = ADDR_TO_PAGE(KVADDR_TO_PADDR(zero_kvaddr));
+    cm_pin(zero_page);
 
-        swapclock_tick();
-        if (swapclock == first_clock) {
-            cycles++;
-        }
+    global_lock = lock_create("global_lock");
+    if (global_lock == NULL) {
+        panic("couldn't initialize global lock\n");
     }
 
-    spinlock_release(&cm_spinlock);
+    daemon_wchan = wchan_create("paging daemon");
+    free_wchan = wchan_create("free frames");
+    if (daemon_wchan == NULL || free_wchan == NULL) {
+        panic("couldn't initialize paging wait channels\n");
+    }
+
+    free_min_pages = (last_page - first_alloc_page) / FREE_MIN_DIV;
+    if (free_min_pages < FREE_MIN_FLOOR) {
+        free_min_pages = FREE_MIN_FLOOR;
+    }
+    free_low_pages = 2 * free_min_pages;
+    free_high_pages = 3 * free_min_pages;
 
-    return NOSWAPPABLE;
+    mlock_max_pages = (last_page - first_alloc_page) / MLOCK_DIV;
+
+    zero_pool_target = (last_page - first_alloc_page) / ZERO_POOL_DIV;
+    if (zero_pool_target > ZERO_POOL_MAX) {
+        zero_pool_target = ZERO_POOL_MAX;
+    }
+
+    pagecache_bootstrap();
 }
 
-int
-swap_in(p_page_t p_page, p_page_t old_p_page)
+void
+swap_bootstrap()
 {
-    KASSERT(cm->cm_entries[p_page] & PP_USED);
-    KASSERT(cm->cm_entries[old_p_page] & PP_USED);
-    KASSERT(in_ram(p_page));
-    KASSERT(in_swap(old_p_page));
-    KASSERT(spinlock_do_i_hold(&cm_spinlock));
+    int ret;
+    char dir[sizeof(swap_dir)];
+    strcpy(dir, swap_dir);
 
-    struct uio *u = swap_load_uio(p_page, old_p_page);
-    if (u == NULL) {
-        return ENOMEM;
+    ret = vfs_open(dir, O_RDWR, 0, &swap_disk);
+    if (ret) {
+        panic("swap disk wasn't able to open\n");
     }
 
-    spinlock_release(&cm_spinlock);
+    struct stat st;
+    ret = VOP_STAT(swap_disk, &st);
+    if (ret) {
+        panic("couldn't get the size of the swap disk\n");
+    }
+
+    /*
+    Swap slots are numbered after the page frames of RAM and must fit in the page number of a
+    page table entry, and their metadata must leave most of RAM to everything else.
+    */
+    size_t nslots = st.st_size / PAGE_SIZE;
+    size_t max_slots = (size_t) PAGE_MASK + 1 - last_page;
+    size_t meta_slots = PAGE_TO_ADDR(last_page) / SWAP_META_RAM_DIV
+                        / (sizeof(cm_entry_t) + sizeof(struct rmap *) + sizeof(uint32_t) + 1);
+    if (nslots > max_slots) {
+        nslots = max_slots;
+    }
+    if (nslots > meta_slots) {
+        nslots = meta_slots;
+    }
+
+    size_t nwords = DIVROUNDUP(nslots, 32);
+    size_t nsummary = DIVROUNDUP(nwords, 32);
+
+    swapmap.sm_nslots = nslots;
+    swapmap.sm_hint = 0;
+    swapmap.sm_entries = kmalloc(nslots * sizeof(cm_entry_t));
+    swapmap.sm_rmap = kmalloc(nslots * sizeof(struct rmap *));
+    swapmap.sm_free = kmalloc(nwords * sizeof(uint32_t));
+    swapmap.sm_summary = kmalloc(nsummary * sizeof(uint32_t));
+    swapmap.sm_cached = kmalloc(last_page * sizeof(p_page_t));
+    if (swapmap.sm_entries == NULL || swapmap.sm_rmap == NULL ||
+        swapmap.sm_free == NULL || swapmap.sm_summary == NULL || swapmap.sm_cached == NULL) {
+        panic("couldn't allocate the swap map\n");
+    }
 
-    VOP_READ(swap_disk, u);
+    bzero(swapmap.sm_entries, nslots * sizeof(cm_entry_t));
+    bzero(swapmap.sm_rmap, nslots * sizeof(struct rmap *));
+    bzero(swapmap.sm_free, nwords * sizeof(uint32_t));
+    bzero(swapmap.sm_summary, nsummary * sizeof(uint32_t));
+    bzero(swapmap.sm_cached, last_page * sizeof(p_page_t));
+    for (size_t slot = 0; slot < nslots; slot++) {
+        swapmap_setfree(slot, true);
+    }
 
     spinlock_acquire(&cm_spinlock);
+    first_page_swap = last_page;
+    last_page_swap = last_page + nslots;
+    spinlock_release(&cm_spinlock);
 
-    swap_uio_cleanup(u);
-    return 0;
+    zswap_bootstrap(nslots);
+
+    KASSERT(kproc != NULL);
+
+    if (SWAP_ON)
+    thread_fork("Paging Daemon", kproc, paging_daemon, NULL, 0);
+
+    ksm_bootstrap();
 }
 
-int
-swap_in_data(p_page_t *p_page_ret)
+/*
+Allocates npages contiguous kernel pages. When free frames are too scattered for a block of
+several pages, a caller that may sleep compacts memory and tries again; any other caller fails,
+and leaves the compaction to the paging daemon.
+*/
+vaddr_t
+alloc_kpages(size_t npages)
 {
-    p_page_t p_page = *p_page_ret;
-    KASSERT(in_swap(p_page));
-    KASSERT(entry_swappable(p_page));
-    KASSERT(spinlock_do_i_hold(&cm_spinlock));
-
     int result;
+    bool acquired = spinlock_do_i_hold(&cm_spinlock);
+    bool can_sleep = !acquired && global_lock != NULL && curthread != NULL &&
+                     !curthread->t_in_interrupt && curcpu->c_spinlocks == 0 &&
+                     curthread->t_curspl == 0;
+
+    if (!acquired) {
+        spinlock_acquire(&cm_spinlock);
+    }
+
+    p_page_t start;
+    result = find_free(npages, &start);
+    if (result && npages > 1) {
+        unsigned order = npages_order(npages);
+        if (order > compact_wanted) {
+            compact_wanted = order;
+        }
+
+        if (can_sleep) {
+            spinlock_release(&cm_spinlock);
+            vm_compact(order);
+            spinlock_acquire(&cm_spinlock);
+            result = find_free(npages, &start);
+        } else if (daemon_wchan != NULL) {
+            wchan_wakeone(daemon_wchan, &cm_spinlock);
+        }
+    }
 
-    p_page_t new_page = first_alloc_page;
-    result = find_free(1, &new_page);
     if (result) {
-        return result;
+        if (!acquired) {
+            spinlock_release(&cm_spinlock);
+        }
+        return 0;
     }
 
-    cm_counter++;
-    cm->cm_entries[new_page] = cm->cm_entries[p_page];
-    cm->pids8_entries[new_page] = cm->pids8_entries[p_page];
-    swap_in(new_page, p_page);
-    update_pt_entries(new_page, p_page);
-    free_ppage_swap(p_page);
+    for (p_page_t p_page = start; p_page < start + npages; p_page++) {
+        kalloc_ppage(p_page);
+    }
 
-    *p_page_ret = new_page;
+    cm->cm_frames[start + npages - 1].cf_entry = cm->cm_frames[start + npages - 1].cf_entry | KMALLOC_END;
 
-    return 0;
-}
+    if (!acquired) {
+        spinlock_release(&cm_spinlock);
+    }
 
-bool
-enough_free()
-{
-    return last_page - cm_counter >= MIN_FREE_PAGES;
+    return PADDR_TO_KVADDR(PAGE_TO_ADDR(start));
 }
 
-void
-paging_daemon(void *data1, unsigned long data2)
+/*
+Allocates a single zeroed kernel page, such as a page table, from the zero pool if it can.
+*/
+vaddr_t
+alloc_kpage_zeroed()
 {
-    (void) data1;
-    (void) data2;
-    int result;
+    p_page_t p_page;
+    bool zeroed;
 
-    while(true) {
-        lock_acquire(global_lock);
+    spinlock_acquire(&cm_spinlock);
 
-        for (int count = 0; count < DAEMON_EVICT_NUM; count++) {
-            result = swap_out();
-            if (result) {
-                switch(result) {
-                    case ENOUGHFREE:
-                    goto done;
-                    break;
-
-                    case NOSWAPPABLE:
-                    goto done;
-                    break;
-
-                    case SWAPNOMEM:
-                    goto done;
-                    break;
-                }
-            }
-            break;
-        }
+    if (find_free_zeroed(&p_page, &zeroed)) {
+        spinlock_release(&cm_spinlock);
+        return 0;
+    }
+
+    kalloc_ppage(p_page);
+    cm->cm_frames[p_page].cf_entry = cm->cm_frames[p_page].cf_entry | KMALLOC_END;
+
+    spinlock_release(&cm_spinlock);
+
+    vaddr_t kvaddr = PADDR_TO_KVADDR(PAGE_TO_ADDR(p_page));
+    if (!zeroed) {
+        bzero((void *) kvaddr, PAGE_SIZE);
+    }
+
+    return kvaddr;
+}
+
+/*
+Zeroes one free frame for the zero pool, if it is below its target and free frames are not
+running low. Called by idle CPUs with interrupts off, so only one page is done per call. Returns
+true if a page was zeroed, in which case the caller should look for work again before idling.
+*/
+bool
+vm_zero_idle()
+{
+    p_page_t p_page;
+
+    if (zero_pool_count >= zero_pool_target) {
+        return false;
+    }
+
+    spinlock_acquire(&cm_spinlock);
+
+    if (zero_pool_count >= zero_pool_target || vm_free_pages() <= free_low_pages ||
+        find_free(1, &p_page)) {
+        spinlock_release(&cm_spinlock);
+        return false;
+    }
+
+    spinlock_release(&cm_spinlock);
+
+    /* The frame is out of the buddy allocator but not in use, so nobody else touches it. */
+    bzero((void *) PADDR_TO_KVADDR(PAGE_TO_ADDR(p_page)), PAGE_SIZE);
+
+    spinlock_acquire(&cm_spinlock);
+    cm->cm_frames[p_page].cf_next = zero_pool;
+    zero_pool = p_page;
+    zero_pool_count++;
+    spinlock_release(&cm_spinlock);
+
+    return true;
+}
+
+void
+free_kpages(vaddr_t addr)
+{
+    p_page_t curr = ADDR_TO_PAGE(KVADDR_TO_PADDR(addr));
+    bool end;
+    bool acquired = spinlock_do_i_hold(&cm_spinlock);
+
+    if (!acquired) {
+        spinlock_acquire(&cm_spinlock);
+    }
+
+    while (p_page_used(curr)) {
+        end = cm->cm_frames[curr].cf_entry & KMALLOC_END;
+        free_ppage(curr);
+        if (end) {
+            if (!acquired) {
+                spinlock_release(&cm_spinlock);
+            }
+            return;
+        }
+        curr++;
+    }
+
+    if (!acquired) {
+        spinlock_release(&cm_spinlock);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+Makes the address space's ASID current on this CPU, giving it a new one if it has none in the
+current generation.
+*/
+void
+vm_activate_asid(struct addrspace *as)
+{
+    KASSERT(as != NULL);
+
+    unsigned cpu = curcpu->c_number;
+
+    spinlock_acquire(&asid_spinlock);
+
+    if (ASID_GEN(as->as_asid) != asid_generation) {
+        if (asid_next == NUM_ASIDS) {
+            asid_generation++;
+            asid_next = 1;
+        }
+
+        as->as_asid = (asid_generation << ASID_GEN_SHIFT) | asid_next;
+        as->as_cpus = 0;
+        asid_next++;
+    }
+
+    /* Only CPUs in as_cpus can hold TLB entries tagged with this ASID. */
+    as->as_cpus |= (uint32_t)1 << cpu;
+
+    if (cpu_asid_generation[cpu] != asid_generation) {
+        /* Hardware ASIDs were handed out again since this CPU last flushed. */
+        tlb_invalidate();
+        cpu_asid_generation[cpu] = asid_generation;
+    }
+
+    tlb_set_asid(ASID_HW(as->as_asid));
+    cpu_as[cpu] = as;
+    cpu_asid[cpu] = as->as_asid;
+
+    spinlock_release(&asid_spinlock);
+}
+
+/*
+Gives the current address space a new ASID, so TLB entries tagged with the old one on any CPU
+are never matched again. Used instead of flushing the TLB when many mappings of it are revoked.
+Only the current address space may be retired: a CPU running it would keep the old ASID in its
+EntryHi, and the TLB refill and vm_fault tag new entries with as_asid.
+*/
+void
+vm_retire_asid(struct addrspace *as)
+{
+    KASSERT(as != NULL);
+    KASSERT(as == proc_getas());
+
+    spinlock_acquire(&asid_spinlock);
+    as->as_asid = 0;
+    spinlock_release(&asid_spinlock);
+
+    vm_activate_asid(as);
+}
+
+/*
+Sets the l2 page table used by the TLB refill fast path on this CPU.
+*/
+void
+vm_set_utlb_pt(struct l2_pt *l2_pt)
+{
+    int spl = splhigh();
+    utlb_l2_pt[curcpu->c_number] = l2_pt;
+    splx(spl);
+}
+
+/*
+Stops the TLB refill fast path on this CPU from walking the given l2 page table.
+*/
+void
+vm_clear_utlb_pt(struct l2_pt *l2_pt)
+{
+    int spl = splhigh();
+    if (utlb_l2_pt[curcpu->c_number] == l2_pt) {
+        utlb_l2_pt[curcpu->c_number] = NULL;
+    }
+    splx(spl);
+}
+
+void
+vm_tlbshootdown_all()
+{
+    for (int i = 0; i < NUM_TLB; i++){
+        tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+    }
+}
+
+
+void
+vm_tlbshootdown(const struct tlbshootdown *tlbsd)
+{
+    vaddr_t v_page = tlbsd->v_page_num;
+    uint32_t asid = ASID_HW(tlbsd->asid);
+    uint32_t entryhi = 0 | (v_page & PAGE_FRAME) | asid << TLBHI_PIDSHIFT;
+    int32_t index = tlb_probe(entryhi, 0);
+
+    if (index > -1) {
+        tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+    }
+}
+
+void
+vm_tlb_batch_init(struct tlb_batch *batch, struct addrspace *as)
+{
+    KASSERT(as != NULL);
+
+    batch->tb_as = as;
+    batch->tb_num = 0;
+}
+
+void
+vm_tlb_batch_add(struct tlb_batch *batch, vaddr_t vaddr)
+{
+    if (batch->tb_num < TLBSHOOTDOWN_MAX) {
+        batch->tb_pages[batch->tb_num].v_page_num = vaddr & PAGE_FRAME;
+        batch->tb_num++;
+    } else {
+        batch->tb_num = TLBSHOOTDOWN_MAX + 1;
+    }
+}
+
+void
+vm_tlb_batch_add_range(struct tlb_batch *batch, vaddr_t start, vaddr_t end)
+{
+    if (end > start && (end - start) / PAGE_SIZE > TLBSHOOTDOWN_MAX) {
+        batch->tb_num = TLBSHOOTDOWN_MAX + 1;
+        return;
+    }
+
+    for (vaddr_t vaddr = start & PAGE_FRAME; vaddr < end; vaddr += PAGE_SIZE) {
+        vm_tlb_batch_add(batch, vaddr);
+    }
+}
+
+/*
+CPUs that may hold TLB entries of an address space under its current ASID: those that activated
+it in the current generation, and those still running it under it from an older one. CPUs whose
+EntryHi holds an earlier ASID of the address space are returned in stale; their entries are not
+tagged with the current ASID, so they have to be flushed entirely. A record left behind by a
+destroyed address space costs at most a needless flush if its memory is reused for another.
+*/
+static
+uint32_t
+asid_cpus(struct addrspace *as, uint32_t *stale)
+{
+    KASSERT(spinlock_do_i_hold(&asid_spinlock));
+
+    uint32_t cpus = (ASID_GEN(as->as_asid) == asid_generation) ? as->as_cpus : 0;
+
+    *stale = 0;
+    for (unsigned i = 0; i < MAXCPUS; i++) {
+        if (cpu_as[i] != as) {
+            continue;
+        }
+
+        if (cpu_asid[i] == as->as_asid) {
+            cpus |= (uint32_t)1 << i;
+        } else {
+            *stale |= (uint32_t)1 << i;
+        }
+    }
+
+    return cpus & ~*stale;
+}
+
+/*
+Invalidates the queued pages on every CPU that may hold entries for them (see asid_cpus), and
+waits until the other CPUs have done so. Used before the frames the pages were mapped to are
+copied, reused or freed, so no CPU can still reach them through a stale entry. The caller must
+not hold a spinlock, and interrupts must be enabled.
+
+Past TLBSHOOTDOWN_MAX pages, the address space running on this CPU retires its ASID instead,
+which no CPU has to be interrupted for: no other CPU can be running it. Any other address space
+keeps its ASID, as a CPU running it would keep the old one in its EntryHi; the CPUs that may
+hold its entries flush their whole TLB.
+*/
+void
+vm_tlb_batch_sync(struct tlb_batch *batch)
+{
+    struct addrspace *as = batch->tb_as;
+
+    if (batch->tb_num == 0) {
+        return;
+    }
+
+    if (batch->tb_num > TLBSHOOTDOWN_MAX && as == proc_getas()) {
+        vm_retire_asid(as);
+        batch->tb_num = 0;
+        return;
+    }
+
+    spinlock_acquire(&asid_spinlock);
+    uint32_t asid = as->as_asid;
+    uint32_t stale;
+    uint32_t cpus = asid_cpus(as, &stale);
+    spinlock_release(&asid_spinlock);
+
+    if (batch->tb_num > TLBSHOOTDOWN_MAX) {
+        stale |= cpus;
+        cpus = 0;
+        batch->tb_num = 0;
+    }
+
+    for (unsigned i = 0; i < batch->tb_num; i++) {
+        batch->tb_pages[i].asid = asid;
+    }
+
+    int spl = splhigh();
+    uint32_t self = (uint32_t)1 << curcpu->c_number;
+
+    if (stale & self) {
+        vm_tlbshootdown_all();
+    } else if (cpus & self) {
+        for (unsigned i = 0; i < batch->tb_num; i++) {
+            vm_tlbshootdown(&batch->tb_pages[i]);
+        }
+    }
+
+    cpus &= ~self;
+    stale &= ~self;
+    if (cpus != 0) {
+        ipi_tlbshootdown_batch(cpus, batch->tb_pages, batch->tb_num);
+    }
+    if (stale != 0) {
+        ipi_tlbshootdown_batch(stale, NULL, TLBSHOOTDOWN_MAX + 1);
+    }
+
+    splx(spl);
+
+    batch->tb_num = 0;
+
+    ipi_tlbshootdown_wait(cpus | stale);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+Swapable pages are user data pages and l1 page tables.
+*/
+static
+bool
+entry_swappable(p_page_t p_page)
+{
+    if (!p_page_used(p_page)) {
+        return false;
+    }
+
+    if (*cm_entry(p_page) & (PP_BUSY | PP_PINNED)) {
+        return false;
+    }
+
+    if (*cm_rmap(p_page) == NULL) {
+        return false;
+    }
+
+    return true;
+}
+
+static
+off_t
+swap_offset(p_page_t p_page)
+{
+    KASSERT(in_swap(p_page));
+    return PAGE_TO_ADDR(p_page - first_page_swap);
+}
+
+/*
+Updates the location of a page in the page tables of every address space in its rmap. The
+global paging lock must be held; the address space lock of every owner not already held is
+acquired while its page tables are modified. Owners of a page can only change under the lock
+of another owner or the global paging lock, so the rmap stays the same while it is walked.
+*/
+static
+int
+update_pt_entries(p_page_t swap_to_page, p_page_t old_page)
+{
+    KASSERT(spinlock_do_i_hold(&cm_spinlock));
+    KASSERT(lock_do_i_hold(global_lock));
+
+    v_page_t v_page = *cm_entry(swap_to_page) & VP_MASK;
+    bool is_l1 = v_page >= 0x00080000;
+    int result;
+
+    for (struct rmap *rm = *cm_rmap(swap_to_page); rm != NULL; rm = rm->rm_next) {
+        struct addrspace *as = rm->rm_as;
+        v_page_l2_t v_l2 = L2_PNUM(rm->rm_vaddr);
+        v_page_l1_t v_l1 = L1_PNUM(rm->rm_vaddr);
+
+        spinlock_release(&cm_spinlock);
+
+        bool acquired = lock_do_i_hold(as->as_lock);
+        if (!acquired) {
+            lock_acquire(as->as_lock);
+        }
+
+        spinlock_acquire(&cm_spinlock);
+
+        struct l2_pt *l2_pt = as->l2_pt;
+        l2_entry_t l2_entry = l2_pt->l2_entries[v_l2];
+
+        KASSERT(l2_entry & ENTRY_VALID);
+
+        if (is_l1) {
+            KASSERT((l2_entry & PAGE_MASK) == old_page);
+            l2_pt->l2_entries[v_l2] = (l2_entry & (~PAGE_MASK)) | swap_to_page;
+        } else {
+            p_page_t p_page = l2_entry & PAGE_MASK;
+
+            if (in_swap(p_page)) {
+                result = swap_in_data(&p_page);
+                if (result) {
+                    if (!acquired) {
+                        spinlock_release(&cm_spinlock);
+                        lock_release(as->as_lock);
+                        spinlock_acquire(&cm_spinlock);
+                    }
+                    return result;
+                }
+            }
+
+            struct l1_pt *l1_pt = (struct l1_pt *) PADDR_TO_KVADDR(PAGE_TO_ADDR(p_page));
+
+            /* Owners sharing the l1 page table see it already updated. */
+            p_page_t cur_p_page = l1_pt->l1_entries[v_l1] & PAGE_MASK;
+            KASSERT(cur_p_page == old_page || cur_p_page == swap_to_page);
+            l1_entry_t l1_entry = (l1_pt->l1_entries[v_l1] & (~PAGE_MASK)) | swap_to_page;
+
+            /* The first write to a page in the swap cache has to fault, to mark it dirty. */
+            if (in_ram(swap_to_page) && swapmap.sm_cached[swap_to_page] != 0) {
+                l1_entry = l1_entry & (~ENTRY_WRITABLE);
+            }
+
+            l1_pt->l1_entries[v_l1] = l1_entry;
+
+            if (in_swap(swap_to_page) && in_ram(old_page)) {
+                as->as_rss_pages--;
+                as->as_swap_pages++;
+                as->as_nswap++;
+            } else if (in_ram(swap_to_page) && in_swap(old_page)) {
+                as->as_swap_pages--;
+                rss_count(swap_to_page, as, true);
+                as->as_majflt++;
+            }
+        }
+
+        if (!acquired) {
+            spinlock_release(&cm_spinlock);
+            lock_release(as->as_lock);
+            spinlock_acquire(&cm_spinlock);
+        }
+    }
+    return 0;
+}
+
+/*
+Moves the clock hand to the next frame. Returns true when it wraps around to the first one.
+*/
+static
+bool
+swapclock_tick()
+{
+    KASSERT(in_ram(swapclock));
+
+    if (swapclock == last_page - 1) {
+        swapclock = first_alloc_page;
+        return true;
+    }
+
+    swapclock++;
+    return false;
+}
+
+/*
+Checks that every owner in the rmap of a page is locked by this thread.
+*/
+static
+bool
+owners_locked(p_page_t p_page)
+{
+    KASSERT(spinlock_do_i_hold(&cm_spinlock));
+
+    for (struct rmap *rm = *cm_rmap(p_page); rm != NULL; rm = rm->rm_next) {
+        if (!lock_do_i_hold(rm->rm_as->as_lock)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+Transfers a run of busy page frames to or from the consecutive swap slots starting at
+first_slot, with a single device operation.
+*/
+static
+int
+swap_io_run(p_page_t *frames, size_t num, p_page_t first_slot, enum uio_rw rw)
+{
+    KASSERT(num <= DAEMON_EVICT_NUM);
+
+    struct iovec iov[DAEMON_EVICT_NUM];
+    struct uio u;
+
+    for (size_t i = 0; i < num; i++) {
+        iov[i].iov_kbase = (void *) PAGE_TO_ADDR(PPAGE_TO_KVPAGE(frames[i]));
+        iov[i].iov_len = PAGE_SIZE;
+    }
+
+    u.uio_iov = iov;
+    u.uio_iovcnt = num;
+    u.uio_offset = swap_offset(first_slot);
+    u.uio_resid = num * PAGE_SIZE;
+    u.uio_segflg = UIO_SYSSPACE;
+    u.uio_rw = rw;
+    u.uio_space = NULL;
+
+    if (rw == UIO_READ) {
+        return VOP_READ(swap_disk, &u);
+    }
+    return VOP_WRITE(swap_disk, &u);
+}
+
+/*
+Writes a page from a kernel buffer to a swap slot; used by the compressed pool to write pages back.
+*/
+int
+swap_write_kbuf(p_page_t slot, const void *buf)
+{
+    struct iovec iov;
+    struct uio u;
+
+    uio_kinit(&iov, &u, (void *) buf, PAGE_SIZE, swap_offset(slot), UIO_WRITE);
+    return VOP_WRITE(swap_disk, &u);
+}
+
+/*
+Drops the mappings of a batch of busy page frames from every TLB, and waits for the other CPUs
+to do so, so nothing can write to the frames while they are written out. Sends one batch per
+owner, holding the mappings of all the frames it owns. l1 page tables are not mapped by user
+TLB entries and are skipped. The locks of all the owners must be held.
+*/
+static
+void
+evict_shootdown(p_page_t *victims, size_t num_victims, struct addrspace **owners, size_t num_owners)
+{
+    for (size_t i = 0; i < num_owners; i++) {
+        struct tlb_batch batch;
+        vm_tlb_batch_init(&batch, owners[i]);
+
+        for (size_t j = 0; j < num_victims; j++) {
+            if ((*cm_entry(victims[j]) & VP_MASK) >= 0x00080000) {
+                continue;
+            }
+
+            for (struct rmap *rm = *cm_rmap(victims[j]); rm != NULL; rm = rm->rm_next) {
+                if (rm->rm_as == owners[i]) {
+                    vm_tlb_batch_add(&batch, rm->rm_vaddr);
+                }
+            }
+        }
+
+        vm_tlb_batch_sync(&batch);
+    }
+}
+
+/*
+Writes a batch of busy page frames out to swap, and points every page table entry mapping them
+to their swap pages. The address spaces of all owners of the frames are locked from before the
+writes until the page tables are updated, so none of them can fault on the frames in the
+meantime. A frame that was freed or changed owners while the locks were acquired is left alone.
+The owners are gathered on the stack, as memory may have run out; frames whose mappings do not
+fit in EVICT_OWNERS_MAX are left out of the batch.
+
+The frames get swap slots one after the other, so they mostly land next to each other on disk
+and go out in a few multi-page writes. A frame in the swap cache goes back to its own slot, and
+is not written at all if it is clean.
+*/
+static
+int
+evict_ppages(p_page_t *victims, size_t num_victims)
+{
+    KASSERT(lock_do_i_hold(global_lock));
+    KASSERT(num_victims <= DAEMON_EVICT_NUM);
+
+    struct addrspace *owners[EVICT_OWNERS_MAX];
+    size_t num_rmap = 0;
+    size_t num_owners = 0;
+    cm_entry_t entries[DAEMON_EVICT_NUM];
+    p_page_t slots[DAEMON_EVICT_NUM];
+    bool clean[DAEMON_EVICT_NUM];
+    size_t num_evicted = 0;
+    int result = 0;
+
+    spinlock_acquire(&cm_spinlock);
+
+    /* A frame left out here is made not busy below, unless its owners get locked anyway. */
+    for (size_t i = 0; i < num_victims; i++) {
+        KASSERT(cm->cm_frames[victims[i]].cf_entry & PP_BUSY);
+        entries[i] = cm->cm_frames[victims[i]].cf_entry;
+
+        size_t refs = 0;
+        for (struct rmap *rm = cm->cm_frames[victims[i]].cf_rmap; rm != NULL; rm = rm->rm_next) {
+            refs++;
+        }
+
+        if (num_rmap + refs > EVICT_OWNERS_MAX) {
+            continue;
+        }
+
+        for (struct rmap *rm = cm->cm_frames[victims[i]].cf_rmap; rm != NULL; rm = rm->rm_next) {
+            owners[num_rmap] = rm->rm_as;
+            num_rmap++;
+        }
+    }
+
+    spinlock_release(&cm_spinlock);
+
+    /* Address spaces owning several of the frames are locked once. */
+    for (size_t i = 0; i < num_rmap; i++) {
+        struct addrspace *as = owners[i];
+        if (!lock_do_i_hold(as->as_lock)) {
+            lock_acquire(as->as_lock);
+            owners[num_owners] = as;
+            num_owners++;
+        }
+    }
+
+    spinlock_acquire(&cm_spinlock);
+
+    for (size_t i = 0; i < num_victims; i++) {
+        p_page_t victim = victims[i];
+
+        if (cm->cm_frames[victim].cf_entry != entries[i] || !owners_locked(victim)) {
+            cm_unbusy(victim);
+            continue;
+        }
+
+        if (swapmap.sm_cached[victim] != 0) {
+            slots[num_evicted] = swapmap.sm_cached[victim];
+            clean[num_evicted] = !(cm->cm_frames[victim].cf_entry & DIRTY);
+        } else if (find_free_swap(&slots[num_evicted]) == 0) {
+            clean[num_evicted] = false;
+        } else {
+            cm_unbusy(victim);
+            continue;
+        }
+
+        victims[num_evicted] = victim;
+        num_evicted++;
+    }
+
+    spinlock_release(&cm_spinlock);
+
+    if (num_evicted == 0) {
+        result = SWAPNOMEM;
+        goto done;
+    }
+
+    evict_shootdown(victims, num_evicted, owners, num_owners);
+
+    /* Pages that compress well go to the compressed pool instead of the disk. */
+    for (size_t i = 0; i < num_evicted; i++) {
+        if (!clean[i] && zswap_store(slots[i], (void *) PAGE_TO_ADDR(PPAGE_TO_KVPAGE(victims[i])))) {
+            clean[i] = true;
+        }
+    }
+
+    /* Clean frames are already on disk. Each run of consecutive slots of the rest goes out in one write. */
+    bool written[DAEMON_EVICT_NUM];
+    p_page_t run[DAEMON_EVICT_NUM];
+    size_t run_idx[DAEMON_EVICT_NUM];
+    size_t run_len = 0;
+    for (size_t i = 0; i <= num_evicted; i++) {
+        if (i < num_evicted && clean[i]) {
+            written[i] = true;
+            continue;
+        }
+
+        if (i < num_evicted && (run_len == 0 || slots[i] == slots[run_idx[run_len - 1]] + 1)) {
+            run[run_len] = victims[i];
+            run_idx[run_len] = i;
+            run_len++;
+            continue;
+        }
+
+        if (run_len > 0) {
+            int run_result = swap_io_run(run, run_len, slots[run_idx[0]], UIO_WRITE);
+            for (size_t j = 0; j < run_len; j++) {
+                written[run_idx[j]] = (run_result == 0);
+            }
+
+            if (run_result) {
+                result = run_result;
+            }
+        }
+
+        run_len = 0;
+        if (i < num_evicted) {
+            run[0] = victims[i];
+            run_idx[0] = i;
+            run_len = 1;
+        }
+    }
+
+    spinlock_acquire(&cm_spinlock);
+
+    for (size_t i = 0; i < num_evicted; i++) {
+        p_page_t victim = victims[i];
+        p_page_t swap_to_page = slots[i];
+
+        if (!written[i]) {
+            /* A swap cache slot stays with its frame; the frame is dirty anyway. */
+            if (swapmap.sm_cached[victim] == 0) {
+                free_ppage_swap(swap_to_page);
+            }
+            cm_unbusy(victim);
+            continue;
+        }
+
+        swapmap.sm_cached[victim] = 0;
+        *cm_entry(swap_to_page) = cm->cm_frames[victim].cf_entry & (~(PP_BUSY | DIRTY));
+        *cm_rmap(swap_to_page) = cm->cm_frames[victim].cf_rmap;
+        cm->cm_frames[victim].cf_rmap = NULL;
+        update_pt_entries(swap_to_page, victim);
+
+        cm->cm_frames[victim].cf_entry = cm->cm_frames[victim].cf_entry & (~PP_BUSY);
+        free_ppage(victim);
+    }
+
+    spinlock_release(&cm_spinlock);
+
+ done:
+    for (size_t i = 0; i < num_owners; i++) {
+        lock_release(owners[i]->as_lock);
+    }
+
+    return result;
+}
+
+/*
+Flushes the TLB of every CPU, so the next use of each page goes through the TLB refill and marks
+its frame referenced again. Done once per turn of the clock, not for each eviction.
+*/
+static
+void
+vm_flush_tlbs()
+{
+    int spl = splhigh();
+    vm_tlbshootdown_all();
+    splx(spl);
+
+    ipi_tlbshootdown_all();
+}
+
+/*
+Ages a frame as the clock passes it: the age is shifted right, and gets its top bit if the frame
+was referenced since the clock last passed. Returns the rank of the frame as a victim, lowest
+first: old clean frames, then old dirty frames, then the rest from least recently used.
+*/
+static
+unsigned
+swapclock_age(p_page_t p_page, bool clean)
+{
+    struct cm_frame *frame = &cm->cm_frames[p_page];
+
+    frame->cf_age = (frame->cf_age >> 1) | (frame->cf_referenced ? AGE_TOP : 0);
+    frame->cf_referenced = 0;
+
+    if (frame->cf_age < AGE_OLD) {
+        return clean ? 0 : 1;
+    }
+
+    return 2 + frame->cf_age;
+}
+
+/*
+Evicts up to npages page frames chosen by the clock, writing them out together. Must be called
+with the global paging lock held, and without holding any address space lock.
+
+This is a WSClock over aging counters. The hand ages at most SWAP_SCAN_MAX frames and keeps the
+npages best ranked ones, stopping early once it has enough old frames that need no write: cached
+file pages, and swap cache pages not written since they were read in. Dirty old frames come next,
+and if there are too few old frames, the least recently used ones are taken so paging always
+makes progress. All TLBs are flushed whenever the hand wraps around, so a page in use is marked
+referenced again before the hand next reaches it; the victims themselves are shot down by
+evict_ppages.
+*/
+int
+swap_out(size_t npages)
+{
+    KASSERT(lock_do_i_hold(global_lock));
+    KASSERT(npages > 0 && npages <= DAEMON_EVICT_NUM);
+
+    if (vm_free_pages() >= free_high_pages) {
+        return ENOUGHFREE;
+    }
+
+    p_page_t victims[DAEMON_EVICT_NUM];
+    unsigned ranks[DAEMON_EVICT_NUM];
+    size_t num_candidates = 0;
+    size_t num_victims = 0;
+    size_t num_dropped = 0;
+    size_t scan = last_page - first_alloc_page;
+    bool wrapped = false;
+
+    if (scan > SWAP_SCAN_MAX) {
+        scan = SWAP_SCAN_MAX;
+    }
+
+    spinlock_acquire(&cm_spinlock);
+
+    for (size_t i = 0; i < scan; i++) {
+        p_page_t p_page = swapclock;
+        cm_entry_t entry = cm->cm_frames[p_page].cf_entry;
+        wrapped = swapclock_tick() || wrapped;
+
+        /* Cached file pages are clean, so they are dropped instead of written to swap. */
+        bool file = pagecache_frame(p_page) && !(entry & (PP_BUSY | PP_PINNED));
+        if (!file && !entry_swappable(p_page)) {
+            continue;
+        }
+
+        bool clean = file || (swapmap.sm_cached[p_page] != 0 && !(entry & DIRTY));
+        unsigned rank = swapclock_age(p_page, clean);
+
+        /* Insert the frame among the best candidates, which are kept sorted by rank. */
+        size_t pos = num_candidates;
+        while (pos > 0 && ranks[pos - 1] > rank) {
+            pos--;
+        }
+
+        if (pos == npages) {
+            continue;
+        }
+
+        if (num_candidates < npages) {
+            num_candidates++;
+        }
+
+        for (size_t j = num_candidates - 1; j > pos; j--) {
+            victims[j] = victims[j - 1];
+            ranks[j] = ranks[j - 1];
+        }
+
+        victims[pos] = p_page;
+        ranks[pos] = rank;
+
+        if (num_candidates == npages && ranks[npages - 1] == 0) {
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < num_candidates; i++) {
+        p_page_t p_page = victims[i];
+
+        if (pagecache_frame(p_page)) {
+            pagecache_drop_frame(p_page);
+            num_dropped++;
+        } else {
+            cm->cm_frames[p_page].cf_entry = cm->cm_frames[p_page].cf_entry | PP_BUSY;
+            victims[num_victims] = p_page;
+            num_victims++;
+        }
+    }
+
+    spinlock_release(&cm_spinlock);
+
+    if (wrapped) {
+        vm_flush_tlbs();
+    }
+
+    if (num_victims > 0) {
+        int result = evict_ppages(victims, num_victims);
+        if (result && num_dropped == 0) {
+            return result;
+        }
+        return 0;
+    }
+
+    return num_dropped > 0 ? 0 : NOSWAPPABLE;
+}
+
+/*
+Evicts up to npages pages of one address space, for a process at its RSS limit. The hand goes
+round the page tables of the address space from where it last stopped, looking at up to
+SWAP_SCAN_MAX pages in RAM. Pages not referenced since the clock last passed are taken first,
+then referenced ones if there are too few. Must be called with the global paging lock held, and
+without holding any address space lock.
+*/
+int
+swap_out_as(struct addrspace *as, size_t npages)
+{
+    KASSERT(lock_do_i_hold(global_lock));
+    KASSERT(npages > 0 && npages <= DAEMON_EVICT_NUM);
+
+    p_page_t victims[DAEMON_EVICT_NUM];
+    p_page_t referenced[DAEMON_EVICT_NUM];
+    size_t num_victims = 0;
+    size_t num_referenced = 0;
+    vaddr_t vaddr = as->as_rss_hand;
+
+    lock_acquire(as->as_lock);
+    spinlock_acquire(&cm_spinlock);
+
+    for (size_t scan = 0, steps = 0;
+         scan < SWAP_SCAN_MAX && steps < NUM_L2PT_ENTRIES + SWAP_SCAN_MAX && num_victims < npages;
+         steps++) {
+        l2_entry_t l2_entry = as->l2_pt->l2_entries[L2_PNUM(vaddr)];
+
+        /* The pages of an l1 page table that is missing or in swap are passed over at once. */
+        if (!(l2_entry & ENTRY_VALID) || !in_ram(l2_entry & PAGE_MASK)) {
+            vaddr = (vaddr | (~L2_PAGE_NUM_MASK)) + 1;
+        } else {
+            struct l1_pt *l1_pt = (struct l1_pt *) PADDR_TO_KVADDR(PAGE_TO_ADDR(l2_entry & PAGE_MASK));
+            l1_entry_t l1_entry = l1_pt->l1_entries[L1_PNUM(vaddr)];
+            p_page_t p_page = l1_entry & PAGE_MASK;
+
+            if ((l1_entry & ENTRY_VALID) && in_ram(p_page) && !pagecache_frame(p_page) &&
+                entry_swappable(p_page)) {
+                scan++;
+
+                if (!cm->cm_frames[p_page].cf_referenced) {
+                    cm->cm_frames[p_page].cf_entry = cm->cm_frames[p_page].cf_entry | PP_BUSY;
+                    victims[num_victims] = p_page;
+                    num_victims++;
+                } else if (num_referenced < npages) {
+                    referenced[num_referenced] = p_page;
+                    num_referenced++;
+                }
+            }
+
+            vaddr += PAGE_SIZE;
+        }
+
+        if (vaddr >= USERSPACETOP) {
+            vaddr = 0;
+        }
+    }
+
+    as->as_rss_hand = vaddr;
+
+    for (size_t i = 0; i < num_referenced && num_victims < npages; i++) {
+        if (entry_swappable(referenced[i])) {
+            cm->cm_frames[referenced[i]].cf_entry = cm->cm_frames[referenced[i]].cf_entry | PP_BUSY;
+            victims[num_victims] = referenced[i];
+            num_victims++;
+        }
+    }
+
+    spinlock_release(&cm_spinlock);
+    lock_release(as->as_lock);
+
+    if (num_victims == 0) {
+        return NOSWAPPABLE;
+    }
+
+    return evict_ppages(victims, num_victims);
+}
+
+/*
+Number of pages the current process, running in as, has to give up before its next fault takes
+a frame, to stay within its RLIMIT_RSS soft limit; see vm.h.
+*/
+static
+size_t
+rss_excess(struct addrspace *as)
+{
+    spinlock_acquire(&curproc->p_lock);
+    rlim_t limit = curproc->p_rlimit[RLIMIT_RSS].rlim_cur;
+    spinlock_release(&curproc->p_lock);
+
+    if (limit >= (rlim_t) PAGE_TO_ADDR(last_page)) {
+        return 0;
+    }
+
+    size_t limit_pages = (size_t) limit / PAGE_SIZE;
+    if (limit_pages < RSS_MIN_PAGES) {
+        limit_pages = RSS_MIN_PAGES;
+    }
+
+    size_t rss = as->as_rss_pages;
+    return (rss >= limit_pages) ? rss - limit_pages + 1 : 0;
+}
+
+/*
+Fills in the memory usage of an address space: its peak resident set in kilobytes, its faults,
+and the pages it had written out to swap.
+*/
+void
+vm_getrusage(struct addrspace *as, struct rusage *ru)
+{
+    spinlock_acquire(&cm_spinlock);
+
+    ru->ru_maxrss = as->as_rss_max * (PAGE_SIZE / 1024);
+    ru->ru_minflt = as->as_minflt;
+    ru->ru_majflt = as->as_majflt;
+    ru->ru_nswap = as->as_nswap;
+
+    spinlock_release(&cm_spinlock);
+}
+
+/*
+Brings the pages in num consecutive swap slots back into new page frames with a single device
+read, and points every page table entry that mapped the slots to the new frames. The global
+paging lock must be held. The new frames are kept busy while they are read in.
+
+Data pages keep their slots as a swap cache, so they need not be written out again if they are
+evicted before they are modified. L1 page tables are changed without faulting, so they give
+their slots up.
+*/
+static
+int
+swap_in_run(p_page_t first_slot, size_t num, p_page_t *frames)
+{
+    KASSERT(spinlock_do_i_hold(&cm_spinlock));
+    KASSERT(lock_do_i_hold(global_lock));
+    KASSERT(num > 0 && num <= DAEMON_EVICT_NUM);
+
+    int result = 0;
+    size_t num_frames;
+
+    for (num_frames = 0; num_frames < num; num_frames++) {
+        p_page_t slot = first_slot + num_frames;
+        KASSERT(in_swap(slot));
+        KASSERT(entry_swappable(slot));
+
+        p_page_t frame;
+        result = find_free(1, &frame);
+        if (result) {
+            break;
+        }
+
+        cm_counter++;
+        cm->cm_frames[frame].cf_entry = *cm_entry(slot) | PP_BUSY;
+        frames[num_frames] = frame;
+    }
+
+    /* Pages in the compressed pool are copied out of it; the rest are read from disk in runs. */
+    bool pooled[DAEMON_EVICT_NUM];
+    if (result == 0) {
+        for (size_t i = 0; i < num; i++) {
+            pooled[i] = zswap_load(first_slot + i, (void *) PAGE_TO_ADDR(PPAGE_TO_KVPAGE(frames[i])));
+        }
+
+        spinlock_release(&cm_spinlock);
+
+        for (size_t i = 0; i < num && result == 0; ) {
+            size_t run = 0;
+            while (i + run < num && !pooled[i + run]) {
+                run++;
+            }
+
+            if (run > 0) {
+                result = swap_io_run(frames + i, run, first_slot + i, UIO_READ);
+            }
+            i += (run > 0) ? run : 1;
+        }
+
+        spinlock_acquire(&cm_spinlock);
+    }
+
+    if (result) {
+        for (size_t i = 0; i < num_frames; i++) {
+            cm->cm_frames[frames[i]].cf_entry = cm->cm_frames[frames[i]].cf_entry & (~PP_BUSY);
+            free_ppage(frames[i]);
+        }
+        return result;
+    }
+
+    for (size_t i = 0; i < num; i++) {
+        p_page_t slot = first_slot + i;
+        p_page_t frame = frames[i];
+        bool is_l1 = (cm->cm_frames[frame].cf_entry & VP_MASK) >= 0x00080000;
+
+        cm->cm_frames[frame].cf_rmap = *cm_rmap(slot);
+        *cm_rmap(slot) = NULL;
+
+        if (!is_l1) {
+            swapmap.sm_cached[frame] = slot;
+            *cm_entry(slot) = PP_USED | SWAP_CACHED | frame;
+            if (pooled[i]) {
+                /* The compressed copy is given up, so the slot has nothing until the frame goes out again. */
+                zswap_drop(slot);
+                cm->cm_frames[frame].cf_entry = cm->cm_frames[frame].cf_entry | DIRTY;
+            } else {
+                cm->cm_frames[frame].cf_entry = cm->cm_frames[frame].cf_entry & (~DIRTY);
+            }
+        }
+
+        update_pt_entries(frame, slot);
+        cm->cm_frames[frame].cf_entry = cm->cm_frames[frame].cf_entry & (~PP_BUSY);
+
+        if (is_l1) {
+            free_ppage_swap(slot);
+        }
+    }
+
+    return 0;
+}
+
+/*
+Brings a page back from swap into a new page frame, and points every page table entry that
+mapped the swap page to the new frame. The global paging lock must be held.
+*/
+int
+swap_in_data(p_page_t *p_page_ret)
+{
+    p_page_t new_page;
+    int result;
+
+    result = swap_in_run(*p_page_ret, 1, &new_page);
+    if (result) {
+        return result;
+    }
+
+    *p_page_ret = new_page;
+
+    return 0;
+}
+
+/*
+Brings the swapped out page mapped by entry v_l1 of the l1 page table back in, together with the
+pages mapped by the entries after it whose slots follow its slot on disk, up to SWAP_READAHEAD
+pages and while free frames are plentiful. Pages evicted together sit in consecutive slots, so
+a sequential scan over swapped memory reads them with one device read per SWAP_READAHEAD pages.
+*/
+static
+int
+swap_in_readahead(struct l1_pt *l1_pt, v_page_l1_t v_l1, p_page_t *p_page_ret)
+{
+    KASSERT(spinlock_do_i_hold(&cm_spinlock));
+
+    p_page_t slot = *p_page_ret;
+    p_page_t frames[SWAP_READAHEAD];
+    size_t num = 1;
+    int result;
+
+    while (num < SWAP_READAHEAD && v_l1 + num < NUM_L1PT_ENTRIES &&
+           vm_free_pages() > free_low_pages + num) {
+        l1_entry_t l1_entry = l1_pt->l1_entries[v_l1 + num];
+        p_page_t next = l1_entry & PAGE_MASK;
+
+        if (!(l1_entry & ENTRY_VALID) || next != slot + num || !in_swap(next) ||
+            !entry_swappable(next)) {
+            break;
+        }
+
+        num++;
+    }
+
+    result = swap_in_run(slot, num, frames);
+    if (result) {
+        return result;
+    }
+
+    *p_page_ret = frames[0];
+
+    return 0;
+}
+
+size_t
+vm_free_pages()
+{
+    return last_page - cm_counter;
+}
+
+bool
+enough_free()
+{
+    return vm_free_pages() >= free_min_pages;
+}
+
+/*
+Number of pages that can back committed heap memory.
+*/
+static
+size_t
+commit_limit()
+{
+    size_t limit = last_page - first_alloc_page - free_min_pages;
+
+    if (SWAP_ON) {
+        limit += last_page_swap - first_page_swap;
+    }
+
+    return limit;
+}
+
+/*
+Accounts for npages of heap that may be touched later. Returns ENOMEM if they cannot be
+backed; see OVERCOMMIT_STRICT.
+*/
+int
+vm_commit(size_t npages)
+{
+    size_t limit = commit_limit();
+
+    spinlock_acquire(&cm_spinlock);
+
+    if (npages > limit || (OVERCOMMIT_STRICT && vm_committed + npages > limit)) {
+        spinlock_release(&cm_spinlock);
+        return ENOMEM;
+    }
+
+    vm_committed += npages;
+
+    spinlock_release(&cm_spinlock);
+    return 0;
+}
+
+void
+vm_uncommit(size_t npages)
+{
+    spinlock_acquire(&cm_spinlock);
+
+    KASSERT(vm_committed >= npages);
+    vm_committed -= npages;
+
+    spinlock_release(&cm_spinlock);
+}
+
+/*
+Waits for free frames once they are below the minimum. The paging daemon is woken if it is not
+already at work, and the wait ends when frames are freed or when the daemon finishes a pass
+without freeing enough, in which case the caller's allocation may fail. Must not be called while
+holding an address space lock.
+*/
+void
+vm_wait_free()
+{
+    spinlock_acquire(&cm_spinlock);
+
+    unsigned pass = daemon_passes;
+    while (!enough_free() && pass == daemon_passes) {
+        wchan_wakeone(daemon_wchan, &cm_spinlock);
+
+        free_waiters++;
+        wchan_sleep(free_wchan, &cm_spinlock);
+        free_waiters--;
+    }
+
+    spinlock_release(&cm_spinlock);
+}
+
+/*
+Acquires the lock of an address space for an operation that walks or frees its page tables.
+If any page is in swap, the operation might have to page l1 page tables in or change the
+reference counts of swap pages, so the lock is dropped and reacquired after the global paging
+lock, and *paging is set. Once the address space lock is held, none of its pages can be moved
+to swap, so checking swap_counter at that point is enough.
+*/
+void
+vm_lock_as(struct addrspace *as, bool *paging)
+{
+    KASSERT(as != NULL);
+
+    *paging = false;
+
+    lock_acquire(as->as_lock);
+
+    if (swap_counter > 0 && !lock_do_i_hold(global_lock)) {
+        lock_release(as->as_lock);
+        lock_acquire(global_lock);
+        lock_acquire(as->as_lock);
+        *paging = true;
+    }
+}
+
+void
+vm_unlock_as(struct addrspace *as, bool paging)
+{
+    KASSERT(as != NULL);
+
+    lock_release(as->as_lock);
+
+    if (paging) {
+        lock_release(global_lock);
+    }
+}
+
+/*
+Checks if a used page frame can be emptied by compaction: it holds a cached file page, which is
+dropped, or a user page or l1 page table that could be evicted, with few enough owners to lock.
+*/
+static
+bool
+compact_movable(p_page_t p_page)
+{
+    KASSERT(spinlock_do_i_hold(&cm_spinlock));
+
+    cm_entry_t entry = cm->cm_frames[p_page].cf_entry;
+
+    if (pagecache_frame(p_page)) {
+        return !(entry & (PP_BUSY | PP_PINNED));
+    }
+
+    return entry_swappable(p_page) && cm_getref(p_page) <= COMPACT_OWNERS_MAX;
+}
+
+/*
+Checks that every owner of a user page has the l1 page table mapping it in RAM, so its entry can
+be changed without paging.
+*/
+static
+bool
+compact_l1s_in_ram(p_page_t p_page)
+{
+    KASSERT(spinlock_do_i_hold(&cm_spinlock));
+
+    if ((cm->cm_frames[p_page].cf_entry & VP_MASK) >= 0x00080000) {
+        return true;
+    }
+
+    for (struct rmap *rm = *cm_rmap(p_page); rm != NULL; rm = rm->rm_next) {
+        l2_entry_t l2_entry = rm->rm_as->l2_pt->l2_entries[L2_PNUM(rm->rm_vaddr)];
+        if (!in_ram(l2_entry & PAGE_MASK)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+Moves the contents of a busy page frame to a new frame, and points every page table entry mapping
+it there. The old frame is freed, but stays busy. The locks of the owners are only tried, never
+waited for, since the caller of alloc_kpages may hold any of them; EBUSY is returned if one is
+taken. The global paging lock must be held.
+*/
+static
+int
+compact_move(p_page_t src)
+{
+    KASSERT(lock_do_i_hold(global_lock));
+
+    struct addrspace *owners[COMPACT_OWNERS_MAX];
+    size_t num_rmap = 0;
+    size_t num_owners = 0;
+    int result = 0;
+
+    spinlock_acquire(&cm_spinlock);
+
+    cm_entry_t entry = cm->cm_frames[src].cf_entry;
+    KASSERT(entry & PP_BUSY);
+
+    /* Its owners may have freed it since it was picked. */
+    if (!(entry & PP_USED)) {
+        spinlock_release(&cm_spinlock);
+        return 0;
+    }
+
+    for (struct rmap *rm = *cm_rmap(src); rm != NULL; rm = rm->rm_next) {
+        if (num_rmap == COMPACT_OWNERS_MAX) {
+            spinlock_release(&cm_spinlock);
+            return EBUSY;
+        }
+        owners[num_rmap] = rm->rm_as;
+        num_rmap++;
+    }
+
+    spinlock_release(&cm_spinlock);
+
+    /* Address spaces owning the frame at several addresses are locked once. */
+    for (size_t i = 0; i < num_rmap; i++) {
+        struct addrspace *as = owners[i];
+        bool locked = false;
+
+        for (size_t j = 0; j < num_owners; j++) {
+            locked = locked || (owners[j] == as);
+        }
+
+        if (locked) {
+            continue;
+        }
+
+        if (!lock_acquire_if_not_held(as->as_lock)) {
+            result = EBUSY;
+            goto done;
+        }
+
+        owners[num_owners] = as;
+        num_owners++;
+    }
+
+    spinlock_acquire(&cm_spinlock);
+
+    p_page_t dst;
+    if (cm->cm_frames[src].cf_entry != entry || !owners_locked(src) || !compact_l1s_in_ram(src)) {
+        result = EBUSY;
+    } else {
+        result = find_free(1, &dst);
+    }
+
+    if (result) {
+        spinlock_release(&cm_spinlock);
+        goto done;
+    }
+
+    cm_counter++;
+    cm->cm_frames[dst].cf_entry = entry;
+
+    spinlock_release(&cm_spinlock);
+
+    /*
+    The frame is busy, so the TLB refill does not map it again once it is shot down. The copy waits
+    for every CPU to drop its entries, or a write through one could be lost.
+    */
+    bool is_l1 = (entry & VP_MASK) >= 0x00080000;
+    for (struct rmap *rm = *cm_rmap(src); rm != NULL && !is_l1; rm = rm->rm_next) {
+        struct tlb_batch batch;
+        vm_tlb_batch_init(&batch, rm->rm_as);
+        vm_tlb_batch_add(&batch, rm->rm_vaddr);
+        vm_tlb_batch_sync(&batch);
+    }
+
+    memcpy((void *) PADDR_TO_KVADDR(PAGE_TO_ADDR(dst)),
+           (const void *) PADDR_TO_KVADDR(PAGE_TO_ADDR(src)), PAGE_SIZE);
+
+    spinlock_acquire(&cm_spinlock);
+
+    cm->cm_frames[dst].cf_rmap = cm->cm_frames[src].cf_rmap;
+    cm->cm_frames[dst].cf_referenced = cm->cm_frames[src].cf_referenced;
+    cm->cm_frames[dst].cf_age = cm->cm_frames[src].cf_age;
+    cm->cm_frames[src].cf_rmap = NULL;
+
+    /* The swap cache copy of the page now belongs to the new frame. */
+    p_page_t slot = swapmap.sm_cached[src];
+    if (slot != 0) {
+        swapmap.sm_cached[dst] = slot;
+        swapmap.sm_cached[src] = 0;
+        *cm_entry(slot) = PP_USED | SWAP_CACHED | dst;
+    }
+
+    cm->cm_frames[dst].cf_entry = entry & (~PP_BUSY);
+    result = update_pt_entries(dst, src);
+    KASSERT(result == 0);
+
+    free_ppage(src);
+
+    spinlock_release(&cm_spinlock);
+
+ done:
+    for (size_t i = 0; i < num_owners; i++) {
+        lock_release(owners[i]->as_lock);
+    }
+
+    return result;
+}
+
+/*
+Gives the frames of a block taken by compaction back: the frames still in use are no longer
+busy, and the free ones go back to the buddy allocator, merging into larger blocks.
+*/
+static
+void
+compact_release(p_page_t base, p_page_t end)
+{
+    KASSERT(spinlock_do_i_hold(&cm_spinlock));
+
+    for (p_page_t p_page = base; p_page < end; p_page++) {
+        cm_unbusy(p_page);
+    }
+}
+
+/*
+Frees an aligned block of 2^order page frames by moving the pages in it elsewhere, for a kernel
+allocation of several frames. The block picked is the one with the fewest pages to move among
+those holding only free frames and frames compact_movable accepts. Its free frames are taken out
+of the buddy allocator and its used frames are made busy, so nothing else lands in the block
+while its pages are moved. Cached file pages are dropped instead of moved.
+
+Takes the global paging lock unless this thread holds it, and gives up if another thread does.
+Must not be called with a spinlock held or interrupts disabled, as moving a page waits for the
+TLB shootdowns. Returns 0 if a free block of the order is available.
+*/
+int
+vm_compact(unsigned order)
+{
+    KASSERT(order < BUDDY_ORDERS);
+    KASSERT(!curthread->t_in_interrupt);
+
+    bool acquired = lock_do_i_hold(global_lock);
+    if (!acquired && !lock_acquire_if_not_held(global_lock)) {
+        return EBUSY;
+    }
+
+    size_t size = 1U << order;
+    p_page_t base = 0;
+    size_t moves = size + 1;
+    int result = 0;
+
+    spinlock_acquire(&cm_spinlock);
+
+    /* Before swap is set up there are no user pages to move. */
+    if (swapmap.sm_cached == NULL) {
+        result = ENOMEM;
+        goto unlock;
+    }
+
+    zero_pool_drain();
+
+    for (p_page_t start = ROUNDUP(first_alloc_page, size); start + size <= last_page; start += size) {
+        size_t used = 0;
+        bool movable = true;
+
+        for (p_page_t p_page = start; p_page < start + size && movable && used < moves; p_page++) {
+            cm_entry_t entry = cm->cm_frames[p_page].cf_entry;
+            if (entry & PP_USED) {
+                movable = compact_movable(p_page);
+                used++;
+            } else if (entry & PP_BUSY) {
+                movable = false;
+            }
+        }
+
+        if (movable && used < moves) {
+            base = start;
+            moves = used;
+        }
+
+        if (moves == 0) {
+            break;
+        }
+    }
+
+    /* The pages moved need as many free frames outside the block, on top of the minimum. */
+    if (base == 0 || vm_free_pages() < size + free_min_pages) {
+        result = ENOMEM;
+        goto unlock;
+    }
+
+    p_page_t p_page = base;
+    while (p_page < base + size) {
+        if (pagecache_frame(p_page)) {
+            pagecache_drop_frame(p_page);
+        }
+
+        if (cm->cm_frames[p_page].cf_entry & PP_USED) {
+            cm->cm_frames[p_page].cf_entry = cm->cm_frames[p_page].cf_entry | PP_BUSY;
+            p_page++;
+            continue;
+        }
+
+        /* The frames before it in the block are taken, so a free frame starts a free block. */
+        unsigned k = 0;
+        while (k < BUDDY_ORDERS && p_page % (1U << k) == 0 && !buddy_isfree(p_page, k)) {
+            k++;
+        }
+
+        /* A frame on its way elsewhere, such as to the zero pool, is not in a free block. */
+        if (k >= BUDDY_ORDERS || p_page % (1U << k) != 0) {
+            compact_release(base, p_page);
+            result = EBUSY;
+            goto unlock;
+        }
+
+        /* The whole block was already free. */
+        if (k > order) {
+            goto unlock;
+        }
+
+        buddy_remove(p_page, k);
+        for (p_page_t free_page = p_page; free_page < p_page + (1U << k); free_page++) {
+            cm->cm_frames[free_page].cf_entry = PP_BUSY;
+        }
+        p_page += 1U << k;
+    }
+
+    spinlock_release(&cm_spinlock);
+
+    for (p_page = base; p_page < base + size && result == 0; p_page++) {
+        result = compact_move(p_page);
+    }
+
+    spinlock_acquire(&cm_spinlock);
+    compact_release(base, base + size);
+
+ unlock:
+    spinlock_release(&cm_spinlock);
+
+    if (!acquired) {
+        lock_release(global_lock);
+    }
+
+    return result;
+}
+
+/*
+Compaction by the paging daemon, after its reclaim pass: for a block alloc_kpages could not find,
+or to keep a free block of 2^COMPACT_ORDER frames while free frames are plentiful.
+*/
+static
+void
+compact_background()
+{
+    KASSERT(lock_do_i_hold(global_lock));
+
+    spinlock_acquire(&cm_spinlock);
+
+    unsigned order = (compact_wanted > COMPACT_ORDER) ? compact_wanted : COMPACT_ORDER;
+    bool wanted = compact_wanted != 0;
+    compact_wanted = 0;
+
+    unsigned k = order;
+    while (k < BUDDY_ORDERS && cm->bd_head[k] == 0) {
+        k++;
+    }
+
+    bool needed = k >= BUDDY_ORDERS && (wanted || vm_free_pages() >= free_high_pages);
+
+    spinlock_release(&cm_spinlock);
+
+    if (needed) {
+        vm_compact(order);
+    }
+}
+
+void
+paging_daemon(void *data1, unsigned long data2)
+{
+    (void) data1;
+    (void) data2;
+    bool stuck = false;
+    int result;
+
+    while(true) {
+        /* After a pass that could not free enough, only try again when woken. */
+        spinlock_acquire(&cm_spinlock);
+        if ((stuck || vm_free_pages() >= free_low_pages) && compact_wanted == 0) {
+            wchan_sleep(daemon_wchan, &cm_spinlock);
+        }
+        spinlock_release(&cm_spinlock);
+
+        lock_acquire(global_lock);
+
+        /* Victims are picked and written out in batches, in as few disk writes as possible. */
+        stuck = false;
+        do {
+            result = swap_out(DAEMON_EVICT_NUM);
+        } while (result == 0);
+
+        if (result != ENOUGHFREE) {
+            stuck = true;
+        }
+
+        compact_background();
+
+        lock_release(global_lock);
+
+        spinlock_acquire(&cm_spinlock);
+        daemon_passes++;
+        if (free_waiters > 0) {
+            wchan_wakeall(free_wchan, &cm_spinlock);
+        }
+        spinlock_release(&cm_spinlock);
+    }
+}
+
+/*
+Checks if a frame may be merged by the page merging thread: it must hold a private user page,
+not an l1 page table or a page cache page, and must not be busy, pinned or the zero page. The
+cm_spinlock must be held.
+*/
+static
+bool
+ksm_mergeable(p_page_t p_page)
+{
+    KASSERT(spinlock_do_i_hold(&cm_spinlock));
+
+    if (p_page == zero_page || !entry_swappable(p_page)) {
+        return false;
+    }
+
+    /* l1 page tables and page cache frames have kernel virtual pages. */
+    return (*cm_entry(p_page) & VP_MASK) < 0x00080000;
+}
+
+/*
+Finds the l1 page table through which the owner rm maps its page, or NULL if the page table is in
+swap or the page is in a shared mapping, whose frames stay with the file.
+*/
+static
+struct l1_pt *
+ksm_owner_l1_pt(struct rmap *rm)
+{
+    l2_entry_t l2_entry = rm->rm_as->l2_pt->l2_entries[L2_PNUM(rm->rm_vaddr)];
+    KASSERT(l2_entry & ENTRY_VALID);
+
+    if (!in_ram(l2_entry & PAGE_MASK)) {
+        return NULL;
+    }
+
+    struct as_region *region = as_find_region(rm->rm_as, rm->rm_vaddr);
+    if (region != NULL && region->ar_shared) {
+        return NULL;
+    }
+
+    return (struct l1_pt *) PADDR_TO_KVADDR(PAGE_TO_ADDR(l2_entry & PAGE_MASK));
+}
+
+/*
+Makes every mapping of a frame read only, and waits until they are dropped from the TLBs of the
+CPUs that ran its owners, so no write can reach the frame once this returns. Returns false, with
+nothing changed, if an owner cannot be reached. The locks of all the owners must be held.
+*/
+static
+bool
+ksm_protect(p_page_t p_page)
+{
+    for (struct rmap *rm = *cm_rmap(p_page); rm != NULL; rm = rm->rm_next) {
+        if (ksm_owner_l1_pt(rm) == NULL) {
+            return false;
+        }
+    }
+
+    for (struct rmap *rm = *cm_rmap(p_page); rm != NULL; rm = rm->rm_next) {
+        struct l1_pt *l1_pt = ksm_owner_l1_pt(rm);
+        v_page_l1_t v_l1 = L1_PNUM(rm->rm_vaddr);
+
+        KASSERT((l1_pt->l1_entries[v_l1] & PAGE_MASK) == p_page);
+        l1_pt->l1_entries[v_l1] = l1_pt->l1_entries[v_l1] & (~ENTRY_WRITABLE);
+
+        struct tlb_batch batch;
+        vm_tlb_batch_init(&batch, rm->rm_as);
+        vm_tlb_batch_add(&batch, rm->rm_vaddr);
+        vm_tlb_batch_sync(&batch);
+    }
+
+    return true;
+}
+
+/*
+Compares two frames a word at a time.
+*/
+static
+bool
+ksm_same(p_page_t a, p_page_t b)
+{
+    const uint32_t *a_words = (const uint32_t *) PADDR_TO_KVADDR(PAGE_TO_ADDR(a));
+    const uint32_t *b_words = (const uint32_t *) PADDR_TO_KVADDR(PAGE_TO_ADDR(b));
+
+    for (size_t i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+        if (a_words[i] != b_words[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+Points every mapping of dup at keep instead, and frees dup, if the two frames still hold the same
+bytes. keep is the zero page, or a frame of the same virtual page as dup. Both frames are made
+busy, which keeps the TLB refill from mapping them and keeps a freed frame from being reused, and
+every mapping of them is made read only before they are compared, with the locks of all their
+owners held. The global paging lock keeps them from moving to or from swap meanwhile.
+*/
+static
+bool
+ksm_merge(p_page_t dup, p_page_t keep)
+{
+    struct addrspace **owners = NULL;
+    size_t num_rmap = 0;
+    size_t num_owners = 0;
+    bool merged = false;
+
+    lock_acquire(global_lock);
+    spinlock_acquire(&cm_spinlock);
+
+    if (!ksm_mergeable(dup) || (keep != zero_page && (!ksm_mergeable(keep) ||
+        (*cm_entry(keep) & VP_MASK) != (*cm_entry(dup) & VP_MASK)))) {
+        spinlock_release(&cm_spinlock);
+        lock_release(global_lock);
+        return false;
+    }
+
+    cm->cm_frames[dup].cf_entry = cm->cm_frames[dup].cf_entry | PP_BUSY;
+    if (keep != zero_page) {
+        cm->cm_frames[keep].cf_entry = cm->cm_frames[keep].cf_entry | PP_BUSY;
+    }
+
+    cm_entry_t dup_entry = cm->cm_frames[dup].cf_entry;
+    cm_entry_t keep_entry = cm->cm_frames[keep].cf_entry;
+    size_t refs = cm_getref(dup) + (keep == zero_page ? 0 : cm_getref(keep));
+
+    spinlock_release(&cm_spinlock);
+
+    owners = kmalloc(refs * sizeof(struct addrspace *));
+    if (owners == NULL) {
+        goto done;
+    }
+
+    spinlock_acquire(&cm_spinlock);
+
+    /* Owners added in the meantime are caught once all the owners are locked. */
+    for (struct rmap *rm = *cm_rmap(dup); rm != NULL && num_rmap < refs; rm = rm->rm_next) {
+        owners[num_rmap] = rm->rm_as;
+        num_rmap++;
+    }
+
+    if (keep != zero_page) {
+        for (struct rmap *rm = *cm_rmap(keep); rm != NULL && num_rmap < refs; rm = rm->rm_next) {
+            owners[num_rmap] = rm->rm_as;
+            num_rmap++;
+        }
+    }
+
+    spinlock_release(&cm_spinlock);
+
+    /* Address spaces owning both frames, or one of them at several addresses, are locked once. */
+    for (size_t i = 0; i < num_rmap; i++) {
+        struct addrspace *as = owners[i];
+        if (!lock_do_i_hold(as->as_lock)) {
+            lock_acquire(as->as_lock);
+            owners[num_owners] = as;
+            num_owners++;
+        }
+    }
+
+    /* A frame whose owners changed before they were all locked is left alone. */
+    spinlock_acquire(&cm_spinlock);
+    bool stable = cm->cm_frames[dup].cf_entry == dup_entry && owners_locked(dup);
+    if (keep != zero_page) {
+        stable = stable && cm->cm_frames[keep].cf_entry == keep_entry && owners_locked(keep);
+    }
+    spinlock_release(&cm_spinlock);
+
+    if (!stable || !ksm_protect(dup) || (keep != zero_page && !ksm_protect(keep))) {
+        goto done;
+    }
+
+    if (!ksm_same(dup, keep)) {
+        goto done;
+    }
+
+    spinlock_acquire(&cm_spinlock);
+
+    /* Owners sharing an l1 page table see their entry already changed. */
+    struct rmap *rm;
+    while ((rm = *cm_rmap(dup)) != NULL) {
+        struct addrspace *as = rm->rm_as;
+        vaddr_t vaddr = rm->rm_vaddr;
+
+        if (cm_addref(keep, as, vaddr)) {
+            break;
+        }
+
+        struct l1_pt *l1_pt = ksm_owner_l1_pt(rm);
+        v_page_l1_t v_l1 = L1_PNUM(vaddr);
+        if ((l1_pt->l1_entries[v_l1] & PAGE_MASK) == dup) {
+            l1_pt->l1_entries[v_l1] = (l1_pt->l1_entries[v_l1] & (~PAGE_MASK)) | keep;
+        }
+
+        cm_remref(dup, as, vaddr);
+    }
+
+    merged = (*cm_rmap(dup) == NULL);
+    if (merged) {
+        cm->cm_frames[dup].cf_entry = cm->cm_frames[dup].cf_entry & (~PP_BUSY);
+        free_ppage(dup);
+    }
+
+    spinlock_release(&cm_spinlock);
+
+ done:
+    for (size_t i = 0; i < num_owners; i++) {
+        lock_release(owners[i]->as_lock);
+    }
+    kfree(owners);
+
+    spinlock_acquire(&cm_spinlock);
+    if (!merged) {
+        cm_unbusy(dup);
+    }
+    if (keep != zero_page) {
+        cm_unbusy(keep);
+    }
+    spinlock_release(&cm_spinlock);
+
+    lock_release(global_lock);
+
+    return merged;
+}
+
+/*
+Checks if a frame holds a page the merging thread may look at, and gives its virtual page.
+*/
+bool
+vm_ksm_candidate(p_page_t p_page, v_page_t *v_page)
+{
+    spinlock_acquire(&cm_spinlock);
+
+    bool mergeable = ksm_mergeable(p_page);
+    *v_page = *cm_entry(p_page) & VP_MASK;
+
+    spinlock_release(&cm_spinlock);
+
+    return mergeable;
+}
+
+/*
+Merges dup into keep, a frame of the same virtual page, if they hold the same bytes.
+*/
+bool
+vm_ksm_merge(p_page_t dup, p_page_t keep)
+{
+    KASSERT(dup != keep);
 
-     done:
-        cv_broadcast(global_cv, global_lock);
-        lock_release(global_lock);
-        thread_yield();
-    }
+    return ksm_merge(dup, keep);
+}
+
+/*
+Maps the zero page in place of dup, if it holds only zeros.
+*/
+bool
+vm_ksm_merge_zero(p_page_t dup)
+{
+    return ksm_merge(dup, zero_page);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -768,6 +2932,23 @@ get_l1_pt(struct l2_pt *l2_pt, v_page_l2_t v_l2, struct l1_pt **l1_pt_ret, bool
         }
 
         p_page_t new_p_page = ADDR_TO_PAGE(KVADDR_TO_PADDR((vaddr_t) l1_pt));
+        struct addrspace *as = proc_getas();
+        vaddr_t vaddr = PAGE_TO_ADDR(PNUM_TO_PAGE(v_l2, 0));
+
+        KASSERT(as->l2_pt == l2_pt);
+
+        spinlock_acquire(&cm_spinlock);
+
+        result = cm_addref(new_p_page, as, vaddr);
+        if (result) {
+            spinlock_release(&cm_spinlock);
+            kfree(l1_pt);
+            return result;
+        }
+
+        cm_remref(p_page, as, vaddr);
+
+        spinlock_release(&cm_spinlock);
 
         struct l1_pt *l1_pt_orig = (struct l1_pt *) PADDR_TO_KVADDR(PAGE_TO_ADDR(p_page));
         for (v_page_l1_t l1_val = 0; l1_val < NUM_L1PT_ENTRIES; l1_val++) {
@@ -779,16 +2960,6 @@ get_l1_pt(struct l2_pt *l2_pt, v_page_l2_t v_l2, struct l1_pt **l1_pt_ret, bool
                                 | ENTRY_READABLE
                                 | ENTRY_WRITABLE
                                 | new_p_page;
-
-        spinlock_acquire(&cm_spinlock);
-
-        cm_incref(new_p_page);
-        add_pid8(new_p_page, curproc->pid);
-
-        cm_decref(p_page);
-        rem_pid8(p_page, curproc->pid);
-
-        spinlock_release(&cm_spinlock);
     } else {
         l1_pt = (struct l1_pt*) PADDR_TO_KVADDR(PAGE_TO_ADDR(p_page));
     }
@@ -810,28 +2981,39 @@ l1_alloc_page(struct l1_pt *l1_pt, v_page_l1_t v_l1, v_page_t v_page, p_page_t *
 
     spinlock_acquire(&cm_spinlock);
 
-    p_page_t p_page = first_alloc_page;
-    result = find_free(1, &p_page);
+    p_page_t p_page;
+    bool zeroed;
+    result = find_free_zeroed(&p_page, &zeroed);
     if (result) {
         spinlock_release(&cm_spinlock);
         return result;
     }
 
     cm_counter++;
-    cm->cm_entries[p_page] = 0
+    cm->cm_frames[p_page].cf_entry = 0
                             | PP_USED
                             | v_page;
 
+    result = cm_addref(p_page, proc_getas(), PAGE_TO_ADDR(v_page));
+    if (result) {
+        free_ppage(p_page);
+        spinlock_release(&cm_spinlock);
+        return result;
+    }
+
     l1_pt->l1_entries[v_l1] = 0
                             | ENTRY_VALID
                             | ENTRY_READABLE
                             | ENTRY_WRITABLE
                             | p_page;
-    cm_incref(p_page);
-    add_pid8(p_page, curproc->pid);
 
     spinlock_release(&cm_spinlock);
 
+    /* The caller holds the address space lock, so the frame cannot be evicted before this. */
+    if (!zeroed) {
+        bzero((void *) PADDR_TO_KVADDR(PAGE_TO_ADDR(p_page)), PAGE_SIZE);
+    }
+
     if (p_page_ret != NULL) {
         *p_page_ret = p_page;
     }
@@ -855,19 +3037,24 @@ add_l1_pt(struct l2_pt *l2_pt, v_page_l2_t v_l2, struct l1_pt **l1_pt_ret)
     }
 
     p_page_t new_p_page = ADDR_TO_PAGE(KVADDR_TO_PADDR((vaddr_t) l1_pt));
-    l2_pt->l2_entries[v_l2] = 0
-                            | ENTRY_VALID
-                            | ENTRY_READABLE
-                            | ENTRY_WRITABLE
-                            | new_p_page;
 
     spinlock_acquire(&cm_spinlock);
 
-    cm_incref(new_p_page);
-    add_pid8(new_p_page, curproc->pid);
+    result = cm_addref(new_p_page, proc_getas(), PAGE_TO_ADDR(PNUM_TO_PAGE(v_l2, 0)));
 
     spinlock_release(&cm_spinlock);
 
+    if (result) {
+        kfree(l1_pt);
+        return result;
+    }
+
+    l2_pt->l2_entries[v_l2] = 0
+                            | ENTRY_VALID
+                            | ENTRY_READABLE
+                            | ENTRY_WRITABLE
+                            | new_p_page;
+
     if (l1_pt_ret != NULL) {
         *l1_pt_ret = l1_pt;
     }
@@ -887,21 +3074,25 @@ copy_user_data(struct l1_pt *l1_pt, v_page_l1_t v_l1, p_page_t old_page,
     KASSERT(spinlock_do_i_hold(&cm_spinlock));
     int result;
 
-    p_page_t p_page = first_alloc_page;
+    p_page_t p_page;
     result = find_free(1, &p_page);
     if (result) {
         return result;
     }
 
     cm_counter++;
-    cm->cm_entries[p_page] = 0
+    cm->cm_frames[p_page].cf_entry = 0
                             | PP_USED
                             | v_page;
-    cm_incref(p_page);
-    add_pid8(p_page, curproc->pid);
 
-    cm_decref(old_page);
-    rem_pid8(old_page, curproc->pid);
+    struct addrspace *as = proc_getas();
+    result = cm_addref(p_page, as, PAGE_TO_ADDR(v_page));
+    if (result) {
+        free_ppage(p_page);
+        return result;
+    }
+
+    cm_remref(old_page, as, PAGE_TO_ADDR(v_page));
 
     const void *src = (const void *) PADDR_TO_KVADDR(PAGE_TO_ADDR(old_page));
     void *dst = (void *) PADDR_TO_KVADDR(PAGE_TO_ADDR(p_page));
@@ -921,17 +3112,17 @@ copy_user_data(struct l1_pt *l1_pt, v_page_l1_t v_l1, p_page_t old_page,
 }
 
 /*
-Removes the reference of the pid to the p_page, and frees it if there are no more references.
+Removes the reference of the address space as at vaddr to the p_page, and frees it if there are
+no more references.
 */
 void
-release_ppage(p_page_t p_page, pid_t pid)
+release_ppage(p_page_t p_page, struct addrspace *as, vaddr_t vaddr)
 {
     spinlock_acquire(&cm_spinlock);
 
-    if (cm_getref(p_page) > 1) {
-        cm_decref(p_page);
-        rem_pid8(p_page, pid);
-    } else {
+    cm_remref(p_page, as, vaddr);
+
+    if (cm_getref(p_page) == 0) {
         if (in_ram(p_page)) {
             free_ppage(p_page);
         } else {
@@ -945,22 +3136,45 @@ release_ppage(p_page_t p_page, pid_t pid)
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
-    lock_acquire(global_lock);
+    struct addrspace *as = curproc->p_addrspace;
+    bool paging = false;
 
-    if (SWAP_ON){
-        swap_out();
+    if (as == NULL) {
+        return EFAULT;
     }
 
-    while (!enough_free()) {
-        cv_wait(global_cv, global_lock);
+    /* Reclaim happens in the paging daemon; a fault only waits for it when frames run out. */
+    if (!enough_free()) {
+        vm_wait_free();
     }
 
-    struct addrspace *as = curproc->p_addrspace;
-    pid_t pid = curproc->pid;
-
-    if (as->brk <= faultaddress && faultaddress < as->stack_top) {
+    /* A process at its resident set limit makes room by evicting its own pages. */
+    size_t excess = rss_excess(as);
+    if (excess > 0 && !lock_do_i_hold(global_lock)) {
+        lock_acquire(global_lock);
+        swap_out_as(as, (excess < DAEMON_EVICT_NUM) ? excess : DAEMON_EVICT_NUM);
         lock_release(global_lock);
-        return SIGSEGV;
+    }
+
+    unsigned majflt = as->as_majflt;
+
+    lock_acquire(as->as_lock);
+
+    /*
+    The space between the heap and the stack is only valid where something is mapped, or where
+    the stack can grow down to.
+    */
+    struct as_region *region = as_find_region(as, faultaddress);
+    if (region == NULL && as->brk <= faultaddress && faultaddress < as->stack_top) {
+        if (as_grow_stack(as, faultaddress)) {
+            lock_release(as->as_lock);
+            return SIGSEGV;
+        }
+    }
+
+    if (region != NULL && region->ar_mapped && !region->ar_readable) {
+        lock_release(as->as_lock);
+        return EFAULT;
     }
 
     int result;
@@ -970,87 +3184,172 @@ vm_fault(int faulttype, vaddr_t faultaddress)
     v_page_l1_t v_l1 = L1_PNUM(fault_page);
 
     struct l2_pt *l2_pt = as->l2_pt;
-    l2_entry_t l2_entry = l2_pt->l2_entries[v_l2];
+    l2_entry_t l2_entry;
+    l1_entry_t l1_entry;
 
     struct l1_pt *l1_pt;
 
+ retry:
+    l2_entry = l2_pt->l2_entries[v_l2];
+
+    /*
+    Paging in needs the global paging lock, which must be acquired before the address space
+    lock. Drop the address space lock, take both in order and look at the page tables again.
+    */
+    if (!paging && (l2_entry & ENTRY_VALID) && in_swap(l2_entry & PAGE_MASK)) {
+        goto need_paging;
+    }
+
     /* Get the l1 page table. */
     if (l2_entry & ENTRY_VALID) {
         /* Checks if a process must be able to modify the l1 page table. */
         bool writable = (faulttype == VM_FAULT_READONLY && !(l2_entry & ENTRY_WRITABLE));
         result = get_l1_pt(l2_pt, v_l2, &l1_pt, writable);
         if (result) {
-            lock_release(global_lock);
+            vm_unlock_as(as, paging);
             return result;
         }
 
     } else {
         result = add_l1_pt(l2_pt, v_l2, &l1_pt);
         if (result) {
-            lock_release(global_lock);
+            vm_unlock_as(as, paging);
             return result;
         }
     }
 
     p_page_t l1_p_page = ADDR_TO_PAGE(KVADDR_TO_PADDR((vaddr_t) l1_pt));
-    cm->cm_entries[l1_p_page] = cm->cm_entries[l1_p_page] | REF_BIT;
+    cm->cm_frames[l1_p_page].cf_referenced = 1;
 
-    l1_entry_t l1_entry = l1_pt->l1_entries[v_l1];
+    l1_entry = l1_pt->l1_entries[v_l1];
     p_page_t p_page;
+    bool copied = false;
+
+    if (!paging && (l1_entry & ENTRY_VALID) && in_swap(l1_entry & PAGE_MASK)) {
+        goto need_paging;
+    }
 
     /* Get the faulting address' physical address */
     if (l1_entry & ENTRY_VALID) {
         p_page_t old_page = l1_entry & PAGE_MASK;
         KASSERT(in_all_memory(old_page));
-        KASSERT((cm->cm_entries[old_page] & PAGE_MASK) == ADDR_TO_PAGE(fault_page));
+        KASSERT(old_page == zero_page || (*cm_entry(old_page) & VP_MASK) == ADDR_TO_PAGE(fault_page));
 
         spinlock_acquire(&cm_spinlock);
 
+        /* mlock can ask for a write to a read only page that has been evicted since it looked. */
+        if (in_swap(old_page)) {
+            result = swap_in_readahead(l1_pt, v_l1, &old_page);
+            if (result) {
+                spinlock_release(&cm_spinlock);
+                vm_unlock_as(as, paging);
+                return result;
+            }
+        }
+
         if (faulttype == VM_FAULT_READONLY && !(l1_entry & ENTRY_WRITABLE)) {
             KASSERT(in_ram(old_page));
 
-            if (cm_getref(old_page) > 1) {
+            if (!as_region_writeable(as, fault_page)) {
+                spinlock_release(&cm_spinlock);
+                vm_unlock_as(as, paging);
+                return EFAULT;
+            }
+
+            if (region != NULL && region->ar_shared) {
+                /* Shared mappings are never copied; note the write for write back instead. */
+                l1_pt->l1_entries[v_l1] = l1_pt->l1_entries[v_l1] | ENTRY_WRITABLE | ENTRY_DIRTY;
+                cm->cm_frames[old_page].cf_entry = cm->cm_frames[old_page].cf_entry | DIRTY;
+                p_page = old_page;
+            } else if (cm_getref(old_page) > 1) {
                 result = copy_user_data(l1_pt, v_l1, old_page, ADDR_TO_PAGE(fault_page), &p_page);
                 if (result) {
                     spinlock_release(&cm_spinlock);
-                    lock_release(global_lock);
+                    vm_unlock_as(as, paging);
                     return result;
                 }
+                copied = true;
+
+                /* A locked page stays locked in its new frame. */
+                if (l1_entry & ENTRY_LOCKED) {
+                    cm_munlock(old_page);
+                    cm_mlock(p_page);
+                    l1_pt->l1_entries[v_l1] = l1_pt->l1_entries[v_l1] | ENTRY_LOCKED;
+                }
             } else {
                 l1_pt->l1_entries[v_l1] = l1_pt->l1_entries[v_l1] | ENTRY_WRITABLE;
+                cm->cm_frames[old_page].cf_entry = cm->cm_frames[old_page].cf_entry | DIRTY;
                 p_page = old_page;
             }
 
         } else {
-            if (in_swap(old_page)) {
-                result = swap_in_data(&old_page);
-                if (result) {
-                    spinlock_release(&cm_spinlock);
-                    lock_release(global_lock);
-                }
-            }
-
             p_page = old_page;
         }
 
         spinlock_release(&cm_spinlock);
 
     } else {
-        result = l1_alloc_page(l1_pt, v_l1, ADDR_TO_PAGE(fault_page), &p_page);
-        if (result) {
-            lock_release(global_lock);
-            return result;
+        /* A new page must not show up in an l1 page table shared with another process. */
+        if (!(l2_pt->l2_entries[v_l2] & ENTRY_WRITABLE)) {
+            result = get_l1_pt(l2_pt, v_l2, &l1_pt, true);
+            if (result) {
+                vm_unlock_as(as, paging);
+                return result;
+            }
+        }
+
+        /* Reading a page with nothing in it yet maps the zero page until the first write. */
+        if (faulttype == VM_FAULT_READ && (region == NULL || !region->ar_shared) &&
+            as_page_zero_fill(as, fault_page)) {
+            l1_pt->l1_entries[v_l1] = 0
+                                    | ENTRY_VALID
+                                    | ENTRY_READABLE
+                                    | zero_page;
+            p_page = zero_page;
+        } else {
+            result = l1_alloc_page(l1_pt, v_l1, ADDR_TO_PAGE(fault_page), &p_page);
+            if (result) {
+                vm_unlock_as(as, paging);
+                return result;
+            }
+
+            /* Pages of the executable are read in on their first touch. */
+            result = as_fill_page(as, fault_page, PADDR_TO_KVADDR(PAGE_TO_ADDR(p_page)));
+            if (result) {
+                free_vpage(l2_pt, v_l2, v_l1);
+                vm_unlock_as(as, paging);
+                return result;
+            }
+
+            if (!as_region_writeable(as, fault_page)) {
+                l1_pt->l1_entries[v_l1] = l1_pt->l1_entries[v_l1] & (~ENTRY_WRITABLE);
+            } else if (region != NULL && region->ar_shared) {
+                /* Map shared pages read only until written, so only dirty pages are written back. */
+                if (faulttype == VM_FAULT_READ) {
+                    l1_pt->l1_entries[v_l1] = l1_pt->l1_entries[v_l1] & (~ENTRY_WRITABLE);
+                } else {
+                    l1_pt->l1_entries[v_l1] = l1_pt->l1_entries[v_l1] | ENTRY_DIRTY;
+                }
+            }
         }
     }
 
+    /* Other CPUs that ran this address space may still map the page to the frame it was copied from. */
+    if (copied) {
+        struct tlb_batch batch;
+        vm_tlb_batch_init(&batch, as);
+        vm_tlb_batch_add(&batch, fault_page);
+        vm_tlb_batch_sync(&batch);
+    }
+
     uint32_t entryhi;
     uint32_t entrylo;
     l1_entry_t new_l1_entry = l1_pt->l1_entries[v_l1];
     p_page_t p_page_high = p_page << 12;
 
-    cm->cm_entries[p_page] = cm->cm_entries[p_page] | REF_BIT;
+    cm->cm_frames[p_page].cf_referenced = 1;
 
-    entryhi = 0 | fault_page | pid << 6;
+    entryhi = 0 | fault_page | ASID_HW(as->as_asid) << TLBHI_PIDSHIFT;
 
     if (new_l1_entry & ENTRY_WRITABLE) {
         entrylo = 0 | p_page_high | TLBLO_VALID | TLBLO_DIRTY;
@@ -1060,28 +3359,33 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
     int spl = splhigh();
 
-    uint32_t entryhi2;
-    uint32_t entrylo2;
-    uint32_t index;
-    bool written = false;
-
-    for (index = 0; index < NUM_TLB; index++) {
-    tlb_read(&entryhi2, &entrylo2, index);
-        if ((entryhi & TLBHI_VPAGE) == (entryhi2 & TLBHI_VPAGE)) {
-            tlb_write(entryhi, entrylo, index);
-            written = true;
-            break;
-        }
-    }
-
-    if (!written) {
+    /*
+    Entries of other address spaces stay in the TLB under their own ASIDs, so only an entry of
+    this one for the page may be replaced; two entries matching the same page and ASID would
+    be a fatal TLB conflict.
+    */
+    int32_t index = tlb_probe(entryhi, 0);
+    if (index >= 0) {
+        tlb_write(entryhi, entrylo, index);
+    } else {
         tlb_random(entryhi, entrylo);
     }
 
     splx(spl);
 
-    lock_release(global_lock);
+    if (as->as_majflt == majflt) {
+        as->as_minflt++;
+    }
+
+    vm_unlock_as(as, paging);
     return 0;
+
+ need_paging:
+    lock_release(as->as_lock);
+    lock_acquire(global_lock);
+    lock_acquire(as->as_lock);
+    paging = true;
+    goto retry;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////
@@ -1090,10 +3394,14 @@ void
 free_vpage(struct l2_pt *l2_pt, v_page_l2_t v_l2, v_page_l1_t v_l1)
 {
     KASSERT(l2_pt != NULL);
-    KASSERT(l2_pt->l2_entries[v_l2] & ENTRY_VALID);
     struct l1_pt *l1_pt;
     int result;
 
+    /* Heap pages are allocated on first touch, so this part of the heap might not exist. */
+    if (!(l2_pt->l2_entries[v_l2] & ENTRY_VALID)) {
+        return;
+    }
+
     result = get_l1_pt(l2_pt, v_l2, &l1_pt, true);
     if (result) {
         return;
@@ -1103,23 +3411,219 @@ free_vpage(struct l2_pt *l2_pt, v_page_l2_t v_l2, v_page_l1_t v_l1)
 
     if (l1_entry & ENTRY_VALID) {
         p_page_t p_page = l1_entry & PAGE_MASK;
-        release_ppage(p_page, curproc->pid);
+
+        if (l1_entry & ENTRY_LOCKED) {
+            spinlock_acquire(&cm_spinlock);
+            cm_munlock(p_page);
+            spinlock_release(&cm_spinlock);
+        }
+
+        release_ppage(p_page, proc_getas(), PAGE_TO_ADDR(PNUM_TO_PAGE(v_l2, v_l1)));
     }
 
     l1_pt->l1_entries[v_l1] = 0;
 }
 
+/*
+Checks that the l1 page table at v_l2 has no entries left, so it can be freed; a missing table
+has none. The l1 page table is brought in from swap if needed.
+*/
+bool
+l1_pt_unused(struct l2_pt *l2_pt, v_page_l2_t v_l2)
+{
+    struct l1_pt *l1_pt;
+
+    if (!(l2_pt->l2_entries[v_l2] & ENTRY_VALID)) {
+        return true;
+    }
+
+    if (get_l1_pt(l2_pt, v_l2, &l1_pt, false)) {
+        return false;
+    }
+
+    for (v_page_l1_t v_l1 = 0; v_l1 < NUM_L1PT_ENTRIES; v_l1++) {
+        if (l1_pt->l1_entries[v_l1] != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 void
 free_l1_pt(struct l2_pt *l2_pt, v_page_l2_t v_l2)
 {
     if (l2_pt->l2_entries[v_l2] & ENTRY_VALID) {
         p_page_t p_page = l2_pt->l2_entries[v_l2] & PAGE_MASK;
-        release_ppage(p_page, curproc->pid);
+        release_ppage(p_page, proc_getas(), PAGE_TO_ADDR(PNUM_TO_PAGE(v_l2, 0)));
 
         l2_pt->l2_entries[v_l2] = 0;
     }
 }
 
+/*
+Locks the page at vaddr for mlock if it is in RAM, and writable as well if write is set: its l1
+entry is marked ENTRY_LOCKED and its frame is pinned, so the clock passes it over. Otherwise
+nothing is done, and *faulttype is set to the fault that brings the page in; once the page is
+locked it is set to -1. The address space lock must be held, as for vm_lock_as.
+*/
+int
+vm_mlock_page(struct addrspace *as, vaddr_t vaddr, bool write, int *faulttype)
+{
+    KASSERT(lock_do_i_hold(as->as_lock));
+    struct l2_pt *l2_pt = as->l2_pt;
+    v_page_l2_t v_l2 = L2_PNUM(vaddr);
+    v_page_l1_t v_l1 = L1_PNUM(vaddr);
+    struct l1_pt *l1_pt;
+    int result;
+
+    *faulttype = write ? VM_FAULT_WRITE : VM_FAULT_READ;
+
+    if (!(l2_pt->l2_entries[v_l2] & ENTRY_VALID)) {
+        return 0;
+    }
+
+    /* Locked entries keep their l1 page table to this address space; see struct cm_frame. */
+    result = get_l1_pt(l2_pt, v_l2, &l1_pt, true);
+    if (result) {
+        return result;
+    }
+
+    l1_entry_t l1_entry = l1_pt->l1_entries[v_l1];
+    p_page_t p_page = l1_entry & PAGE_MASK;
+
+    if (!(l1_entry & ENTRY_VALID) || in_swap(p_page)) {
+        return 0;
+    }
+
+    if (write && !(l1_entry & ENTRY_WRITABLE)) {
+        *faulttype = VM_FAULT_READONLY;
+        return 0;
+    }
+
+    *faulttype = -1;
+
+    if (l1_entry & ENTRY_LOCKED) {
+        return 0;
+    }
+
+    spinlock_acquire(&cm_spinlock);
+
+    if (cm->cm_frames[p_page].cf_pins == 0 && p_page != zero_page &&
+        mlocked_pages >= mlock_max_pages) {
+        spinlock_release(&cm_spinlock);
+        return EAGAIN;
+    }
+
+    cm_mlock(p_page);
+
+    spinlock_release(&cm_spinlock);
+
+    l1_pt->l1_entries[v_l1] = l1_entry | ENTRY_LOCKED;
+
+    return 0;
+}
+
+/*
+Unlocks the page at vaddr if mlock locked it. The address space lock must be held, as for
+vm_lock_as.
+*/
+int
+vm_munlock_page(struct addrspace *as, vaddr_t vaddr)
+{
+    KASSERT(lock_do_i_hold(as->as_lock));
+    struct l2_pt *l2_pt = as->l2_pt;
+    v_page_l2_t v_l2 = L2_PNUM(vaddr);
+    v_page_l1_t v_l1 = L1_PNUM(vaddr);
+    struct l1_pt *l1_pt;
+    int result;
+
+    if (!(l2_pt->l2_entries[v_l2] & ENTRY_VALID)) {
+        return 0;
+    }
+
+    result = get_l1_pt(l2_pt, v_l2, &l1_pt, false);
+    if (result) {
+        return result;
+    }
+
+    l1_entry_t l1_entry = l1_pt->l1_entries[v_l1];
+    if (!(l1_entry & ENTRY_LOCKED)) {
+        return 0;
+    }
+
+    spinlock_acquire(&cm_spinlock);
+    cm_munlock(l1_entry & PAGE_MASK);
+    spinlock_release(&cm_spinlock);
+
+    l1_pt->l1_entries[v_l1] = l1_entry & (~ENTRY_LOCKED);
+
+    return 0;
+}
+
+/*
+Writes the dirty pages of a shared file mapping that lie between start and end back to the
+file. The address space lock must be held, and the global paging lock as well if any of the
+address space's pages are in swap.
+*/
+int
+vm_writeback_range(struct addrspace *as, struct as_region *region, vaddr_t start, vaddr_t end)
+{
+    KASSERT(lock_do_i_hold(as->as_lock));
+    KASSERT(region->ar_vnode != NULL);
+    struct l2_pt *l2_pt = as->l2_pt;
+    struct l1_pt *l1_pt;
+    struct iovec iov;
+    struct uio ku;
+    int result;
+
+    /* Only the part of the mapping that came from the file is written back. */
+    vaddr_t file_end = region->ar_vbase + region->ar_filesize;
+    if (end > file_end) {
+        end = file_end;
+    }
+
+    for (vaddr_t v_page = start; v_page < end; v_page += PAGE_SIZE) {
+        v_page_l2_t v_l2 = L2_PNUM(v_page);
+        v_page_l1_t v_l1 = L1_PNUM(v_page);
+
+        if (!(l2_pt->l2_entries[v_l2] & ENTRY_VALID)) {
+            continue;
+        }
+
+        result = get_l1_pt(l2_pt, v_l2, &l1_pt, false);
+        if (result) {
+            return result;
+        }
+
+        l1_entry_t l1_entry = l1_pt->l1_entries[v_l1];
+        if (!(l1_entry & ENTRY_VALID) || !(l1_entry & ENTRY_DIRTY)) {
+            continue;
+        }
+
+        p_page_t p_page = l1_entry & PAGE_MASK;
+        if (in_swap(p_page)) {
+            spinlock_acquire(&cm_spinlock);
+            result = swap_in_data(&p_page);
+            spinlock_release(&cm_spinlock);
+            if (result) {
+                return result;
+            }
+        }
+
+        size_t len = end - v_page < PAGE_SIZE ? end - v_page : PAGE_SIZE;
+        uio_kinit(&iov, &ku, (void *) PADDR_TO_KVADDR(PAGE_TO_ADDR(p_page)), len,
+                  region->ar_offset + (v_page - region->ar_vbase), UIO_WRITE);
+
+        result = VOP_WRITE(region->ar_vnode, &ku);
+        if (result) {
+            return result;
+        }
+    }
+
+    return 0;
+}
+
 /*
 Adds a physical apge to the specified l1 page table
 */
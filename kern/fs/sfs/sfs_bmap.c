@@ -37,6 +37,7 @@
 #include <lib.h>
 #include <vfs.h>
 #include <sfs.h>
+#include <pagecache.h>
 #include "sfsprivate.h"
 
 /*
@@ -225,6 +226,9 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 
 	vfs_biglock_acquire();
 
+	/* Cached data past the new end must not outlive the blocks. */
+	pagecache_purge(&sv->sv_absvn, len);
+
 	/*
 	 * Go through the direct blocks. Discard any that are
 	 * past the limit we're truncating to.
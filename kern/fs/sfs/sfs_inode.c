@@ -37,6 +37,7 @@
 #include <lib.h>
 #include <vfs.h>
 #include <sfs.h>
+#include <pagecache.h>
 #include "sfsprivate.h"
 
 
@@ -131,6 +132,9 @@ sfs_reclaim(struct vnode *v)
 	}
 	vnodearray_remove(sfs->sfs_vnodes, ix);
 
+	/* The cache is keyed by vnode; don't let a new vnode inherit pages. */
+	pagecache_purge(&sv->sv_absvn, 0);
+
 	vnode_cleanup(&sv->sv_absvn);
 
 	vfs_biglock_release();
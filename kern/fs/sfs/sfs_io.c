@@ -39,6 +39,8 @@
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
+#include <vm.h>
+#include <pagecache.h>
 #include "sfsprivate.h"
 
 ////////////////////////////////////////////////////////////
@@ -132,6 +134,110 @@ sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 //
 // File-level I/O
 
+/*
+ * Do I/O to (part of) a block of a file through the page cache page
+ * PG, which holds the block. The block is read into the page unless it
+ * is already there or is about to be overwritten completely. Writes go
+ * through to the disk right away, so cached pages never need to be
+ * written back.
+ *
+ * SKIPSTART and LEN are as for sfs_partialio.
+ */
+static
+int
+sfs_cachedio(struct sfs_vnode *sv, struct pc_page *pg, struct uio *uio,
+	     uint32_t skipstart, uint32_t len)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t diskblock;
+	uint32_t fileblock;
+	unsigned sector;
+	char *blockbuf;
+	int result;
+
+	KASSERT(SFS_BLOCKSIZE == PC_SECTOR_SIZE);
+	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
+	KASSERT(vfs_biglock_do_i_hold());
+
+	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	sector = fileblock % (PAGE_SIZE / SFS_BLOCKSIZE);
+	blockbuf = (char *)pagecache_data(pg) + sector * SFS_BLOCKSIZE;
+
+	if (!pagecache_valid(pg, sector) &&
+	    !(uio->uio_rw == UIO_WRITE && len == SFS_BLOCKSIZE)) {
+		result = sfs_bmap(sv, fileblock, false, &diskblock);
+		if (result) {
+			return result;
+		}
+
+		if (diskblock == 0) {
+			/* Not mapped (yet); the block reads as zeros. */
+			bzero(blockbuf, SFS_BLOCKSIZE);
+		}
+		else {
+			result = sfs_readblock(sfs, diskblock, blockbuf,
+					       SFS_BLOCKSIZE);
+			if (result) {
+				return result;
+			}
+		}
+		pagecache_setvalid(pg, sector, true);
+	}
+
+	result = uiomove(blockbuf + skipstart, len, uio);
+	if (result) {
+		/* A failed write may have left the cached block half done. */
+		if (uio->uio_rw == UIO_WRITE) {
+			pagecache_setvalid(pg, sector, false);
+		}
+		return result;
+	}
+
+	if (uio->uio_rw == UIO_WRITE) {
+		result = sfs_bmap(sv, fileblock, true, &diskblock);
+		if (result == 0) {
+			result = sfs_writeblock(sfs, diskblock, blockbuf,
+						SFS_BLOCKSIZE);
+		}
+		/* Keep the cache in line with what made it to disk. */
+		pagecache_setvalid(pg, sector, result == 0);
+		if (result) {
+			return result;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Do I/O to (part of) a block of a file through the page cache, if
+ * the cache can hold the page. Sets *CACHED to false without doing any
+ * I/O if it cannot, and the caller goes to the disk directly.
+ */
+static
+int
+sfs_trycachedio(struct sfs_vnode *sv, struct uio *uio,
+		uint32_t skipstart, uint32_t len, bool *cached)
+{
+	struct pc_page *pg;
+	off_t pageoff;
+	int result;
+
+	pageoff = uio->uio_offset - uio->uio_offset % PAGE_SIZE;
+
+	pg = pagecache_get(&sv->sv_absvn, pageoff);
+	if (pg == NULL) {
+		*cached = false;
+		return 0;
+	}
+
+	*cached = true;
+	result = sfs_cachedio(sv, pg, uio, skipstart, len);
+	pagecache_put(pg);
+
+	return result;
+}
+
 /*
  * Do I/O to a block of a file that doesn't cover the whole block.  We
  * need to read in the original block first, even if we're writing, so
@@ -160,6 +266,7 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
+	bool cached;
 
 	/* Allocate missing blocks if and only if we're writing */
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
@@ -169,6 +276,11 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	/* We're using a global static buffer; it had better be locked */
 	KASSERT(vfs_biglock_do_i_hold());
 
+	result = sfs_trycachedio(sv, uio, skipstart, len, &cached);
+	if (cached) {
+		return result;
+	}
+
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
@@ -233,6 +345,12 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	off_t diskoff;
 	off_t saveres;
 	off_t diskres;
+	bool cached;
+
+	result = sfs_trycachedio(sv, uio, 0, SFS_BLOCKSIZE, &cached);
+	if (cached) {
+		return result;
+	}
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -40,8 +40,32 @@
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct lock;
 
 
+/*
+ * A region of an executable mapped by as_define_region, or a mapping
+ * made by mmap. Its pages are read from the file when they are first
+ * touched; the part of the region past ar_filesize is zero-filled.
+ * Anonymous mappings have no vnode.
+ *
+ * Dirty pages of shared mappings are written back to the file when they
+ * are unmapped.
+ */
+struct as_region {
+        vaddr_t ar_vbase;
+        size_t ar_memsize;
+        struct vnode *ar_vnode;
+        off_t ar_offset;
+        size_t ar_filesize;
+        bool ar_readable;
+        bool ar_writeable;
+        bool ar_executable;
+        bool ar_mapped;         /* Made by mmap, so it can be unmapped */
+        bool ar_shared;         /* MAP_SHARED; writes go back to the file */
+        struct as_region *ar_next;
+};
+
 /*
  * Address space - data structure associated with the virtual memory
  * space of a process.
@@ -60,9 +84,20 @@ struct addrspace {
         paddr_t as_stackpbase;
 #else
         struct l2_pt *l2_pt;
+        struct lock *as_lock;   /* Protects the page tables of this address space */
+        uint32_t as_asid;       /* ASID generation and hardware ASID; see vm.c */
+        uint32_t as_cpus;       /* CPUs that activated the current ASID, one bit each */
+        struct as_region *regions;
         vaddr_t heap_base;
-        vaddr_t stack_top;
+        vaddr_t stack_top;      /* Lowest page of the stack, which grows down; see vm.h */
         vaddr_t brk;
+        size_t as_rss_pages;    /* User pages mapped in RAM; see vm.h */
+        size_t as_swap_pages;   /* User pages mapped in swap */
+        size_t as_rss_max;      /* Highest as_rss_pages so far */
+        unsigned as_minflt;     /* Faults that read nothing in from swap */
+        unsigned as_majflt;     /* Pages read back in from swap */
+        unsigned as_nswap;      /* Pages written out to swap */
+        vaddr_t as_rss_hand;    /* Where swap_out_as looks for victims next */
 #endif
 };
 
@@ -91,7 +126,8 @@ struct addrspace {
  *                the way this works if implementing user-level threads.
  *
  *    as_define_region - set up a region of memory within the address
- *                space.
+ *                space, backed by FILESIZE bytes of the vnode starting
+ *                at OFFSET.
  *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
@@ -103,6 +139,28 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_fill_page - fill a newly allocated page with the contents of the
+ *                regions it belongs to. Called by vm_fault.
+ *
+ *    as_page_zero_fill - check whether a page has no file contents, so
+ *                it reads as all zeros until it is written.
+ *
+ *    as_region_writeable - check whether a page may be written to.
+ *
+ *    as_find_region - find the region containing a virtual address.
+ *
+ *    as_map_region - add an mmap region to the address space, choosing
+ *                its address unless MAP_FIXED is given.
+ *
+ *    as_unmap_range - remove the mmap regions in an address range, writing
+ *                dirty shared pages back and freeing the pages.
+ *
+ *    as_mmap_floor - lowest address in use by mmap regions or kept for
+ *                the stack, which the heap may not grow past.
+ *
+ *    as_grow_stack - extend the stack down to a faulting address, within
+ *                the stack limit of the current process.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -115,12 +173,22 @@ void              as_destroy(struct addrspace *, pid_t pid);
 
 int               as_define_region(struct addrspace *as,
                                    vaddr_t vaddr, size_t sz,
+                                   struct vnode *v, off_t offset,
+                                   size_t filesize,
                                    int readable,
                                    int writeable,
                                    int executable);
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_fill_page(struct addrspace *as, vaddr_t vpage, vaddr_t kvaddr);
+bool              as_page_zero_fill(struct addrspace *as, vaddr_t vpage);
+bool              as_region_writeable(struct addrspace *as, vaddr_t vpage);
+struct as_region *as_find_region(struct addrspace *as, vaddr_t vaddr);
+int               as_map_region(struct addrspace *as, struct as_region *region, bool fixed);
+int               as_unmap_range(struct addrspace *as, vaddr_t start, vaddr_t end);
+vaddr_t           as_mmap_floor(struct addrspace *as);
+int               as_grow_stack(struct addrspace *as, vaddr_t vaddr);
 
 int               l1_create(struct l1_pt **l1_pt);
 void              l2_init(struct l2_pt *l2_pt);
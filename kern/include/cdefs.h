@@ -48,6 +48,12 @@
 #define ARRAYCOUNT(arr) (sizeof(arr) / sizeof((arr)[0]))
 
 
+/*
+ * Byte offset of a member within a structure.
+ */
+#define offsetof(type, member) __builtin_offsetof(type, member)
+
+
 /*
  * Tell GCC how to check printf formats. Also tell it about functions
  * that don't return, as this is helpful for avoiding bogus warnings
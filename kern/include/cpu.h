@@ -83,10 +83,16 @@ struct cpu {
 	 * struct tlbshootdown is machine-dependent and might
 	 * reasonably be either an address space and vaddr pair, or a
 	 * paddr, or something else.
+	 *
+	 * c_shootdown_queued counts the shootdown requests queued on
+	 * the cpu, and c_shootdown_done is set to it once the cpu has
+	 * carried them out, so a sender can wait for its own.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	uint32_t c_shootdown_queued;
+	uint32_t c_shootdown_done;
 	struct spinlock c_ipi_lock;
 };
 
@@ -153,6 +159,12 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_all makes all CPUs except the current one flush
+ * their whole TLB.
+ * ipi_tlbshootdown_batch carries several shootdowns to each CPU in a
+ * mask of CPU numbers, with one IPI per CPU.
+ * ipi_tlbshootdown_wait waits until the CPUs in a mask have carried out
+ * the shootdowns queued on them so far.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -167,6 +179,10 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_all(void);
+void ipi_tlbshootdown_batch(uint32_t cpus, const struct tlbshootdown *mappings,
+			    unsigned num);
+void ipi_tlbshootdown_wait(uint32_t cpus);
 
 void interprocessor_interrupt(void);
 
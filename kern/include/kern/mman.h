@@ -0,0 +1,34 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Constants for mmap(), shared between the kernel and libc.
+ */
+
+/* Page protections */
+#define PROT_NONE       0x0      /* Page cannot be accessed */
+#define PROT_READ       0x1      /* Page can be read */
+#define PROT_WRITE      0x2      /* Page can be written */
+#define PROT_EXEC       0x4      /* Page can be executed */
+
+/* Mapping flags; exactly one of MAP_SHARED and MAP_PRIVATE must be given */
+#define MAP_SHARED      0x0001   /* Writes go to the file on msync or munmap */
+#define MAP_PRIVATE     0x0002   /* Writes are private to this process */
+#define MAP_FIXED       0x0010   /* Map exactly at the given address */
+#define MAP_ANON        0x1000   /* Not backed by a file; pages start zeroed */
+#define MAP_ANONYMOUS   MAP_ANON
+
+/* Advice for madvise() */
+#define MADV_NORMAL     0        /* No special treatment */
+#define MADV_RANDOM     1        /* Pages will be accessed in random order */
+#define MADV_SEQUENTIAL 2        /* Pages will be accessed in sequential order */
+#define MADV_WILLNEED   3        /* Pages will be needed soon; read them in from swap */
+#define MADV_DONTNEED   4        /* Pages are not needed; drop them now */
+#define MADV_FREE       8        /* Contents of the pages may be discarded */
+
+/* Flags for msync(); exactly one must be given */
+#define MS_ASYNC        0x1      /* Write back dirty pages (done synchronously anyway) */
+#define MS_SYNC         0x2      /* Write back dirty pages and wait for it */
+
+
+#endif /* _KERN_MMAN_H_ */
@@ -0,0 +1,25 @@
+#ifndef _KERN_SPAWN_H_
+#define _KERN_SPAWN_H_
+
+/*
+ * File actions for spawn(), shared between the kernel and libc.
+ *
+ * The child starts with a copy of the parent's file table; the actions
+ * are then applied to it in order before the new program is loaded.
+ */
+
+/* Action codes */
+#define SPAWN_CLOSE     1        /* close(sa_fd) */
+#define SPAWN_DUP2      2        /* dup2(sa_fd, sa_newfd) */
+
+/* Most actions a single spawn() will take */
+#define SPAWN_ACTIONS_MAX 32
+
+struct spawn_action {
+	int sa_op;                   /* SPAWN_CLOSE or SPAWN_DUP2 */
+	int sa_fd;                   /* Descriptor acted on */
+	int sa_newfd;                /* Target of SPAWN_DUP2 */
+};
+
+
+#endif /* _KERN_SPAWN_H_ */
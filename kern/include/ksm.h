@@ -0,0 +1,42 @@
+#ifndef _KSM_H_
+#define _KSM_H_
+
+#include <types.h>
+#include "opt-dumbvm.h"
+
+/*
+Kernel same-page merging. A kernel thread goes over the page frames of RAM a few at a time, and
+merges private user pages holding the same bytes into a single read only frame. A process that
+later writes to the page gets its own copy again through the copy on write path of vm_fault.
+After a fork, or with many processes running the same program, data pages written with the same
+values end up in separate frames, and this gives those frames back.
+
+Since a coremap entry has room for a single virtual page, a frame is only merged with frames of
+the same virtual page. Pages of all zeros are merged into the zero page, from any virtual page.
+
+The thread hashes each frame as it passes, and only looks further at a frame whose hash is the
+same as the last time round, which leaves pages that are being written to alone. A table of the
+hashes of the frames seen so far in the current round pairs up candidates, which are compared
+byte for byte, with every mapping of both frames read only, before they are merged.
+*/
+
+#define KSM_SCAN_PAGES   64     /* Frames hashed per pass */
+#define KSM_SLEEP_SECS   1      /* Seconds between passes */
+#define KSM_TABLE_SIZE   256    /* Buckets of the table of candidates */
+
+#if OPT_DUMBVM
+
+/* dumbvm never shares frames. */
+static inline void ksm_printstats(void) { }
+
+#else
+
+void ksm_bootstrap(void);
+void ksm_daemon(void *, unsigned long);
+
+/* Prints the number of frames merged so far */
+void ksm_printstats(void);
+
+#endif /* OPT_DUMBVM */
+
+#endif /* _KSM_H_ */
@@ -3,5 +3,12 @@
 
 /* Memory system calls */
 int sys_sbrk(ssize_t, int32_t *);
+int sys_mmap(void *, size_t, int, int, int, off_t, int32_t *);
+int sys_munmap(void *, size_t);
+int sys_msync(void *, size_t, int);
+int sys_mlock(void *, size_t);
+int sys_munlock(void *, size_t);
+int sys_madvise(void *, size_t, int);
+int sys_mincore(void *, size_t, userptr_t);
 
 #endif /* _MSYSCALL_H_ */
@@ -0,0 +1,78 @@
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+#include <types.h>
+#include "opt-dumbvm.h"
+
+struct vnode;
+struct pc_page;
+
+/*
+Page cache for file data, keyed by vnode and page offset. Each cached page lives in a page frame
+of its own, tagged in the coremap with a virtual page number from VP_FILE_BASE up, so the clock
+in swap_out can tell file pages apart and drop them. Writes go through to the disk, so cached
+pages are always clean and are dropped without any I/O.
+
+A page is filled a sector at a time: the file system marks each sector valid once it has been read
+from or written to disk. A page returned by pagecache_get is marked busy in the coremap until it
+is given back with pagecache_put, so it cannot be dropped while it is used.
+
+Callers serialize access to the pages of a vnode themselves (SFS does all file I/O under the
+vfs big lock).
+
+Mappings do not map cache frames: mmap faults copy file data in through VOP_READ, and shared
+mappings go back through VOP_WRITE on msync, munmap and exit. In between, a mapping and the
+cache can hold different data for the same page.
+*/
+
+#define PC_SECTOR_SIZE   512    /* Size of the pieces a cached page is filled in */
+#define PC_MAX_PAGES     256    /* Upper bound on the number of cached pages */
+
+#if OPT_DUMBVM
+
+/* dumbvm never gives memory back, so it caches nothing. */
+static inline struct pc_page *pagecache_get(struct vnode *vn, off_t offset)
+{
+    (void)vn;
+    (void)offset;
+    return NULL;
+}
+static inline void pagecache_put(struct pc_page *pg) { (void)pg; }
+static inline void *pagecache_data(struct pc_page *pg) { (void)pg; return NULL; }
+static inline bool pagecache_valid(struct pc_page *pg, unsigned sector)
+{
+    (void)pg;
+    (void)sector;
+    return false;
+}
+static inline void pagecache_setvalid(struct pc_page *pg, unsigned sector, bool valid)
+{
+    (void)pg;
+    (void)sector;
+    (void)valid;
+}
+static inline void pagecache_purge(struct vnode *vn, off_t offset)
+{
+    (void)vn;
+    (void)offset;
+}
+
+#else
+
+void pagecache_bootstrap(void);
+
+/* Used by the file system */
+struct pc_page *pagecache_get(struct vnode *vn, off_t offset);
+void pagecache_put(struct pc_page *pg);
+void *pagecache_data(struct pc_page *pg);
+bool pagecache_valid(struct pc_page *pg, unsigned sector);
+void pagecache_setvalid(struct pc_page *pg, unsigned sector, bool valid);
+void pagecache_purge(struct vnode *vn, off_t offset);
+
+/* Used by the clock in swap_out; the coremap spinlock must be held */
+bool pagecache_frame(p_page_t p_page);
+void pagecache_drop_frame(p_page_t p_page);
+
+#endif /* OPT_DUMBVM */
+
+#endif /* _PAGECACHE_H_ */
@@ -41,6 +41,8 @@
 #include <filetable.h>
 #include <machine/trapframe.h>
 #include <limits.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 
 /*
 * Table index status for pidtable
@@ -69,6 +71,8 @@ struct proc {
 
 	/* VM */
 	struct addrspace *p_addrspace;	/* virtual address space */
+	struct semaphore *p_vfork_sem;	/* Parent waiting in vfork, while borrowing its address space */
+	struct rlimit p_rlimit[__RLIMIT_NUM];	/* Resource limits; inherited by children */
 
 	/* VFS */
 	struct vnode *p_cwd;		/* current working directory */
@@ -107,6 +111,15 @@ struct proc *proc_create_runprogram(const char *name);
 /* Copies the current process to a new process structure */
 int proc_create_fork(const char *, struct proc **);
 
+/* Like proc_create_fork, but the child borrows the parent's address space */
+int proc_create_vfork(const char *, struct semaphore *, struct proc **);
+
+/* Like proc_create_fork, but the child gets no address space */
+int proc_create_spawn(const char *, struct proc **);
+
+/* Hands a vfork child's borrowed address space back to its parent */
+void proc_vfork_release(struct proc *);
+
 /* Destroy a process. */
 void proc_destroy(struct proc *proc);
 
@@ -4,10 +4,16 @@
 
 /* Process system calls */
 int sys_fork(struct trapframe *, int32_t *);
+int sys_vfork(struct trapframe *, int32_t *);
 int sys_getpid(int32_t *);
 int sys_waitpid(pid_t, int32_t *, int32_t);
 void sys__exit(int32_t);
 int sys_execv(const char *, char **);
+struct spawn_action;
+int sys_spawn(const char *, char **, const struct spawn_action *, int, int32_t *);
+int sys_getrlimit(int, userptr_t);
+int sys_setrlimit(int, const_userptr_t);
+int sys_getrusage(int, userptr_t);
 
 /* Creating and entering a new process */
 void enter_usermode(void *, unsigned long);
@@ -32,29 +32,29 @@
 
 #include <machine/vm.h>
 
+struct addrspace;
+struct as_region;
+struct rusage;
+
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
 #define VM_FAULT_WRITE       1    /* A write was attempted */
 #define VM_FAULT_READONLY    2    /* A write to a readonly page was attempted*/
 
-#define COREMAP_PAGES        8    /* Pages used for coremap */
-#define NUM_PPAGES           COREMAP_PAGES*PAGE_SIZE/8    /* Number of page frames managed by coremap */
+#define BUDDY_ORDERS         18    /* Free blocks are 2^0 to 2^17 page frames; kseg0 maps 2^17 */
 
 #define PP_USED              0x80000000    /* Bit indicating if physical page unused */
 #define KMALLOC_END          0x40000000    /* Bit indicating the last page of a kmalloc; used for kfree */
 #define DIRTY                0x20000000    /* Bit indicating if the page was modified since it was created/swapped in from disk */
-#define REF_BIT              0x10000000    /* Bit used in swapping clock, indicating if ppage was in tlb */
+#define SWAP_CACHED          KMALLOC_END   /* In a swap map entry: the slot holds a copy of the page frame in VP_MASK */
+#define PP_BUSY              0x08000000    /* Bit indicating the page frame is in transit to or from swap */
+#define PP_PINNED            0x04000000    /* Bit indicating the page frame must not be evicted */
 #define REF_COUNT            0x03f00000
+#define REF_MAX              0x0000003f    /* A saturated reference count; the rmap has the real count */
 #define GET_REF(entry)       (((entry) & REF_COUNT) >> 20)
 #define SET_REF(entry, ref)  ((entry) = ((entry) & (~REF_COUNT)) | (((ref) & 0x0000003f) << 20))
 #define VP_MASK              0x000fffff    /* Mask to extract the virtual page of the page frame */
-
-#define NUM_CM_PIDS          4
-#define MAX_CM_PID           256
-#define PID8_1               0x000000ff
-#define PID8_2               0x0000ff00
-#define PID8_3               0x00ff0000
-#define PID8_4               0xff000000
+#define VP_FILE_BASE         0x000c0000    /* Page cache frames have virtual pages from here; see pagecache.h */
 
 #define NUM_L2PT_ENTRIES     PAGE_SIZE/4
 #define NUM_L1PT_ENTRIES     PAGE_SIZE/4
@@ -75,25 +75,86 @@
 #define ENTRY_READABLE       0x10000000
 #define ENTRY_WRITABLE       0x08000000
 #define ENTRY_EXECUTABLE     0x04000000
+#define ENTRY_LOCKED         0x02000000    /* In an l1 entry: locked by mlock, and holding a pin on its frame */
 
 /* Private error codes, used only within the virtual memory system */
 #define SWAPNOMEM      1     /* No swap memory left while paging */
 #define ENOUGHFREE     2     /* Enough free physical pages; no need to swap out */
 #define NOSWAPPABLE    3     /* No entries in the coremap are swappable */
 
-/* Page Daemon swapping definitions */
-#define SWAP_OUT_COUNT    1
-#define NUM_FREE_PPAGES   8
-#define DAEMON_EVICT_NUM  8
-#define MIN_FREE_PAGES    4
+/*
+Page Daemon swapping definitions. The paging daemon sleeps until the number of free page frames
+drops below the low watermark, and then evicts pages until it is back at the high watermark.
+Faulting threads only wait for it once free frames are below the minimum. The minimum is
+1/FREE_MIN_DIV of the page frames, but at least FREE_MIN_FLOOR; the low and high watermarks are
+two and three times the minimum.
+*/
+#define FREE_MIN_DIV      128
+#define FREE_MIN_FLOOR    4
+#define DAEMON_EVICT_NUM  8     /* Largest batch of pages evicted and written out together */
+#define EVICT_OWNERS_MAX  (8 * DAEMON_EVICT_NUM)    /* Most mappings of the frames of a batch */
+#define SWAP_SCAN_MAX     (16 * DAEMON_EVICT_NUM)    /* Most frames the clock ages per batch */
+#define AGE_TOP           0x80  /* Added to the age of a frame referenced since the clock last passed */
+#define AGE_OLD           0x40  /* A frame with a lower age was unused the last two times the clock passed */
+#define SWAP_READAHEAD    4     /* Most pages read in together by a fault on a swapped out page */
 #define SWAP_ON 1
 
+/*
+Idle CPUs keep a pool of zeroed free frames for new pages and page tables, of 1/ZERO_POOL_DIV of
+the page frames but at most ZERO_POOL_MAX. The pool is only filled while free frames are above
+the low watermark.
+*/
+#define ZERO_POOL_DIV     64
+#define ZERO_POOL_MAX     256
+
+/* The swap map may use at most 1/SWAP_META_RAM_DIV of RAM for its per-slot metadata */
+#define SWAP_META_RAM_DIV 8
+
+/*
+Heap memory is committed when sbrk grows the heap, but frames are only allocated on the first
+touch. With OVERCOMMIT_STRICT, sbrk fails once the committed heap pages of all address spaces
+would exceed RAM and swap; otherwise it only fails requests that could never be satisfied.
+*/
+#define OVERCOMMIT_STRICT 0
+
+/*
+The user stack starts out empty at USERSTACK and grows down a page at a time as it is touched, as
+far as the RLIMIT_STACK soft limit of the process allows; the default limit is STACK_LIMIT_DEFAULT.
+It has to keep STACK_GUARD_PAGES unmapped pages between itself and the heap or any mapping. mmap
+places mappings below the whole limit, unless the limit is over STACK_RESERVE_MAX.
+*/
+#define STACK_LIMIT_DEFAULT (1024 * 1024)
+#define STACK_GUARD_PAGES   16
+#define STACK_RESERVE_MAX   (64 * 1024 * 1024)
+
+/* At most 1/MLOCK_DIV of the page frames may be pinned by mlock, so the clock always has victims */
+#define MLOCK_DIV         4
+
+/*
+Every address space counts the user pages it maps in RAM and in swap, one per rmap entry, so a
+page shared by several processes counts for each of them; the zero page and page tables are not
+counted. A process whose resident pages reach its RLIMIT_RSS soft limit evicts its own pages
+before its faults take any more frames, instead of leaving it to the clock to push out the pages
+of every other process. Limits below RSS_MIN_PAGES are taken as RSS_MIN_PAGES.
+*/
+#define RSS_MIN_PAGES     16
+
+/*
+Compaction moves user pages out of an aligned block of page frames to free the whole block, for
+kernel allocations of several contiguous frames. alloc_kpages compacts when it cannot find a block
+and is allowed to sleep; otherwise it leaves the paging daemon to do it. The daemon also keeps a
+free block of 2^COMPACT_ORDER frames around while free frames are above the high watermark. Pages
+mapped more than COMPACT_OWNERS_MAX times are not moved.
+*/
+#define COMPACT_ORDER      3
+#define COMPACT_OWNERS_MAX 16
+
 
 /*
-The coremap supports 16MB of physical RAM, since cm_entry_t is a 4 bytes,
-and thus there are 2^12 cm_entries in 4 pages. However, we still use 20 bits
-to index the physical pages. The physical pages are indexed from 0 until 2^12 - 1,
-each identically corresponding to the indices of the cm_entries.
+The coremap has a struct cm_frame for every page frame of RAM, indexed by physical page number,
+and is allocated in vm_bootstrap from the size of RAM. All of RAM is reached through kseg0, so
+there are at most 2^17 frames (512MB), and the virtual page of a kernel frame (0x80000 plus its
+physical page) stays below VP_FILE_BASE.
 
 A coremap entry contains the corresponding vaddr page number (and the process ID if the address
 is a user address... but for now this isn't implemented). It contains a free bit indicating if
@@ -130,10 +191,108 @@ deleted if there are no other references).
 
 /*
 Reference counts are modified in vm_fault, in as_copy, as_destroy.
+
+Every reference to a page frame or swap slot has an entry in its reverse map (rmap): the address
+space holding the reference, and the virtual address it is mapped at there. For an l1 page table,
+the virtual address is the start of the 4MB region the l1 page table maps. The paging code uses
+the rmap to find and fix every page table entry pointing to a page it moves, however many
+address spaces share the page. The reference count in the coremap entry matches the length of the
+rmap, until it saturates at REF_MAX; from then on cm_getref counts the rmap.
+
+Rmap entries come from a pool of kernel pages set aside for them, and are protected by the
+cm_spinlock like the coremap.
+
+The zero page is a pinned kernel frame of zeros. A read fault on a page that has no file contents
+and was never written maps the zero page read only instead of a new frame, so the first write
+copies it like any other copy on write page. Its mappings are not kept in the rmap, since there
+can be any number of them: cm_addref and cm_remref ignore it, and cm_getref always counts it as
+shared, so it is never written or freed.
 */
+struct rmap {
+    struct addrspace *rm_as;
+    vaddr_t rm_vaddr;
+    struct rmap *rm_next;
+};
+
+/*
+Locking. Every address space has its own as_lock, which protects its l2 page table and the
+l1 page tables reachable from it. A page fault only takes the lock of the faulting address
+space, so faults in different processes run concurrently. The cm_spinlock protects the coremap
+entries, and is always acquired after an as_lock.
+
+The global_lock is the paging lock. It is only taken when swap is involved: by the paging daemon
+(or a faulting thread under memory exhaustion) while evicting, and by a fault that has to page
+data back in. Paging rewrites the page tables of every process sharing a page, so it holds the
+as_lock of all owners at once. To avoid deadlock, only the holder of the global_lock may hold more
+than one as_lock, and the global_lock is always acquired before any as_lock.
+
+A page frame selected for eviction is marked busy, so that it is not selected twice and not
+reallocated while the evicting thread waits for the owners' address space locks. Pinned frames
+are never selected for eviction.
+
+Free page frames are kept by a buddy allocator. A free block of order k is 2^k frames starting at
+a frame number that is a multiple of 2^k, and its buddy is the block its frame number differs from
+in bit k. Each order has a free list, linked through cf_next and cf_prev by frame number, and a
+bitmap with a bit for every 2^k-th frame, set while the block starting there is free. Allocating
+splits the smallest large enough block; freeing merges a block with its buddy for as long as the
+buddy is free, so both take O(BUDDY_ORDERS). Frame 0 is never allocatable and ends the lists. A
+frame freed while it is busy only goes back to the buddy allocator once it is no longer busy.
+
+Free frames that were zeroed by an idle CPU are kept apart in the zero pool, a list linked through
+cf_next. They count as free, and are given back to the buddy allocator when it runs dry.
+
+Page replacement tracks references in software. The TLB refill marks a frame referenced whenever
+it loads a mapping of it, and the paging daemon flushes every TLB each time the clock wraps
+around, so a page still in use is refilled and marked again before the clock returns to it. The clock folds the mark into the frame's
+aging counter as it passes; see swap_out.
+
+A frame mapped by l1 entries locked with mlock counts one pin per entry in cf_pins, and is
+PP_PINNED while any are left. The l1 page tables holding locked entries are never shared with
+another process, so each pin belongs to exactly one entry.
+*/
+struct cm_frame {
+    cm_entry_t cf_entry;         /* Must stay first: read by the TLB refill in exception-mips1.S */
+    struct rmap *cf_rmap;
+    p_page_t cf_next;            /* Free list links, while the frame starts a free block */
+    p_page_t cf_prev;
+    uint32_t cf_referenced;      /* Nonzero if used since the clock last passed; set by the TLB refill */
+    uint16_t cf_age;             /* Aging counter of the clock; see swap_out */
+    uint16_t cf_pins;            /* Locked l1 entries mapping the frame */
+};
+
 struct coremap {
-    cm_entry_t cm_entries[NUM_PPAGES];
-    pids8_t pids8_entries[NUM_PPAGES];
+    struct cm_frame *cm_frames;  /* Must stay first: read by the TLB refill in exception-mips1.S */
+    p_page_t bd_head[BUDDY_ORDERS];
+    uint32_t *bd_map[BUDDY_ORDERS];
+};
+
+
+/*
+The swap map holds the state of the swap slots, which are numbered right after the page frames
+of RAM: slot i is page number first_page_swap + i in page table entries. Each slot has an entry
+and rmap just like a page frame, so a swapped out page keeps its reference count, virtual page
+and owners. The number of slots comes from the size of the swap disk, and the metadata is
+allocated in swap_bootstrap.
+
+A page read back in from swap keeps its slot while it is in RAM, in the swap cache: sm_cached maps
+the page frame to the slot, and the slot's entry is marked SWAP_CACHED. The page is mapped read
+only until its first write, which sets the DIRTY bit of its frame. If a clean page is evicted
+again, the copy in its slot is still good and nothing is written; a dirty one is written back to
+the same slot. The slots of the swap cache are taken back when all slots are in use.
+
+Free slots are found with a two level bitmap. A bit of sm_free is set if its slot is free, and a
+bit of sm_summary is set if the corresponding word of sm_free has a free slot, so a search skips
+32 full words at a time. Slots are handed out next fit from sm_hint, so pages evicted together
+end up next to each other on disk. The swap map is protected by the cm_spinlock.
+*/
+struct swapmap {
+    size_t sm_nslots;
+    size_t sm_hint;              /* Slot to start the next search from */
+    cm_entry_t *sm_entries;
+    struct rmap **sm_rmap;
+    p_page_t *sm_cached;         /* For each page frame, the slot of its swap cache copy, or 0 */
+    uint32_t *sm_free;
+    uint32_t *sm_summary;
 };
 
 
@@ -176,46 +335,102 @@ void free_ppage(p_page_t);
 void free_ppage_swap(p_page_t);
 
 size_t cm_getref(p_page_t);
-void cm_incref(p_page_t);
-void cm_decref(p_page_t);
+int cm_addref(p_page_t, struct addrspace *, vaddr_t);
+void cm_remref(p_page_t, struct addrspace *, vaddr_t);
 
-void set_pid8(p_page_t, pid_t, uint32_t);
-pid_t get_pid8(p_page_t, uint32_t);
-void add_pid8(p_page_t, pid_t);
-void rem_pid8(p_page_t, pid_t);
+void cm_pin(p_page_t);
+void cm_unpin(p_page_t);
+void cm_munlock(p_page_t);
 
 /* Initialization function */
 void vm_bootstrap(void);
 void swap_bootstrap(void);
 
 /* Swapping */
-int swap_out(void);
-int swap_out_test(p_page_t *, p_page_t *);
-int swap_in(p_page_t, p_page_t);
+int swap_out(size_t npages);
+int swap_out_as(struct addrspace *, size_t npages);
 int swap_in_data(p_page_t *);
 
+size_t vm_free_pages(void);
 bool enough_free(void);
+int vm_commit(size_t npages);
+void vm_uncommit(size_t npages);
+void vm_wait_free(void);
 void paging_daemon(void *, unsigned long);
+int vm_compact(unsigned order);
+
+/* Resource usage of an address space, for getrusage */
+void vm_getrusage(struct addrspace *, struct rusage *);
+
+/* Address space locking */
+void vm_lock_as(struct addrspace *, bool *);
+void vm_unlock_as(struct addrspace *, bool);
 
 /* Fault handling function called by trap code */
 int get_l1_pt(struct l2_pt *, v_page_l2_t, struct l1_pt **, bool);
 int l1_alloc_page(struct l1_pt *, v_page_l1_t, v_page_t, p_page_t *);
 int copy_user_data(struct l1_pt *, v_page_l1_t, p_page_t, v_page_t, p_page_t *);
-void release_ppage(p_page_t, pid_t);
+void release_ppage(p_page_t, struct addrspace *, vaddr_t);
 int vm_fault(int, vaddr_t);
 
 /* Allocate/free kernel heap pages (called by kmalloc/kfree) */
 vaddr_t alloc_kpages(unsigned);
+vaddr_t alloc_kpage_zeroed(void);
 void free_kpages(vaddr_t);
 
+/* Fills the pool of zeroed frames; called by idle CPUs */
+bool vm_zero_idle(void);
+
+/* Address space IDs */
+void vm_activate_asid(struct addrspace *);
+void vm_retire_asid(struct addrspace *);
+
+/* Page table used by the TLB refill fast path */
+void vm_set_utlb_pt(struct l2_pt *);
+void vm_clear_utlb_pt(struct l2_pt *);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/*
+Invalidations of pages of one address space, queued while its page tables are changed and then
+sent together: one interprocessor interrupt to each CPU that may hold entries of the address
+space. vm_tlb_batch_sync waits until every CPU has dropped the entries, so the frames the pages
+mapped can then be copied, reused or freed. Past TLBSHOOTDOWN_MAX pages the current address
+space retires its ASID, and the CPUs holding entries of any other flush their whole TLB.
+*/
+struct tlb_batch {
+    struct addrspace *tb_as;
+    unsigned tb_num;             /* TLBSHOOTDOWN_MAX + 1 once the batch has overflowed */
+    struct tlbshootdown tb_pages[TLBSHOOTDOWN_MAX];
+};
+
+void vm_tlb_batch_init(struct tlb_batch *, struct addrspace *);
+void vm_tlb_batch_add(struct tlb_batch *, vaddr_t);
+void vm_tlb_batch_add_range(struct tlb_batch *, vaddr_t start, vaddr_t end);
+void vm_tlb_batch_sync(struct tlb_batch *);
+
 /* Page manipulation */
 void free_vpage(struct l2_pt *, v_page_l2_t, v_page_l1_t);
 void free_l1_pt(struct l2_pt *, v_page_l2_t);
+bool l1_pt_unused(struct l2_pt *, v_page_l2_t);
 int add_ppage(struct l2_pt *, v_page_l2_t, v_page_l1_t);
 int add_l1_pt(struct l2_pt *, v_page_l2_t, struct l1_pt **);
 
+/* Writes back a page of the compressed swap pool; see zswap.h */
+int swap_write_kbuf(p_page_t slot, const void *buf);
+
+/* Merging frames with the same contents; see ksm.h */
+bool vm_ksm_candidate(p_page_t, v_page_t *);
+bool vm_ksm_merge(p_page_t dup, p_page_t keep);
+bool vm_ksm_merge_zero(p_page_t dup);
+
+/* Locking pages in memory for mlock */
+int vm_mlock_page(struct addrspace *, vaddr_t, bool write, int *faulttype);
+int vm_munlock_page(struct addrspace *, vaddr_t);
+
+/* Shared file mappings */
+int vm_writeback_range(struct addrspace *, struct as_region *, vaddr_t start, vaddr_t end);
+
 #endif /* _VM_H_ */
@@ -0,0 +1,51 @@
+#ifndef _ZSWAP_H_
+#define _ZSWAP_H_
+
+#include <types.h>
+#include "opt-dumbvm.h"
+
+/*
+Compressed swap pool. It sits in front of the swap disk and is keyed by swap slot: a dirty page
+being evicted is compressed and kept in RAM under its slot instead of being written out, and a
+fault on the slot copies it back out of the pool without any disk I/O. Only pages that compress
+to at most ZS_MAX_SIZE are taken; the rest go to the disk as before.
+
+The compressor is a word pattern coder suited to the data of user pages: each 32 bit word gets
+a 2 bit tag saying whether it is zero, repeats the word before it, fits in 16 bits, or is stored
+whole. Pages of all zeros take no space in the pool at all.
+
+The pool grows a page frame at a time, up to a fraction of RAM and only while free frames are not
+short, and gives frames back as soon as they empty. Each frame is split in ZS_CHUNKS chunks, and a
+compressed page takes consecutive chunks of one frame. When the pool is full, the pages in one of
+its frames are written back to their slots on disk to make room, going round the frames in turn.
+
+Pool state is protected by the coremap spinlock. Storing and loading pages also needs the global
+paging lock, which keeps the pool's buffers and the slots being written back to itself.
+*/
+
+#define ZS_CHUNK_SIZE    128                          /* Pool frames are handed out in chunks */
+#define ZS_CHUNKS        (PAGE_SIZE / ZS_CHUNK_SIZE)  /* One bit each in a word */
+#define ZS_MAX_SIZE      (PAGE_SIZE / 2)              /* Pages compressing worse than 2:1 go to disk */
+#define ZS_POOL_DIV      8                            /* At most this fraction of the frames is pool */
+#define ZS_MAX_PAGES     128                          /* Upper bound on the frames of the pool */
+
+#if OPT_DUMBVM
+
+/* dumbvm has no swap. */
+static inline void zswap_printstats(void) { }
+
+#else
+
+void zswap_bootstrap(size_t nslots);
+
+/* Used by swap_out and swap in; see above for the locks */
+bool zswap_store(p_page_t slot, const void *page);
+bool zswap_load(p_page_t slot, void *page);
+void zswap_drop(p_page_t slot);
+
+/* Prints the compression ratio and hit rate of the pool */
+void zswap_printstats(void);
+
+#endif /* OPT_DUMBVM */
+
+#endif /* _ZSWAP_H_ */
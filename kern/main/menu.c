@@ -42,6 +42,8 @@
 #include <syscall.h>
 #include <test.h>
 #include <psyscall.h>
+#include <zswap.h>
+#include <ksm.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
@@ -381,6 +383,30 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_zswapstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	zswap_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_ksmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	ksm_printstats();
+
+	return 0;
+}
+
 static
 int
 cmd_kheapgeneration(int nargs, char **args)
@@ -517,6 +543,8 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[zs] Compressed swap stats          ",
+	"[ksm] Page merging stats            ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -571,6 +599,8 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "zs",         cmd_zswapstats },
+	{ "ksm",        cmd_ksmstats },
 
 	/* base system tests */
 	{ "at",		arraytest },
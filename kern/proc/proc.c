@@ -99,6 +99,12 @@ proc_create(const char *name)
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
+	proc->p_vfork_sem = NULL;
+	for (int i = 0; i < __RLIMIT_NUM; i++) {
+		proc->p_rlimit[i].rlim_cur = RLIM_INFINITY;
+		proc->p_rlimit[i].rlim_max = RLIM_INFINITY;
+	}
+	proc->p_rlimit[RLIMIT_STACK].rlim_cur = STACK_LIMIT_DEFAULT;
 
 	/* VFS fields */
 	proc->p_cwd = NULL;
@@ -276,10 +282,13 @@ proc_create_runprogram(const char *name)
 
 
 /*
- * Sets up the memory structures for a newly forked process.
+ * Creates a child of the current process sharing its working directory
+ * and open files, with the same resource limits, but with no address
+ * space yet.
  */
+static
 int
-proc_create_fork(const char *name, struct proc **new_proc)
+proc_create_child(const char *name, struct proc **new_proc)
 {
 	int ret;
 	struct proc *proc;
@@ -295,18 +304,14 @@ proc_create_fork(const char *name, struct proc **new_proc)
 		return ret;
 	}
 
-	ret = as_copy(curproc->p_addrspace, &proc->p_addrspace, proc->pid);
-	if (ret) {
-		pidtable_freepid(proc->pid);
-		proc_destroy(proc);
-		return ret;
-	}
-
 	spinlock_acquire(&curproc->p_lock);
 	if (curproc->p_cwd != NULL) {
 		VOP_INCREF(curproc->p_cwd);
 		proc->p_cwd = curproc->p_cwd;
 	}
+	for (int i = 0; i < __RLIMIT_NUM; i++) {
+		proc->p_rlimit[i] = curproc->p_rlimit[i];
+	}
 	spinlock_release(&curproc->p_lock);
 
 	struct ft *ft = curproc->proc_ft;
@@ -318,6 +323,81 @@ proc_create_fork(const char *name, struct proc **new_proc)
 	return 0;
 }
 
+/*
+ * Sets up the memory structures for a newly forked process.
+ */
+int
+proc_create_fork(const char *name, struct proc **new_proc)
+{
+	int ret;
+	struct proc *proc;
+
+	ret = proc_create_child(name, &proc);
+	if (ret) {
+		return ret;
+	}
+
+	ret = as_copy(curproc->p_addrspace, &proc->p_addrspace, proc->pid);
+	if (ret) {
+		pidtable_freepid(proc->pid);
+		proc_destroy(proc);
+		return ret;
+	}
+
+	*new_proc = proc;
+	return 0;
+}
+
+/*
+ * Sets up a vfork child. Nothing is copied: the child runs on the parent's
+ * address space, and the parent sleeps on sem until proc_vfork_release.
+ */
+int
+proc_create_vfork(const char *name, struct semaphore *sem, struct proc **new_proc)
+{
+	int ret;
+	struct proc *proc;
+
+	KASSERT(sem != NULL);
+
+	ret = proc_create_child(name, &proc);
+	if (ret) {
+		return ret;
+	}
+
+	proc->p_addrspace = curproc->p_addrspace;
+	proc->p_vfork_sem = sem;
+
+	*new_proc = proc;
+	return 0;
+}
+
+/*
+ * Sets up a spawn child. Its address space is created by the child itself
+ * when it loads the new program.
+ */
+int
+proc_create_spawn(const char *name, struct proc **new_proc)
+{
+	return proc_create_child(name, new_proc);
+}
+
+/*
+ * Called by a vfork child once it has stopped using the parent's address
+ * space, either because execv switched to a new one or because the child
+ * is exiting and has dropped it. The parent may run as soon as this returns.
+ */
+void
+proc_vfork_release(struct proc *proc)
+{
+	struct semaphore *sem = proc->p_vfork_sem;
+
+	KASSERT(sem != NULL);
+
+	proc->p_vfork_sem = NULL;
+	V(sem);
+}
+
 /*
  * Add a thread to a process. Either the thread or the process might
  * or might not be current.
@@ -603,6 +683,13 @@ pidtable_exit(struct proc *proc, int32_t waitcode)
 {
 	KASSERT(proc != NULL);
 
+	if (proc->p_vfork_sem != NULL) {
+		/* The address space is the parent's, so reaping us must not destroy it */
+		proc_setas(NULL);
+		as_deactivate();
+		proc_vfork_release(proc);
+	}
+
 	lock_acquire(pidtable->pid_lock);
 
 	pidtable_update_children(proc);
@@ -37,6 +37,10 @@
  *    - then it loads each chunk of the program;
  *    - finally, as_complete_load.
  *
+ * Without dumbvm, the segments are not loaded here: as_define_region
+ * records the file offset of each segment, and vm_fault reads each
+ * page from the executable when it is first touched.
+ *
  * This gives the VM code enough flexibility to deal with even grossly
  * mis-linked executables if that proves desirable. Under normal
  * circumstances, as_prepare_load and as_complete_load probably don't
@@ -60,6 +64,7 @@
 #include <vnode.h>
 #include <elf.h>
 
+#if OPT_DUMBVM
 /*
  * Load a segment at virtual address VADDR. The segment in memory
  * extends from VADDR up to (but not including) VADDR+MEMSIZE. The
@@ -144,6 +149,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 
 	return result;
 }
+#endif /* OPT_DUMBVM */
 
 /*
  * Load an ELF executable user program into the current address space.
@@ -245,6 +251,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 
 		result = as_define_region(as,
 					  ph.p_vaddr, ph.p_memsz,
+					  v, ph.p_offset, ph.p_filesz,
 					  ph.p_flags & PF_R,
 					  ph.p_flags & PF_W,
 					  ph.p_flags & PF_X);
@@ -258,6 +265,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return result;
 	}
 
+#if OPT_DUMBVM
 	/*
 	 * Now actually load each segment.
 	 */
@@ -295,6 +303,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return result;
 		}
 	}
+#endif
 
 	result = as_complete_load(as);
 	if (result) {
@@ -6,34 +6,20 @@
 #include <addrspace.h>
 #include <proc.h>
 #include <current.h>
+#include <filetable.h>
+#include <vnode.h>
+#include <stat.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <copyinout.h>
 
-
-/* Global lock and wait channel from vm.c */
-extern struct lock *global_lock;
-extern struct cv *global_cv;
-extern p_page_t last_page;
-extern size_t cm_counter;
+/* Residency bytes mincore gathers under the address space lock before copying them out */
+#define MINCORE_CHUNK 128
 
 /*
-Get the number of pages to be allocated between old and new places in l1 & l2
-*/
-static
-int
-get_num_used(v_page_l1_t old_l1, v_page_l2_t old_l2, v_page_l1_t new_l1, v_page_l2_t new_l2)
-{
-    int num_used = 0;
-    if (old_l2 == new_l2){
-        num_used += (new_l1 - old_l1);
-    } else {
-        num_used += (new_l2 - old_l2 - 1) * NUM_L1PT_ENTRIES;
-        num_used += NUM_L1PT_ENTRIES - old_l1;
-        num_used += new_l1;
-    }
-    return num_used;
-}
-
-/*
-Frees pages between the old and new places in l1 & l2 in a loop
+Frees pages between the old and new places in l1 & l2 in a loop. The l1 page tables wholly
+inside the freed range go as well. Mappings and the stack may lie above the old break in the
+same l1 page table, so that one is only freed if nothing is left in it.
 */
 static
 void
@@ -55,7 +41,9 @@ free_sbrk(struct l2_pt *l2_pt, v_page_l1_t old_l1, v_page_l2_t old_l2, v_page_l1
             free_vpage(l2_pt, old_l2, v_l1);
         }
 
-        free_l1_pt(l2_pt, old_l2);
+        if (l1_pt_unused(l2_pt, old_l2)) {
+            free_l1_pt(l2_pt, old_l2);
+        }
 
         for (v_page_l1_t v_l1 = new_l1; v_l1 < NUM_L1PT_ENTRIES; v_l1++) {
             free_vpage(l2_pt, new_l2, v_l1);
@@ -64,122 +52,702 @@ free_sbrk(struct l2_pt *l2_pt, v_page_l1_t old_l1, v_page_l2_t old_l2, v_page_l1
 }
 
 /*
-Allocates all the pages between the old and new places in l1 & l2 in a loop
+Sbrk system call. Moves the sbrk pointer in address space. Growing the heap only commits memory;
+the pages are allocated and zeroed by vm_fault when they are first touched. Shrinking the heap
+frees the pages that were touched.
+*/
+int
+sys_sbrk(ssize_t amount, int32_t *retval0)
+{
+    if (amount % PAGE_SIZE) {
+        return EINVAL;
+    }
+
+    /* Shrinking the heap might have to page in l1 page tables. */
+    if (amount < 0 && !enough_free()) {
+        vm_wait_free();
+    }
+
+    struct addrspace *as = curproc->p_addrspace;
+    bool paging;
+
+    vm_lock_as(as, &paging);
+
+    vaddr_t old_heap_end = as->brk;
+    vaddr_t new_heap_end = old_heap_end + amount;
+
+    if (new_heap_end < as->heap_base) {
+        vm_unlock_as(as, paging);
+        return EINVAL;
+    }
+
+    int64_t overflow = (int64_t)old_heap_end + (int64_t)amount;
+    if (overflow > USERSPACETOP || overflow < 0){
+        vm_unlock_as(as, paging);
+        return EINVAL;
+    }
+
+    /* The heap may not grow into mmap regions either. */
+    if (new_heap_end > as_mmap_floor(as)) {
+        vm_unlock_as(as, paging);
+        return ENOMEM;
+    }
+
+    v_page_l2_t old_l2 = L2_PNUM(old_heap_end);
+    v_page_l1_t old_l1 = L1_PNUM(old_heap_end);
+    v_page_l2_t new_l2 = L2_PNUM(new_heap_end);
+    v_page_l1_t new_l1 = L1_PNUM(new_heap_end);
+    struct l2_pt *l2_pt = as->l2_pt;
+
+    if (new_heap_end < old_heap_end) {
+        struct tlb_batch batch;
+        vm_tlb_batch_init(&batch, as);
+        vm_tlb_batch_add_range(&batch, new_heap_end, old_heap_end);
+
+        free_sbrk(l2_pt, old_l1, old_l2, new_l1, new_l2);
+        vm_tlb_batch_sync(&batch);
+        vm_uncommit((old_heap_end - new_heap_end) / PAGE_SIZE);
+    }
+    else if (new_heap_end > old_heap_end)
+    {
+        int result = vm_commit((new_heap_end - old_heap_end) / PAGE_SIZE);
+        if (result){
+            vm_unlock_as(as, paging);
+            *retval0 = -1;
+            return result;
+        }
+    }
+
+    *retval0 = old_heap_end;
+    as->brk = new_heap_end;
+
+    vm_unlock_as(as, paging);
+
+    return 0;
+}
+
+/*
+Sets up the file side of a mapping: checks the open file allows the access and takes a
+reference to its vnode.
 */
 static
 int
-allocate_sbrk(struct l2_pt *l2_pt, v_page_l1_t old_l1, v_page_l2_t old_l2, v_page_l1_t new_l1, v_page_l2_t new_l2)
+mmap_file(struct as_region *region, int fd, int prot, int flags)
 {
+    struct ft *ft = curproc->proc_ft;
+    struct ft_entry *entry;
+    struct stat st;
     int result;
 
-    if (!(l2_pt->l2_entries[old_l2] & ENTRY_VALID)) {
-        result = add_l1_pt(l2_pt, old_l2, NULL);
-        if (result) return result;
+    lock_acquire(ft->ft_lock);
+    if (!fd_valid_and_used(ft, fd)) {
+        lock_release(ft->ft_lock);
+        return EBADF;
     }
 
-    if (old_l2 == new_l2){
-        for (v_page_l1_t v_l1 = old_l1; v_l1 < new_l1; v_l1++) {
-            result = add_ppage(l2_pt, old_l2, v_l1);
-            if (result) return result;
-        }
-    } else {
-        for (v_page_l2_t v_l2 = old_l2 + 1; v_l2 < new_l2; v_l2++) {
-            result = add_l1_pt(l2_pt, v_l2, NULL);
-            if (result) return result;
+    entry = ft->entries[fd];
+    lock_acquire(entry->entry_lock);
 
-            for (v_page_l1_t v_l1 = 0; v_l1 < NUM_L1PT_ENTRIES; v_l1++) {
-                result = add_ppage(l2_pt, v_l2, v_l1);
-                if (result) return result;
-            }
+    lock_release(ft->ft_lock);
+
+    int accmode = entry->rwflags & O_ACCMODE;
+    if (accmode == O_WRONLY ||
+        ((flags & MAP_SHARED) && (prot & PROT_WRITE) && accmode != O_RDWR)) {
+        lock_release(entry->entry_lock);
+        return EACCES;
+    }
+
+    result = VOP_MMAP(entry->file, region->ar_offset, prot);
+    if (result) {
+        lock_release(entry->entry_lock);
+        return result;
+    }
+
+    result = VOP_STAT(entry->file, &st);
+    if (result) {
+        lock_release(entry->entry_lock);
+        return result;
+    }
+
+    /* Pages past the end of the file are zero-filled and never written back. */
+    region->ar_filesize = 0;
+    if (st.st_size > region->ar_offset) {
+        off_t left = st.st_size - region->ar_offset;
+        region->ar_filesize = left < (off_t) region->ar_memsize ? (size_t) left : region->ar_memsize;
+    }
+
+    region->ar_vnode = entry->file;
+    VOP_INCREF(region->ar_vnode);
+
+    lock_release(entry->entry_lock);
+    return 0;
+}
+
+/*
+Mmap system call. Maps len bytes of the file at fd, starting at offset, or zeroed memory with
+MAP_ANON. Nothing is read here; vm_fault pages the mapping in. Private mappings are copied on
+write like the rest of the address space after a fork, and shared mappings write their dirty
+pages back to the file on msync, when they are unmapped, or when the process exits.
+
+A file mapping is filled by copying from the page cache, not by mapping its frames, so a shared
+mapping is only shared with the processes forked from its owner. Until its pages are written
+back, read and write on the file, and other mappings of it, do not see what was written through
+the mapping, nor does the mapping see later writes to the file.
+*/
+int
+sys_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset, int32_t *retval0)
+{
+    int sharing = flags & (MAP_SHARED | MAP_PRIVATE);
+    int result;
+
+    if (len == 0 || sharing == 0 || sharing == (MAP_SHARED | MAP_PRIVATE)) {
+        return EINVAL;
+    }
+
+    if (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) {
+        return EINVAL;
+    }
+
+    if (offset % PAGE_SIZE || offset < 0) {
+        return EINVAL;
+    }
+
+    if ((flags & MAP_FIXED) && (vaddr_t) addr % PAGE_SIZE) {
+        return EINVAL;
+    }
+
+    size_t memsize = (len + PAGE_SIZE - 1) & VPAGE_ADDR_MASK;
+    if (memsize < len) {
+        return ENOMEM;
+    }
+
+    struct as_region *region = kmalloc(sizeof(struct as_region));
+    if (region == NULL) {
+        return ENOMEM;
+    }
+
+    region->ar_vbase = (vaddr_t) addr;
+    region->ar_memsize = memsize;
+    region->ar_vnode = NULL;
+    region->ar_offset = offset;
+    region->ar_filesize = 0;
+    region->ar_readable = (prot & PROT_READ) != 0;
+    region->ar_writeable = (prot & PROT_WRITE) != 0;
+    region->ar_executable = (prot & PROT_EXEC) != 0;
+    region->ar_mapped = true;
+    region->ar_shared = (flags & MAP_SHARED) != 0;
+    region->ar_next = NULL;
+
+    if (!(flags & MAP_ANON)) {
+        result = mmap_file(region, fd, prot, flags);
+        if (result) {
+            kfree(region);
+            return result;
         }
+    }
 
-        for (v_page_l1_t v_l1 = old_l1; v_l1 < NUM_L1PT_ENTRIES; v_l1++) {
-            result = add_ppage(l2_pt, old_l2, v_l1);
-            if (result) return result;
+    size_t commit = (region->ar_shared || !region->ar_writeable) ? 0 : memsize / PAGE_SIZE;
+    result = vm_commit(commit);
+    if (result) {
+        if (region->ar_vnode != NULL) {
+            VOP_DECREF(region->ar_vnode);
         }
+        kfree(region);
+        return result;
+    }
+
+    struct addrspace *as = curproc->p_addrspace;
+    bool paging;
 
-        result = add_l1_pt(l2_pt, new_l2, NULL);
-        if (result) return result;
+    vm_lock_as(as, &paging);
 
-        for (v_page_l1_t v_l1 = 0; v_l1 < new_l1; v_l1++) {
-            result = add_ppage(l2_pt, new_l2, v_l1);
-            if (result) return result;
+    result = as_map_region(as, region, (flags & MAP_FIXED) != 0);
+    if (result) {
+        vm_unlock_as(as, paging);
+        vm_uncommit(commit);
+        if (region->ar_vnode != NULL) {
+            VOP_DECREF(region->ar_vnode);
         }
+        kfree(region);
+        return result;
     }
 
+    *retval0 = region->ar_vbase;
+
+    vm_unlock_as(as, paging);
+
     return 0;
 }
 
 /*
-Sbrk system call. Moves the sbrk pointer in address space and manipulates memory for the user's heap.
+Munmap system call. Removes the mappings in the given range, writing back dirty pages of
+shared file mappings.
 */
 int
-sys_sbrk(ssize_t amount, int32_t *retval0)
+sys_munmap(void *addr, size_t len)
 {
-    if (amount % PAGE_SIZE) {
+    vaddr_t start = (vaddr_t) addr;
+    vaddr_t end = start + ((len + PAGE_SIZE - 1) & VPAGE_ADDR_MASK);
+
+    if (len == 0 || start % PAGE_SIZE || end <= start || end > USERSPACETOP) {
         return EINVAL;
     }
 
-    lock_acquire(global_lock);
-
-    while (!enough_free()) {
-        cv_wait(global_cv, global_lock);
+    /* Writing back pages might have to page them in. */
+    if (!enough_free()) {
+        vm_wait_free();
     }
 
     struct addrspace *as = curproc->p_addrspace;
+    bool paging;
+    int result;
 
-    vaddr_t stack_top = as->stack_top;
-    vaddr_t old_heap_end = as->brk;
-    vaddr_t new_heap_end = old_heap_end + amount;
+    vm_lock_as(as, &paging);
 
-    if (new_heap_end < as->heap_base) {
-        lock_release(global_lock);
+    struct tlb_batch batch;
+    vm_tlb_batch_init(&batch, as);
+    vm_tlb_batch_add_range(&batch, start, end);
+
+    result = as_unmap_range(as, start, end);
+    vm_tlb_batch_sync(&batch);
+
+    vm_unlock_as(as, paging);
+
+    return result;
+}
+
+/*
+Checks the range given to msync, mlock, munlock, madvise and mincore, which must start on a page, and
+rounds its end up to a page.
+*/
+static
+int
+page_range(void *addr, size_t len, vaddr_t *start, vaddr_t *end)
+{
+    *start = (vaddr_t) addr;
+
+    if (*start % PAGE_SIZE || len > USERSPACETOP) {
         return EINVAL;
     }
 
-    int64_t overflow = (int64_t)old_heap_end + (int64_t)amount;
-    if (overflow > USERSPACETOP || overflow < 0){
-        lock_release(global_lock);
+    *end = *start + ((len + PAGE_SIZE - 1) & VPAGE_ADDR_MASK);
+    if (*end < *start || *end > USERSPACETOP) {
+        return ENOMEM;
+    }
+
+    return 0;
+}
+
+/*
+Checks that every page between start and end is mapped, by the same rule as vm_fault: the space
+between the heap and the stack only where an mmap region is. With readable set, the pages must
+also allow access.
+*/
+static
+bool
+range_mapped(struct addrspace *as, vaddr_t start, vaddr_t end, bool readable)
+{
+    for (vaddr_t v_page = start; v_page < end; v_page += PAGE_SIZE) {
+        struct as_region *region = as_find_region(as, v_page);
+
+        if (region == NULL && as->brk <= v_page && v_page < as->stack_top) {
+            return false;
+        }
+
+        if (readable && region != NULL && region->ar_mapped && !region->ar_readable) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+Looks up the l1 entry of the page at vaddr, which is 0 if the page was never touched. The address
+space lock must be held, as for vm_lock_as.
+*/
+static
+int
+page_entry(struct addrspace *as, vaddr_t vaddr, l1_entry_t *entry)
+{
+    struct l2_pt *l2_pt = as->l2_pt;
+    v_page_l2_t v_l2 = L2_PNUM(vaddr);
+    struct l1_pt *l1_pt;
+    int result;
+
+    *entry = 0;
+
+    if (!(l2_pt->l2_entries[v_l2] & ENTRY_VALID)) {
+        return 0;
+    }
+
+    result = get_l1_pt(l2_pt, v_l2, &l1_pt, false);
+    if (result) {
+        return result;
+    }
+
+    *entry = l1_pt->l1_entries[L1_PNUM(vaddr)];
+    return 0;
+}
+
+/*
+Msync system call. Writes the dirty pages of the shared file mappings in the range back to their
+files, through the page cache, so read and write on the file see them. The write back is always
+done before returning, whichever flag is given. Pages stay marked dirty, so they are written
+again by a later msync or munmap.
+*/
+int
+sys_msync(void *addr, size_t len, int flags)
+{
+    vaddr_t start;
+    vaddr_t end;
+    int result;
+
+    if (flags != MS_ASYNC && flags != MS_SYNC) {
         return EINVAL;
     }
 
-    if (new_heap_end > stack_top) {
-        lock_release(global_lock);
+    result = page_range(addr, len, &start, &end);
+    if (result) {
+        return result;
+    }
+
+    /* Writing back pages might have to page them in. */
+    if (!enough_free()) {
+        vm_wait_free();
+    }
+
+    struct addrspace *as = curproc->p_addrspace;
+    bool paging;
+
+    vm_lock_as(as, &paging);
+
+    if (!range_mapped(as, start, end, false)) {
+        vm_unlock_as(as, paging);
         return ENOMEM;
     }
 
-    v_page_l2_t old_l2 = L2_PNUM(old_heap_end);
-    v_page_l1_t old_l1 = L1_PNUM(old_heap_end);
-    v_page_l2_t new_l2 = L2_PNUM(new_heap_end);
-    v_page_l1_t new_l1 = L1_PNUM(new_heap_end);
-    struct l2_pt *l2_pt = as->l2_pt;
+    for (vaddr_t v_page = start; v_page < end; v_page += PAGE_SIZE) {
+        struct as_region *region = as_find_region(as, v_page);
 
-    if (new_heap_end < old_heap_end) {
-        free_sbrk(l2_pt, old_l1, old_l2, new_l1, new_l2);
-        tlb_invalidate();
+        if (region != NULL && region->ar_shared && region->ar_vnode != NULL) {
+            result = vm_writeback_range(as, region, v_page, v_page + PAGE_SIZE);
+            if (result) {
+                break;
+            }
+        }
     }
-    else if (new_heap_end > old_heap_end)
-    {
-        int result;
-        int used = get_num_used(old_l1, old_l2, new_l1, new_l2);
 
-        int32_t free_pages = last_page - cm_counter;
-        if (used > free_pages - MIN_FREE_PAGES){
-            lock_release(global_lock);
-            *retval0 = -1;
-            return ENOMEM;
+    vm_unlock_as(as, paging);
+
+    return result;
+}
+
+/*
+Mlock system call. Faults the pages of the range in, breaking copy on write for private writable
+pages, and locks them in memory: the clock passes them over until they are unlocked by munlock,
+or unmapped. Locks are not inherited by a forked child. If a page cannot be brought in, the ones
+before it stay locked.
+*/
+int
+sys_mlock(void *addr, size_t len)
+{
+    vaddr_t start;
+    vaddr_t end;
+    int result;
+
+    result = page_range(addr, len, &start, &end);
+    if (result) {
+        return result;
+    }
+
+    /* Locking might have to copy l1 page tables. */
+    if (!enough_free()) {
+        vm_wait_free();
+    }
+
+    struct addrspace *as = curproc->p_addrspace;
+    bool paging;
+
+    vm_lock_as(as, &paging);
+
+    if (!range_mapped(as, start, end, true)) {
+        vm_unlock_as(as, paging);
+        return ENOMEM;
+    }
+
+    vaddr_t v_page = start;
+    while (v_page < end) {
+        struct as_region *region = as_find_region(as, v_page);
+        bool write = as_region_writeable(as, v_page) && (region == NULL || !region->ar_shared);
+        int faulttype;
+
+        result = vm_mlock_page(as, v_page, write, &faulttype);
+        if (result) {
+            break;
         }
 
-        result = allocate_sbrk(l2_pt, old_l1, old_l2, new_l1, new_l2);
-        if (result){
-            panic("Kernel checked for empty pages, found them, but could not use them.");
+        if (faulttype < 0) {
+            v_page += PAGE_SIZE;
+            continue;
         }
+
+        /* vm_fault takes the locks itself; the page is looked at again once it is in. */
+        vm_unlock_as(as, paging);
+
+        result = vm_fault(faulttype, v_page);
+        if (result) {
+            return result;
+        }
+
+        vm_lock_as(as, &paging);
     }
 
-    *retval0 = old_heap_end;
-    as->brk = new_heap_end;
+    vm_unlock_as(as, paging);
+
+    return result;
+}
+
+/*
+Munlock system call. Unlocks the pages of the range that mlock locked.
+*/
+int
+sys_munlock(void *addr, size_t len)
+{
+    vaddr_t start;
+    vaddr_t end;
+    int result;
+
+    result = page_range(addr, len, &start, &end);
+    if (result) {
+        return result;
+    }
 
-    lock_release(global_lock);
+    struct addrspace *as = curproc->p_addrspace;
+    bool paging;
+
+    vm_lock_as(as, &paging);
+
+    if (!range_mapped(as, start, end, false)) {
+        vm_unlock_as(as, paging);
+        return ENOMEM;
+    }
+
+    for (vaddr_t v_page = start; v_page < end; v_page += PAGE_SIZE) {
+        result = vm_munlock_page(as, v_page);
+        if (result) {
+            break;
+        }
+    }
+
+    vm_unlock_as(as, paging);
+
+    return result;
+}
+
+/*
+Reads the pages of the range that are in swap back in, a readahead run at a time.
+*/
+static
+int
+madvise_willneed(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+    bool paging;
+    int result;
+
+    for (vaddr_t v_page = start; v_page < end; v_page += PAGE_SIZE) {
+        l1_entry_t entry;
+
+        vm_lock_as(as, &paging);
+        result = page_entry(as, v_page, &entry);
+        vm_unlock_as(as, paging);
+        if (result) {
+            return result;
+        }
+
+        if ((entry & ENTRY_VALID) && in_swap(entry & PAGE_MASK)) {
+            result = vm_fault(VM_FAULT_READ, v_page);
+            if (result) {
+                return result;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+Frees the pages of the range right away, so they are reclaimed without going through swap. The
+next touch of a page zero-fills it, or reads it from the file it maps. Dirty pages of shared file
+mappings are written back first, and pages of shared anonymous mappings, which hold the only copy
+of their data, are kept. Locked pages cannot be dropped.
+*/
+static
+int
+madvise_dontneed(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+    bool paging;
+    int result = 0;
+
+    /* Freeing pages might have to page in or copy l1 page tables. */
+    if (!enough_free()) {
+        vm_wait_free();
+    }
+
+    vm_lock_as(as, &paging);
+
+    for (vaddr_t v_page = start; v_page < end; v_page += PAGE_SIZE) {
+        l1_entry_t entry;
+
+        result = page_entry(as, v_page, &entry);
+        if (result) {
+            vm_unlock_as(as, paging);
+            return result;
+        }
+
+        if (entry & ENTRY_LOCKED) {
+            vm_unlock_as(as, paging);
+            return EINVAL;
+        }
+    }
+
+    struct tlb_batch batch;
+    vm_tlb_batch_init(&batch, as);
+    vm_tlb_batch_add_range(&batch, start, end);
+
+    for (vaddr_t v_page = start; v_page < end; v_page += PAGE_SIZE) {
+        struct as_region *region = as_find_region(as, v_page);
+
+        if (region != NULL && region->ar_shared) {
+            if (region->ar_vnode == NULL) {
+                continue;
+            }
+
+            result = vm_writeback_range(as, region, v_page, v_page + PAGE_SIZE);
+            if (result) {
+                break;
+            }
+        }
+
+        free_vpage(as->l2_pt, L2_PNUM(v_page), L1_PNUM(v_page));
+    }
+
+    vm_tlb_batch_sync(&batch);
+
+    vm_unlock_as(as, paging);
+
+    return result;
+}
+
+/*
+Madvise system call. MADV_DONTNEED and MADV_FREE free the pages of the range at once, and
+MADV_WILLNEED reads them in from swap. The access pattern hints are accepted but change nothing,
+since swap readahead already follows faults.
+*/
+int
+sys_madvise(void *addr, size_t len, int advice)
+{
+    vaddr_t start;
+    vaddr_t end;
+    int result;
+
+    result = page_range(addr, len, &start, &end);
+    if (result) {
+        return result;
+    }
+
+    struct addrspace *as = curproc->p_addrspace;
+    bool paging;
+
+    vm_lock_as(as, &paging);
+    bool mapped = range_mapped(as, start, end, false);
+    vm_unlock_as(as, paging);
+
+    if (!mapped) {
+        return ENOMEM;
+    }
+
+    switch (advice) {
+        case MADV_NORMAL:
+        case MADV_RANDOM:
+        case MADV_SEQUENTIAL:
+            return 0;
+
+        case MADV_WILLNEED:
+            return madvise_willneed(as, start, end);
+
+        case MADV_DONTNEED:
+        case MADV_FREE:
+            return madvise_dontneed(as, start, end);
+
+        default:
+            return EINVAL;
+    }
+}
+
+/*
+Mincore system call. Fills vec with a byte for each page of the range, which is 1 if the page is
+in RAM and 0 if it is in swap or was never touched. The bytes are copied out a chunk at a time,
+since the address space lock cannot be held while copying to user memory.
+*/
+int
+sys_mincore(void *addr, size_t len, userptr_t vec)
+{
+    unsigned char chunk[MINCORE_CHUNK];
+    vaddr_t start;
+    vaddr_t end;
+    int result;
+
+    result = page_range(addr, len, &start, &end);
+    if (result) {
+        return result;
+    }
+
+    /* Looking at the pages might have to page in l1 page tables. */
+    if (!enough_free()) {
+        vm_wait_free();
+    }
+
+    struct addrspace *as = curproc->p_addrspace;
+    bool paging;
+
+    vm_lock_as(as, &paging);
+    bool mapped = range_mapped(as, start, end, false);
+    vm_unlock_as(as, paging);
+
+    if (!mapped) {
+        return ENOMEM;
+    }
+
+    vaddr_t v_page = start;
+    while (v_page < end) {
+        size_t num = 0;
+
+        vm_lock_as(as, &paging);
+
+        while (num < MINCORE_CHUNK && v_page < end) {
+            l1_entry_t entry;
+
+            result = page_entry(as, v_page, &entry);
+            if (result) {
+                vm_unlock_as(as, paging);
+                return result;
+            }
+
+            chunk[num] = (entry & ENTRY_VALID) && in_ram(entry & PAGE_MASK);
+            num++;
+            v_page += PAGE_SIZE;
+        }
+
+        vm_unlock_as(as, paging);
+
+        result = copyout(chunk, vec, num);
+        if (result) {
+            return result;
+        }
+
+        vec = (userptr_t) ((char *) vec + num);
+    }
 
     return 0;
 }
@@ -10,6 +10,9 @@
 #include <copyinout.h>
 #include <psyscall.h>
 #include <wchan.h>
+#include <synch.h>
+#include <kern/wait.h>
+#include <kern/spawn.h>
 
 
 static
@@ -73,6 +76,52 @@ sys_fork(struct trapframe *tf, int32_t *retval0)
 	return 0;
 }
 
+/*
+ Forks the current process without copying its address space. The child runs
+ on the parent's address space, so the parent is suspended until the child
+ calls execv or exits.
+ */
+int
+sys_vfork(struct trapframe *tf, int32_t *retval0)
+{
+	struct proc *new_proc;
+	struct semaphore *sem;
+	int ret;
+
+	sem = sem_create("vfork", 0);
+	if (sem == NULL) {
+		return ENOMEM;
+	}
+
+	ret = proc_create_vfork("new_proc", sem, &new_proc);
+	if (ret) {
+		sem_destroy(sem);
+		return ret;
+	}
+
+	struct trapframe *new_tf;
+	setup_forked_trapframe(tf, &new_tf);
+
+	*retval0 = new_proc->pid;
+	ret = thread_fork("new_thread", new_proc, enter_usermode, new_tf, 1);
+	if (ret) {
+		pid_t pid = new_proc->pid;
+		/* The address space is ours; it must not go away with the child */
+		new_proc->p_addrspace = NULL;
+		new_proc->p_vfork_sem = NULL;
+		proc_destroy(new_proc);
+		pidtable_freepid(pid);
+		kfree(new_tf);
+		sem_destroy(sem);
+		return ret;
+	}
+
+	P(sem);
+	sem_destroy(sem);
+
+	return 0;
+}
+
 /*
  Gets the PID of the current process.
  */
@@ -373,7 +422,6 @@ sys_execv(const char *prog, char **args)
 		return ENOMEM;
 	}
 
-	as_destroy(as_old, curproc->pid);
 	switch_addrspace(as_new);
 
 	ret = load_elf(v, &entrypoint);
@@ -398,6 +446,14 @@ sys_execv(const char *prog, char **args)
 
 	vfs_close(v);
 
+	/* A vfork child hands the old address space back instead of destroying it */
+	if (curproc->p_vfork_sem != NULL) {
+		proc_vfork_release(curproc);
+	}
+	else {
+		as_destroy(as_old, curproc->pid);
+	}
+
 	userptr_t args_out_addr;
 	copy_out_args(argc, args_in, size, &stackptr, &args_out_addr);
 
@@ -410,3 +466,309 @@ sys_execv(const char *prog, char **args)
 	panic("enter_new_process returned\n");
 	return EINVAL;
 }
+
+/*
+Everything a spawned child needs to load its program.
+*/
+struct spawn_image {
+	struct vnode *si_vnode;
+	char *si_progname;
+	int si_argc;
+	char **si_args;
+	int *si_size;
+};
+
+/*
+Applies the spawn file actions to the child's file table. The child has not
+run yet, so nothing else can be using the table.
+*/
+static
+int
+spawn_file_actions(struct ft *ft, struct spawn_action *actions, int nactions)
+{
+	for (int i = 0; i < nactions; i++) {
+		struct spawn_action *sa = &actions[i];
+
+		if (!fd_valid_and_used(ft, sa->sa_fd)) {
+			return EBADF;
+		}
+
+		switch (sa->sa_op) {
+			case SPAWN_CLOSE:
+			free_fd(ft, sa->sa_fd);
+			break;
+
+			case SPAWN_DUP2:
+			if (!fd_valid(sa->sa_newfd)) {
+				return EBADF;
+			}
+			if (sa->sa_newfd == sa->sa_fd) {
+				break;
+			}
+			free_fd(ft, sa->sa_newfd);
+			assign_fd(ft, ft->entries[sa->sa_fd], sa->sa_newfd);
+			break;
+
+			default:
+			return EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+/*
+Entry point of a spawned child: builds its first address space directly from
+the program image. A program that fails to load exits with status 127.
+*/
+static
+void
+enter_spawned(void *data1, unsigned long data2)
+{
+	(void) data2;
+	struct spawn_image *si = data1;
+	vaddr_t entrypoint, stackptr;
+	int ret;
+
+	struct addrspace *as = as_create();
+	if (as == NULL) {
+		ret = ENOMEM;
+		goto fail;
+	}
+
+	proc_setas(as);
+	as_activate();
+
+	ret = load_elf(si->si_vnode, &entrypoint);
+	if (ret) {
+		goto fail;
+	}
+
+	ret = as_define_stack(as, &stackptr);
+	if (ret) {
+		goto fail;
+	}
+
+	vfs_close(si->si_vnode);
+
+	userptr_t args_out_addr;
+	int argc = si->si_argc;
+	copy_out_args(argc, si->si_args, si->si_size, &stackptr, &args_out_addr);
+
+	kfree(si->si_progname);
+	free_copied_in_args(argc, si->si_size, si->si_args);
+	kfree(si);
+
+	enter_new_process(argc, args_out_addr, NULL, stackptr, entrypoint);
+
+	/* enter_new_process does not return. */
+	panic("enter_new_process returned\n");
+
+fail:
+	vfs_close(si->si_vnode);
+	kfree(si->si_progname);
+	free_copied_in_args(si->si_argc, si->si_size, si->si_args);
+	kfree(si);
+
+	sys__exit(_MKWAIT_EXIT(127));
+}
+
+/*
+Creates a child process running prog, without copying the address space of
+the current process. The file actions are applied to the child's copy of the
+file table. Errors in the arguments, the actions, or opening prog are returned
+to the caller; a program that then fails to load exits with status 127.
+*/
+int
+sys_spawn(const char *prog, char **args, const struct spawn_action *user_actions,
+	  int nactions, int32_t *retval0)
+{
+	int ret;
+
+	if (prog == NULL || args == NULL) {
+		return EFAULT;
+	}
+
+	if (nactions < 0 || nactions > SPAWN_ACTIONS_MAX) {
+		return EINVAL;
+	}
+
+	/* Kernel stacks are small; the actions go on the heap */
+	struct spawn_action *actions = kmalloc(SPAWN_ACTIONS_MAX*sizeof(struct spawn_action));
+	if (actions == NULL) {
+		return ENOMEM;
+	}
+	if (nactions > 0) {
+		ret = copyin((const_userptr_t) user_actions, actions,
+			     nactions*sizeof(struct spawn_action));
+		if (ret) {
+			kfree(actions);
+			return ret;
+		}
+	}
+
+	char *progname;
+	ret = string_in(prog, &progname, PATH_MAX);
+	if (ret) {
+		kfree(actions);
+		return ret;
+	}
+
+	int argc;
+	ret = get_argc(args, &argc);
+	if (ret) {
+		kfree(actions);
+		kfree(progname);
+		return ret;
+	}
+
+	char **args_in = kmalloc(argc*sizeof(char *));
+	int *size = kmalloc(argc*sizeof(int));
+	ret = copy_in_args(argc, args, args_in, size);
+	if (ret) {
+		kfree(args_in);
+		kfree(size);
+		kfree(actions);
+		kfree(progname);
+		return ret;
+	}
+
+	struct spawn_image *si = kmalloc(sizeof(struct spawn_image));
+	if (si == NULL) {
+		kfree(actions);
+		kfree(progname);
+		free_copied_in_args(argc, size, args_in);
+		return ENOMEM;
+	}
+
+	struct vnode *v;
+	ret = vfs_open(progname, O_RDONLY, 0, &v);
+	if (ret) {
+		kfree(si);
+		kfree(actions);
+		kfree(progname);
+		free_copied_in_args(argc, size, args_in);
+		return ret;
+	}
+
+	struct proc *new_proc;
+	ret = proc_create_spawn("new_proc", &new_proc);
+	if (ret) {
+		goto fail;
+	}
+
+	ret = spawn_file_actions(new_proc->proc_ft, actions, nactions);
+	kfree(actions);
+	actions = NULL;
+	if (ret) {
+		goto fail_proc;
+	}
+
+	si->si_vnode = v;
+	si->si_progname = progname;
+	si->si_argc = argc;
+	si->si_args = args_in;
+	si->si_size = size;
+
+	*retval0 = new_proc->pid;
+	ret = thread_fork("new_thread", new_proc, enter_spawned, si, 0);
+	if (ret) {
+		goto fail_proc;
+	}
+
+	return 0;
+
+fail_proc: ;
+	pid_t pid = new_proc->pid;
+	proc_destroy(new_proc);
+	pidtable_freepid(pid);
+fail:
+	vfs_close(v);
+	kfree(si);
+	kfree(actions);
+	kfree(progname);
+	free_copied_in_args(argc, size, args_in);
+	return ret;
+}
+
+/*
+ Gets a resource limit of the current process.
+ */
+int
+sys_getrlimit(int resource, userptr_t rlp)
+{
+	struct rlimit rl;
+
+	if (resource < 0 || resource >= __RLIMIT_NUM) {
+		return EINVAL;
+	}
+
+	spinlock_acquire(&curproc->p_lock);
+	rl = curproc->p_rlimit[resource];
+	spinlock_release(&curproc->p_lock);
+
+	return copyout(&rl, rlp, sizeof(struct rlimit));
+}
+
+/*
+ Sets a resource limit of the current process. The soft limit may not be
+ above the hard limit, and the hard limit can only be lowered. So far only
+ RLIMIT_STACK and RLIMIT_RSS are enforced. RLIMIT_STACK is checked by
+ as_grow_stack; lowering it does not shrink a stack that has already grown
+ past the new limit. RLIMIT_RSS is checked by vm_fault, which evicts pages
+ of the process once it is over the limit.
+ */
+int
+sys_setrlimit(int resource, const_userptr_t rlp)
+{
+	struct rlimit rl;
+	int ret;
+
+	if (resource < 0 || resource >= __RLIMIT_NUM) {
+		return EINVAL;
+	}
+
+	ret = copyin(rlp, &rl, sizeof(struct rlimit));
+	if (ret) {
+		return ret;
+	}
+
+	if (rl.rlim_cur > rl.rlim_max) {
+		return EINVAL;
+	}
+
+	spinlock_acquire(&curproc->p_lock);
+	if (rl.rlim_max > curproc->p_rlimit[resource].rlim_max) {
+		spinlock_release(&curproc->p_lock);
+		return EPERM;
+	}
+	curproc->p_rlimit[resource] = rl;
+	spinlock_release(&curproc->p_lock);
+
+	return 0;
+}
+
+/*
+ Gets the resource usage of the current process. Only memory use is
+ tracked: the peak resident set size, the page faults and the pages
+ written out to swap. The usage of children is not kept.
+ */
+int
+sys_getrusage(int who, userptr_t usage)
+{
+	struct rusage ru;
+	struct addrspace *as;
+
+	if (who != RUSAGE_SELF) {
+		return EINVAL;
+	}
+
+	bzero(&ru, sizeof(struct rusage));
+
+	as = proc_getas();
+	if (as != NULL) {
+		vm_getrusage(as, &ru);
+	}
+
+	return copyout(&ru, usage, sizeof(struct rusage));
+}
@@ -194,6 +194,8 @@ cpu_create(unsigned hardware_number)
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_queued = 0;
+	c->c_shootdown_done = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -644,7 +646,10 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			/* Zero a free page for the VM system, or wait. */
+			if (!vm_zero_idle()) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -1184,12 +1189,116 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 		target->c_numshootdown = n+1;
 	}
 
+	target->c_shootdown_queued++;
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
 
 	spinlock_release(&target->c_ipi_lock);
 }
 
+void
+ipi_tlbshootdown_all(void)
+{
+	unsigned i;
+	struct cpu *c;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+
+		spinlock_acquire(&c->c_ipi_lock);
+		c->c_numshootdown = TLBSHOOTDOWN_ALL;
+		c->c_shootdown_queued++;
+		c->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
+		mainbus_send_ipi(c);
+		spinlock_release(&c->c_ipi_lock);
+	}
+}
+
+/*
+ * Queue a batch of shootdowns on each CPU in the mask (by c_number)
+ * other than the current one, with a single IPI per CPU. A CPU whose
+ * queue would overflow flushes its whole TLB instead, so passing more
+ * than TLBSHOOTDOWN_MAX mappings (MAPPINGS may then be NULL) makes
+ * every CPU in the mask flush everything.
+ */
+void
+ipi_tlbshootdown_batch(uint32_t cpus, const struct tlbshootdown *mappings,
+		       unsigned num)
+{
+	unsigned i, j;
+	int n;
+	struct cpu *c;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self ||
+		    !(cpus & ((uint32_t)1 << c->c_number))) {
+			continue;
+		}
+
+		spinlock_acquire(&c->c_ipi_lock);
+		n = c->c_numshootdown;
+		if (n == TLBSHOOTDOWN_ALL) {
+			/* already flushing everything */
+		}
+		else if ((unsigned)n + num > TLBSHOOTDOWN_MAX) {
+			c->c_numshootdown = TLBSHOOTDOWN_ALL;
+		}
+		else {
+			for (j=0; j < num; j++) {
+				c->c_shootdown[n + j] = mappings[j];
+			}
+			c->c_numshootdown = n + num;
+		}
+		c->c_shootdown_queued++;
+		c->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
+		mainbus_send_ipi(c);
+		spinlock_release(&c->c_ipi_lock);
+	}
+}
+
+/*
+ * Wait until each CPU in the mask has carried out every shootdown
+ * queued on it before the call, for callers about to reuse, copy or
+ * free a page whose mappings they shot down. The caller must not hold
+ * a spinlock: interrupts have to stay enabled, so that CPUs waiting
+ * for each other still take each other's shootdowns. The current CPU
+ * is waited for like the others, since the thread may have moved to a
+ * CPU in the mask since it sent the IPIs.
+ */
+void
+ipi_tlbshootdown_wait(uint32_t cpus)
+{
+	unsigned i;
+	uint32_t target;
+	bool done;
+	struct cpu *c;
+
+	KASSERT(curcpu->c_spinlocks == 0);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(curthread->t_curspl == 0);
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (!(cpus & ((uint32_t)1 << c->c_number))) {
+			continue;
+		}
+
+		spinlock_acquire(&c->c_ipi_lock);
+		target = c->c_shootdown_queued;
+		spinlock_release(&c->c_ipi_lock);
+
+		do {
+			spinlock_acquire(&c->c_ipi_lock);
+			done = (int32_t)(c->c_shootdown_done - target) >= 0;
+			spinlock_release(&c->c_ipi_lock);
+		} while (!done);
+	}
+}
+
 void
 interprocessor_interrupt(void)
 {
@@ -1232,6 +1341,7 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdown_done = curcpu->c_shootdown_queued;
 	}
 
 	curcpu->c_ipi_pending = 0;
@@ -237,15 +237,17 @@ null_fsync(struct vnode *v)
 }
 
 /*
- * For mmap. If you want this to do anything, you have to write it
- * yourself. Some devices may not make sense to map. Others do.
+ * For mmap. Mapped files are paged through vop_read and vop_write,
+ * which does not make sense for devices, so none can be mapped.
  */
 static
 int
-dev_mmap(struct vnode *v  /* add stuff as needed */)
+dev_mmap(struct vnode *v, off_t offset, int prot)
 {
 	(void)v;
-	return ENOSYS;
+	(void)offset;
+	(void)prot;
+	return ENODEV;
 }
 
 /*
@@ -7,6 +7,11 @@
 #include <spl.h>
 #include <mips/tlb.h>
 #include <wchan.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <current.h>
+#include <kern/resource.h>
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -16,7 +21,6 @@
 
 extern struct spinlock global;
 extern struct lock *global_lock;
-extern struct cv *global_cv;
 
 extern struct cm *cm;
 extern struct spinlock cm_spinlock;
@@ -29,18 +33,15 @@ extern bool io_flag;
 int
 l1_create(struct l1_pt **l1_pt)
 {
+    KASSERT(sizeof(struct l1_pt) == PAGE_SIZE);
+
+    /* An empty l1 page table is all zeros, so it is taken from the zero pool; kfree frees it. */
     struct l1_pt *l1_pt_new;
-    l1_pt_new = kmalloc(sizeof(struct l1_pt));
+    l1_pt_new = (struct l1_pt *) alloc_kpage_zeroed();
     if (l1_pt_new == NULL) {
         return ENOMEM;
     }
 
-    KASSERT(((vaddr_t) l1_pt_new) % PAGE_SIZE == 0);
-
-    for (v_page_l1_t v_l1 = 0; v_l1 < NUM_L1PT_ENTRIES; v_l1++) {
-        l1_pt_new->l1_entries[v_l1] = 0;
-    }
-
     *l1_pt = l1_pt_new;
     return 0;
 }
@@ -66,6 +67,47 @@ tlb_invalidate() {
     splx(spl);
 }
 
+/*
+Number of pages of len bytes of a region that count against the commit limit. Only private,
+writeable mappings made by mmap need memory of their own; see vm_commit.
+*/
+static
+size_t
+region_commit_pages(struct as_region *region, size_t len)
+{
+    if (region->ar_mapped && !region->ar_shared && region->ar_writeable) {
+        return len / PAGE_SIZE;
+    }
+
+    return 0;
+}
+
+/*
+Number of pages committed for the heap, the stack and the mappings of an address space.
+*/
+static
+size_t
+as_commit_pages(struct addrspace *as)
+{
+    size_t npages = (as->brk - as->heap_base + USERSTACK - as->stack_top) / PAGE_SIZE;
+
+    for (struct as_region *region = as->regions; region != NULL; region = region->ar_next) {
+        npages += region_commit_pages(region, region->ar_memsize);
+    }
+
+    return npages;
+}
+
+static
+void
+region_destroy(struct as_region *region)
+{
+    if (region->ar_vnode != NULL) {
+        VOP_DECREF(region->ar_vnode);
+    }
+    kfree(region);
+}
+
 struct addrspace *
 as_create(void)
 {
@@ -82,14 +124,78 @@ as_create(void)
         return NULL;
     }
 
+    as->as_lock = lock_create("as_lock");
+    if (as->as_lock == NULL) {
+        kfree(as->l2_pt);
+        kfree(as);
+        return NULL;
+    }
+
     l2_init(as->l2_pt);
+    as->as_asid = 0;
+    as->as_cpus = 0;
+    as->regions = NULL;
     as->heap_base = 0;
-    as->stack_top = USERSTACK - STACK_SIZE;
+    as->stack_top = USERSTACK;
     as->brk = 0;
+    as->as_rss_pages = 0;
+    as->as_swap_pages = 0;
+    as->as_rss_max = 0;
+    as->as_minflt = 0;
+    as->as_majflt = 0;
+    as->as_nswap = 0;
+    as->as_rss_hand = 0;
 
     return as;
 }
 
+/*
+Adds the references of newas to an l1 page table it shares with the address space it is copied
+from, and to every page the l1 page table maps. If that fails, the references added so far are
+dropped, so newas can be destroyed without them.
+*/
+static
+int
+copy_l1_refs(struct addrspace *newas, v_page_l2_t v_l2, struct l1_pt *l1_pt)
+{
+    p_page_t p_page_l1 = ADDR_TO_PAGE(KVADDR_TO_PADDR((vaddr_t) l1_pt));
+    v_page_l1_t v_l1;
+    int result;
+
+    spinlock_acquire(&cm_spinlock);
+
+    result = cm_addref(p_page_l1, newas, PAGE_TO_ADDR(PNUM_TO_PAGE(v_l2, 0)));
+    if (result) {
+        spinlock_release(&cm_spinlock);
+        return result;
+    }
+
+    for (v_l1 = 0; v_l1 < NUM_L1PT_ENTRIES; v_l1++) {
+        l1_entry_t l1_entry = l1_pt->l1_entries[v_l1];
+        if (l1_entry & ENTRY_VALID) {
+            result = cm_addref(l1_entry & PAGE_MASK, newas, PAGE_TO_ADDR(PNUM_TO_PAGE(v_l2, v_l1)));
+            if (result) {
+                break;
+            }
+        }
+    }
+
+    if (result) {
+        while (v_l1 > 0) {
+            v_l1--;
+            l1_entry_t l1_entry = l1_pt->l1_entries[v_l1];
+            if (l1_entry & ENTRY_VALID) {
+                cm_remref(l1_entry & PAGE_MASK, newas, PAGE_TO_ADDR(PNUM_TO_PAGE(v_l2, v_l1)));
+            }
+        }
+        cm_remref(p_page_l1, newas, PAGE_TO_ADDR(PNUM_TO_PAGE(v_l2, 0)));
+    }
+
+    spinlock_release(&cm_spinlock);
+
+    return result;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret, pid_t pid)
 {
@@ -100,6 +206,7 @@ as_copy(struct addrspace *old, struct addrspace **ret, pid_t pid)
     KASSERT(proc->p_addrspace == *ret);
 
     struct addrspace *newas;
+    bool paging;
     int result;
 
     newas = as_create();
@@ -107,64 +214,122 @@ as_copy(struct addrspace *old, struct addrspace **ret, pid_t pid)
         return ENOMEM;
     }
 
-    lock_acquire(global_lock);
-
-    while (!enough_free()) {
-        cv_wait(global_cv, global_lock);
+    if (!enough_free()) {
+        vm_wait_free();
     }
 
-    tlb_invalidate();
+    vm_lock_as(old, &paging);
+
+    /* The child's heap and stack are committed separately, since either copy can be touched later. */
+    result = vm_commit((old->brk - old->heap_base + USERSTACK - old->stack_top) / PAGE_SIZE);
+    if (result) {
+        vm_unlock_as(old, paging);
+        as_destroy(newas, pid);
+        return result;
+    }
 
     newas->heap_base = old->heap_base;
     newas->stack_top = old->stack_top;
     newas->brk = old->brk;
 
+    /* Each region is committed as it is copied, so as_destroy uncommits exactly what was. */
+    struct as_region **tail = &newas->regions;
+    for (struct as_region *region = old->regions; region != NULL; region = region->ar_next) {
+        result = vm_commit(region_commit_pages(region, region->ar_memsize));
+        if (result) {
+            vm_unlock_as(old, paging);
+            as_destroy(newas, pid);
+            return result;
+        }
+
+        struct as_region *copy = kmalloc(sizeof(struct as_region));
+        if (copy == NULL) {
+            vm_uncommit(region_commit_pages(region, region->ar_memsize));
+            vm_unlock_as(old, paging);
+            as_destroy(newas, pid);
+            return ENOMEM;
+        }
+
+        *copy = *region;
+        copy->ar_next = NULL;
+        if (copy->ar_vnode != NULL) {
+            VOP_INCREF(copy->ar_vnode);
+        }
+
+        *tail = copy;
+        tail = &copy->ar_next;
+    }
+
     struct l2_pt *l2_pt_new = newas->l2_pt;
     struct l2_pt *l2_pt_old = old->l2_pt;
     struct l1_pt *l1_pt_old;
 
+    /* Pages of the old address space that are made read only lose their writable TLB entries. */
+    struct tlb_batch batch;
+    vm_tlb_batch_init(&batch, old);
+
     for (v_page_l2_t v_l2 = 0; v_l2 < NUM_L2PT_ENTRIES; v_l2++) {
         l2_pt_old->l2_entries[v_l2] = l2_pt_old->l2_entries[v_l2] & (~ENTRY_WRITABLE);
 
         if (l2_pt_old->l2_entries[v_l2] & ENTRY_VALID) {
             result = get_l1_pt(l2_pt_old, v_l2, &l1_pt_old, false);
             if (result) {
+                vm_tlb_batch_sync(&batch);
+                vm_unlock_as(old, paging);
                 as_destroy(newas, pid);
-                lock_release(global_lock);
                 return result;
             }
 
-            p_page_t p_page_l1 = ADDR_TO_PAGE(KVADDR_TO_PADDR((vaddr_t) l1_pt_old));
-
-            spinlock_acquire(&cm_spinlock);
-
-            cm_incref(p_page_l1);
-            add_pid8(p_page_l1, pid);
-
-            spinlock_release(&cm_spinlock);
-
+            bool locked = false;
             for (v_page_l1_t v_l1 = 0; v_l1 < NUM_L1PT_ENTRIES; v_l1++) {
-                l1_pt_old->l1_entries[v_l1] = l1_pt_old->l1_entries[v_l1] & (~ENTRY_WRITABLE);
-
-                if (l1_pt_old->l1_entries[v_l1] & ENTRY_VALID) {
-                    p_page_t p_page = l1_pt_old->l1_entries[v_l1] & PAGE_MASK;
+                l1_entry_t l1_entry = l1_pt_old->l1_entries[v_l1];
+                if ((l1_entry & ENTRY_VALID) && (l1_entry & ENTRY_WRITABLE)) {
+                    vm_tlb_batch_add(&batch, PAGE_TO_ADDR(PNUM_TO_PAGE(v_l2, v_l1)));
+                }
+                locked = locked || (l1_entry & ENTRY_LOCKED);
+                l1_pt_old->l1_entries[v_l1] = l1_entry & (~ENTRY_WRITABLE);
+            }
 
-                    spinlock_acquire(&cm_spinlock);
+            result = copy_l1_refs(newas, v_l2, l1_pt_old);
+            if (result) {
+                vm_tlb_batch_sync(&batch);
+                vm_unlock_as(old, paging);
+                as_destroy(newas, pid);
+                return result;
+            }
 
-                    cm_incref(p_page);
-                    add_pid8(p_page, pid);
+            l2_pt_new->l2_entries[v_l2] = l2_pt_old->l2_entries[v_l2];
+
+            /*
+            Locks made by mlock are not inherited. The old address space takes a copy of an l1
+            page table holding locked entries, and the new one keeps the original without them.
+            */
+            if (locked) {
+                struct l1_pt *l1_pt_copy;
+                result = get_l1_pt(l2_pt_old, v_l2, &l1_pt_copy, true);
+                if (result) {
+                    vm_tlb_batch_sync(&batch);
+                    vm_unlock_as(old, paging);
+                    as_destroy(newas, pid);
+                    return result;
+                }
 
-                    spinlock_release(&cm_spinlock);
+                for (v_page_l1_t v_l1 = 0; v_l1 < NUM_L1PT_ENTRIES; v_l1++) {
+                    l1_pt_old->l1_entries[v_l1] = l1_pt_old->l1_entries[v_l1] & (~ENTRY_LOCKED);
                 }
             }
+
+            continue;
         }
 
         l2_pt_new->l2_entries[v_l2] = l2_pt_old->l2_entries[v_l2];
     }
 
+    vm_tlb_batch_sync(&batch);
+
     *ret = newas;
 
-    lock_release(global_lock);
+    vm_unlock_as(old, paging);
     return 0;
 }
 
@@ -179,13 +344,26 @@ as_destroy(struct addrspace *as, pid_t pid)
     KASSERT(proc != NULL);
     KASSERT(proc->pid == pid);
 
+    /*
+    The paging daemon finds the address spaces of a page's owners through its rmap,
+    so an address space must not disappear while a page is being evicted.
+    */
     lock_acquire(global_lock);
-    tlb_invalidate();
+    lock_acquire(as->as_lock);
+    vm_clear_utlb_pt(as->l2_pt);
 
     struct l2_pt *l2_pt = as->l2_pt;
     struct l1_pt *l1_pt;
     int result;
 
+    /* Nothing can report a failure to write back from here, so errors are dropped. */
+    for (struct as_region *region = as->regions; region != NULL; region = region->ar_next) {
+        if (region->ar_shared && region->ar_vnode != NULL) {
+            vm_writeback_range(as, region, region->ar_vbase,
+                               region->ar_vbase + region->ar_memsize);
+        }
+    }
+
     for (v_page_l2_t v_l2 = 0; v_l2 < NUM_L2PT_ENTRIES; v_l2++) {
         if (l2_pt->l2_entries[v_l2] & ENTRY_VALID) {
             result = get_l1_pt(l2_pt, v_l2, &l1_pt, false);
@@ -198,14 +376,33 @@ as_destroy(struct addrspace *as, pid_t pid)
 
                 if (l1_entry & ENTRY_VALID) {
                     p_page_t p_page = l1_entry & PAGE_MASK;
-                    release_ppage(p_page, pid);
+
+                    if (l1_entry & ENTRY_LOCKED) {
+                        spinlock_acquire(&cm_spinlock);
+                        cm_munlock(p_page);
+                        spinlock_release(&cm_spinlock);
+                    }
+
+                    release_ppage(p_page, as, PAGE_TO_ADDR(PNUM_TO_PAGE(v_l2, v_l1)));
                 }
             }
 
-            release_ppage(ADDR_TO_PAGE(KVADDR_TO_PADDR((vaddr_t) l1_pt)), pid);
+            release_ppage(ADDR_TO_PAGE(KVADDR_TO_PADDR((vaddr_t) l1_pt)), as,
+                          PAGE_TO_ADDR(PNUM_TO_PAGE(v_l2, 0)));
         }
     }
 
+    vm_uncommit(as_commit_pages(as));
+
+    while (as->regions != NULL) {
+        struct as_region *region = as->regions;
+        as->regions = region->ar_next;
+        region_destroy(region);
+    }
+
+    lock_release(as->as_lock);
+    lock_destroy(as->as_lock);
+
     kfree(as->l2_pt);
     kfree(as);
 
@@ -221,13 +418,14 @@ as_activate(void)
     if (as == NULL) {
         return;
     }
-    tlb_invalidate();
+    vm_activate_asid(as);
+    vm_set_utlb_pt(as->l2_pt);
 }
 
 void
 as_deactivate(void)
 {
-    /* Nothing */
+    vm_set_utlb_pt(NULL);
 }
 
 /*
@@ -235,14 +433,18 @@ as_deactivate(void)
  * segment in memory extends from VADDR up to (but not including)
  * VADDR+MEMSIZE.
  *
+ * The first FILESIZE bytes of the segment are the contents of V starting
+ * at OFFSET; the rest is zero-filled. Nothing is read here: vm_fault
+ * reads each page of the segment when it is first touched.
+ *
  * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * write, or execute permission should be set on the segment. Writes
+ * to pages of segments that are not writeable fail.
  */
 
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+         struct vnode *v, off_t offset, size_t filesize,
          int readable, int writeable, int executable)
 {
     /*
@@ -251,14 +453,38 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
     Thus, the top of this region should be available for heap. This implementation
     finds this top.
     */
-    (void)as;
-    (void)vaddr;
-    (void)sz;
-    (void)readable;
-    (void)writeable;
-    (void)executable;
+    KASSERT(v != NULL);
 
     vaddr_t region_end = vaddr + sz;
+    if (region_end < vaddr || region_end > USERSPACETOP) {
+        return EFAULT;
+    }
+
+    if (filesize > sz) {
+        kprintf("ELF: warning: segment filesize > segment memsize\n");
+        filesize = sz;
+    }
+
+    struct as_region *region = kmalloc(sizeof(struct as_region));
+    if (region == NULL) {
+        return ENOMEM;
+    }
+
+    region->ar_vbase = vaddr;
+    region->ar_memsize = sz;
+    region->ar_vnode = v;
+    region->ar_offset = offset;
+    region->ar_filesize = filesize;
+    region->ar_readable = readable != 0;
+    region->ar_writeable = writeable != 0;
+    region->ar_executable = executable != 0;
+    region->ar_mapped = false;
+    region->ar_shared = false;
+    region->ar_next = as->regions;
+
+    VOP_INCREF(v);
+    as->regions = region;
+
     if (region_end > as->heap_base) {
         vaddr_t page_aligned_end = VPAGE_ADDR_MASK & region_end;
         page_aligned_end += PAGE_SIZE;
@@ -270,6 +496,369 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
     return 0;
 }
 
+/*
+Reads the parts of the regions that overlap the virtual page into the page frame at kvaddr.
+The frame must already be zeroed, which takes care of the parts of the regions past their
+file contents.
+*/
+int
+as_fill_page(struct addrspace *as, vaddr_t vpage, vaddr_t kvaddr)
+{
+    KASSERT((vpage & ~VPAGE_ADDR_MASK) == 0);
+    struct iovec iov;
+    struct uio ku;
+    int result;
+
+    for (struct as_region *region = as->regions; region != NULL; region = region->ar_next) {
+        if (region->ar_vnode == NULL) {
+            continue;
+        }
+
+        vaddr_t file_start = region->ar_vbase;
+        vaddr_t file_end = region->ar_vbase + region->ar_filesize;
+
+        vaddr_t start = vpage > file_start ? vpage : file_start;
+        vaddr_t end = vpage + PAGE_SIZE < file_end ? vpage + PAGE_SIZE : file_end;
+        if (start >= end) {
+            continue;
+        }
+
+        uio_kinit(&iov, &ku, (void *) (kvaddr + (start - vpage)), end - start,
+                  region->ar_offset + (start - file_start), UIO_READ);
+
+        result = VOP_READ(region->ar_vnode, &ku);
+        if (result) {
+            return result;
+        }
+
+        /* A mapped file may have shrunk since mmap; the rest of the page stays zeroed. */
+        if (ku.uio_resid != 0 && !region->ar_mapped) {
+            /* short read; the executable was truncated since exec */
+            return ENOEXEC;
+        }
+    }
+
+    return 0;
+}
+
+/*
+Checks if no region has file contents in the virtual page, so that it is all zeros until it is
+written. Such pages can be backed by the shared zero page on a read fault.
+*/
+bool
+as_page_zero_fill(struct addrspace *as, vaddr_t vpage)
+{
+    KASSERT((vpage & ~VPAGE_ADDR_MASK) == 0);
+
+    for (struct as_region *region = as->regions; region != NULL; region = region->ar_next) {
+        if (region->ar_vnode == NULL) {
+            continue;
+        }
+
+        vaddr_t file_start = region->ar_vbase;
+        vaddr_t file_end = region->ar_vbase + region->ar_filesize;
+
+        if (vpage < file_end && file_start < vpage + PAGE_SIZE) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+Checks if the virtual page can be written. Pages outside of the regions (heap and stack)
+are always writeable.
+*/
+bool
+as_region_writeable(struct addrspace *as, vaddr_t vpage)
+{
+    bool in_region = false;
+
+    for (struct as_region *region = as->regions; region != NULL; region = region->ar_next) {
+        vaddr_t start = region->ar_vbase & VPAGE_ADDR_MASK;
+        vaddr_t end = region->ar_vbase + region->ar_memsize;
+
+        if (start <= vpage && vpage < end) {
+            if (region->ar_writeable) {
+                return true;
+            }
+            in_region = true;
+        }
+    }
+
+    return !in_region;
+}
+
+struct as_region *
+as_find_region(struct addrspace *as, vaddr_t vaddr)
+{
+    for (struct as_region *region = as->regions; region != NULL; region = region->ar_next) {
+        vaddr_t start = region->ar_vbase & VPAGE_ADDR_MASK;
+        vaddr_t end = region->ar_vbase + region->ar_memsize;
+
+        if (start <= vaddr && vaddr < end) {
+            return region;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+Returns a region that overlaps the range from start to end, or NULL.
+*/
+static
+struct as_region *
+find_overlap(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+    for (struct as_region *region = as->regions; region != NULL; region = region->ar_next) {
+        vaddr_t region_start = region->ar_vbase & VPAGE_ADDR_MASK;
+        vaddr_t region_end = region->ar_vbase + region->ar_memsize;
+
+        if (region_start < end && start < region_end) {
+            return region;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+Highest address mmap places mappings below, leaving room for the stack to grow to its limit and
+for its guard pages. A limit too large to keep clear only keeps the stack as it is now clear.
+*/
+static
+vaddr_t
+stack_reserve(struct addrspace *as)
+{
+    vaddr_t floor = as->stack_top;
+
+    spinlock_acquire(&curproc->p_lock);
+    rlim_t limit = curproc->p_rlimit[RLIMIT_STACK].rlim_cur;
+    spinlock_release(&curproc->p_lock);
+
+    if (limit <= STACK_RESERVE_MAX) {
+        vaddr_t limit_floor = USERSTACK - ROUNDUP((vaddr_t) limit, PAGE_SIZE);
+        if (limit_floor < floor) {
+            floor = limit_floor;
+        }
+    }
+
+    return floor - STACK_GUARD_PAGES * PAGE_SIZE;
+}
+
+/*
+Extends the stack down to the page of vaddr, which must be below it. This fails if the stack
+would pass the RLIMIT_STACK soft limit of the current process, or come within STACK_GUARD_PAGES
+of the heap or of a mapping. The new pages are committed, but only allocated as they are touched.
+The address space lock must be held.
+*/
+int
+as_grow_stack(struct addrspace *as, vaddr_t vaddr)
+{
+    KASSERT(lock_do_i_hold(as->as_lock));
+    KASSERT(vaddr < as->stack_top);
+
+    vaddr_t new_top = vaddr & VPAGE_ADDR_MASK;
+    size_t guard = STACK_GUARD_PAGES * PAGE_SIZE;
+    int result;
+
+    spinlock_acquire(&curproc->p_lock);
+    rlim_t limit = curproc->p_rlimit[RLIMIT_STACK].rlim_cur;
+    spinlock_release(&curproc->p_lock);
+
+    if (limit < USERSTACK - new_top) {
+        return ENOMEM;
+    }
+
+    if (new_top < as->brk || new_top - as->brk < guard) {
+        return ENOMEM;
+    }
+
+    if (find_overlap(as, new_top - guard, as->stack_top) != NULL) {
+        return ENOMEM;
+    }
+
+    result = vm_commit((as->stack_top - new_top) / PAGE_SIZE);
+    if (result) {
+        return result;
+    }
+
+    as->stack_top = new_top;
+
+    return 0;
+}
+
+vaddr_t
+as_mmap_floor(struct addrspace *as)
+{
+    vaddr_t floor = stack_reserve(as);
+
+    for (struct as_region *region = as->regions; region != NULL; region = region->ar_next) {
+        if (region->ar_mapped && region->ar_vbase < floor) {
+            floor = region->ar_vbase;
+        }
+    }
+
+    return floor;
+}
+
+/*
+Adds an mmap region, whose ar_memsize must be a multiple of the page size. Mappings live between
+the heap and the stack. Unless fixed is set, the highest free range below the stack is used,
+leaving the heap as much room as possible; otherwise the region must fit at its ar_vbase.
+The address space lock must be held.
+*/
+int
+as_map_region(struct addrspace *as, struct as_region *region, bool fixed)
+{
+    KASSERT(lock_do_i_hold(as->as_lock));
+    KASSERT(region->ar_mapped);
+    KASSERT(region->ar_memsize % PAGE_SIZE == 0);
+
+    size_t size = region->ar_memsize;
+
+    if (fixed) {
+        vaddr_t start = region->ar_vbase;
+        if (start < as->brk || start > as->stack_top || as->stack_top - start < size) {
+            return EINVAL;
+        }
+
+        if (find_overlap(as, start, start + size) != NULL) {
+            return EINVAL;
+        }
+    } else {
+        vaddr_t end = stack_reserve(as);
+
+        for (;;) {
+            if (end < as->brk || end - as->brk < size) {
+                return ENOMEM;
+            }
+
+            struct as_region *overlap = find_overlap(as, end - size, end);
+            if (overlap == NULL) {
+                break;
+            }
+
+            end = overlap->ar_vbase & VPAGE_ADDR_MASK;
+        }
+
+        region->ar_vbase = end - size;
+    }
+
+    region->ar_next = as->regions;
+    as->regions = region;
+
+    return 0;
+}
+
+/*
+Drops the first part of a region, up to new_start.
+*/
+static
+void
+region_trim_front(struct as_region *region, vaddr_t new_start)
+{
+    size_t delta = new_start - region->ar_vbase;
+
+    region->ar_vbase = new_start;
+    region->ar_memsize -= delta;
+    region->ar_offset += delta;
+    region->ar_filesize = region->ar_filesize > delta ? region->ar_filesize - delta : 0;
+}
+
+/*
+Drops the last part of a region, from new_end.
+*/
+static
+void
+region_trim_back(struct as_region *region, vaddr_t new_end)
+{
+    region->ar_memsize = new_end - region->ar_vbase;
+    if (region->ar_filesize > region->ar_memsize) {
+        region->ar_filesize = region->ar_memsize;
+    }
+}
+
+/*
+Removes the mmap regions between the page aligned addresses start and end. Dirty pages of
+shared file mappings are written back first. Regions that only partly overlap the range are
+trimmed, or split in two if the range is in their middle. The address space lock must be held,
+as for vm_writeback_range. The caller is responsible for dropping stale TLB entries.
+*/
+int
+as_unmap_range(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+    KASSERT(lock_do_i_hold(as->as_lock));
+    struct as_region **link = &as->regions;
+    int result;
+
+    while (*link != NULL) {
+        struct as_region *region = *link;
+        vaddr_t region_end = region->ar_vbase + region->ar_memsize;
+
+        if (!region->ar_mapped || region_end <= start || end <= region->ar_vbase) {
+            link = &region->ar_next;
+            continue;
+        }
+
+        vaddr_t unmap_start = start > region->ar_vbase ? start : region->ar_vbase;
+        vaddr_t unmap_end = end < region_end ? end : region_end;
+
+        /* Allocate the second half of a split region before anything is changed. */
+        struct as_region *tail = NULL;
+        if (unmap_start > region->ar_vbase && unmap_end < region_end) {
+            tail = kmalloc(sizeof(struct as_region));
+            if (tail == NULL) {
+                return ENOMEM;
+            }
+        }
+
+        if (region->ar_shared && region->ar_vnode != NULL) {
+            result = vm_writeback_range(as, region, unmap_start, unmap_end);
+            if (result) {
+                kfree(tail);
+                return result;
+            }
+        }
+
+        for (vaddr_t v_page = unmap_start; v_page < unmap_end; v_page += PAGE_SIZE) {
+            free_vpage(as->l2_pt, L2_PNUM(v_page), L1_PNUM(v_page));
+        }
+
+        vm_uncommit(region_commit_pages(region, unmap_end - unmap_start));
+
+        if (unmap_start == region->ar_vbase && unmap_end == region_end) {
+            *link = region->ar_next;
+            region_destroy(region);
+            continue;
+        }
+
+        if (unmap_start == region->ar_vbase) {
+            region_trim_front(region, unmap_end);
+        } else if (unmap_end == region_end) {
+            region_trim_back(region, unmap_start);
+        } else {
+            *tail = *region;
+            region_trim_front(tail, unmap_end);
+            region_trim_back(region, unmap_start);
+
+            if (tail->ar_vnode != NULL) {
+                VOP_INCREF(tail->ar_vnode);
+            }
+
+            region->ar_next = tail;
+            link = &tail->ar_next;
+            continue;
+        }
+
+        link = &region->ar_next;
+    }
+
+    return 0;
+}
+
 int
 as_prepare_load(struct addrspace *as)
 {
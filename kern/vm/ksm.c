@@ -0,0 +1,185 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <clock.h>
+#include <thread.h>
+#include <proc.h>
+#include <vm.h>
+#include <ksm.h>
+
+/* Paging bounds from vm.c */
+extern p_page_t first_alloc_page;
+extern p_page_t last_page;
+
+#define KSM_WORDS        (PAGE_SIZE / sizeof(uint32_t))
+#define KSM_GOLDEN       0x9e3779b1    /* Spreads virtual page numbers over the table */
+
+/*
+A frame seen in the current round, found by its hash and virtual page. kb_page is 0 if the
+bucket is empty.
+*/
+struct ksm_bucket {
+    p_page_t kb_page;
+    v_page_t kb_v_page;
+    uint32_t kb_hash;
+};
+
+static struct ksm_bucket ksm_table[KSM_TABLE_SIZE];
+static uint32_t *ksm_hashes;    /* Hash of each frame the last time round, from first_alloc_page */
+static p_page_t ksm_hand;       /* Next frame to look at */
+
+/* Statistics, protected by ksm_spinlock */
+static struct spinlock ksm_spinlock = SPINLOCK_INITIALIZER;
+static unsigned ksm_rounds;     /* Times the thread went over all of RAM */
+static unsigned ksm_scanned;    /* Frames hashed */
+static unsigned ksm_merged;     /* Frames freed by merging them with another frame */
+static unsigned ksm_merged_zero;/* Frames freed by mapping the zero page instead */
+static unsigned ksm_failed;     /* Candidates that differed, or changed before they were merged */
+
+/*
+Allocates the hashes of the frames and starts the merging thread. Called once kproc exists.
+*/
+void
+ksm_bootstrap(void)
+{
+    size_t nframes = last_page - first_alloc_page;
+
+    ksm_hashes = kmalloc(nframes * sizeof(uint32_t));
+    if (ksm_hashes == NULL) {
+        panic("couldn't allocate the page merging hashes\n");
+    }
+
+    bzero(ksm_hashes, nframes * sizeof(uint32_t));
+    ksm_hand = first_alloc_page;
+
+    thread_fork("Page Merging Daemon", kproc, ksm_daemon, NULL, 0);
+}
+
+/*
+FNV-1a hash of the words of a frame. *zero is set if they are all zero.
+*/
+static
+uint32_t
+ksm_hash(p_page_t p_page, bool *zero)
+{
+    const uint32_t *words = (const uint32_t *) PADDR_TO_KVADDR(PAGE_TO_ADDR(p_page));
+    uint32_t hash = 2166136261U;
+    uint32_t all = 0;
+
+    for (size_t i = 0; i < KSM_WORDS; i++) {
+        hash = (hash ^ words[i]) * 16777619U;
+        all |= words[i];
+    }
+
+    *zero = (all == 0);
+    return hash;
+}
+
+/*
+Looks at the next npages frames. Frames are hashed without any lock, since a stale hash only
+makes a merge fail when the frames are compared.
+*/
+static
+void
+ksm_scan(size_t npages)
+{
+    unsigned scanned = 0;
+    unsigned merged = 0;
+    unsigned merged_zero = 0;
+    unsigned failed = 0;
+    unsigned rounds = 0;
+
+    for (size_t i = 0; i < npages; i++) {
+        p_page_t p_page = ksm_hand;
+        ksm_hand++;
+        if (ksm_hand == last_page) {
+            ksm_hand = first_alloc_page;
+            bzero(ksm_table, sizeof(ksm_table));
+            rounds++;
+        }
+
+        uint32_t *last_hash = &ksm_hashes[p_page - first_alloc_page];
+        v_page_t v_page;
+
+        if (!vm_ksm_candidate(p_page, &v_page)) {
+            *last_hash = 0;
+            continue;
+        }
+
+        bool zero;
+        uint32_t hash = ksm_hash(p_page, &zero);
+        scanned++;
+
+        /* A frame that changed since the last round is likely to change again. */
+        if (hash != *last_hash) {
+            *last_hash = hash;
+            continue;
+        }
+
+        if (zero) {
+            if (vm_ksm_merge_zero(p_page)) {
+                merged_zero++;
+            } else {
+                failed++;
+            }
+            continue;
+        }
+
+        struct ksm_bucket *bucket = &ksm_table[(hash ^ (v_page * KSM_GOLDEN)) % KSM_TABLE_SIZE];
+
+        if (bucket->kb_page != 0 && bucket->kb_page != p_page &&
+            bucket->kb_hash == hash && bucket->kb_v_page == v_page) {
+            if (vm_ksm_merge(p_page, bucket->kb_page)) {
+                merged++;
+                continue;
+            }
+            failed++;
+        }
+
+        bucket->kb_page = p_page;
+        bucket->kb_v_page = v_page;
+        bucket->kb_hash = hash;
+    }
+
+    spinlock_acquire(&ksm_spinlock);
+    ksm_scanned += scanned;
+    ksm_merged += merged;
+    ksm_merged_zero += merged_zero;
+    ksm_failed += failed;
+    ksm_rounds += rounds;
+    spinlock_release(&ksm_spinlock);
+}
+
+/*
+The merging thread. It only wakes up once every KSM_SLEEP_SECS, and hashes KSM_SCAN_PAGES frames
+each time, so it stays out of the way of the processes it works for.
+*/
+void
+ksm_daemon(void *data1, unsigned long data2)
+{
+    (void) data1;
+    (void) data2;
+
+    while (true) {
+        clocksleep(KSM_SLEEP_SECS);
+        ksm_scan(KSM_SCAN_PAGES);
+    }
+}
+
+void
+ksm_printstats(void)
+{
+    spinlock_acquire(&ksm_spinlock);
+    unsigned rounds = ksm_rounds;
+    unsigned scanned = ksm_scanned;
+    unsigned merged = ksm_merged;
+    unsigned merged_zero = ksm_merged_zero;
+    unsigned failed = ksm_failed;
+    spinlock_release(&ksm_spinlock);
+
+    kprintf("Page merging:\n");
+    kprintf("    %u frames hashed in %u rounds over RAM\n", scanned, rounds);
+    kprintf("    %u frames merged, %u of them into the zero page\n",
+            merged + merged_zero, merged_zero);
+    kprintf("    %u candidates not merged\n", failed);
+}
@@ -0,0 +1,297 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <pagecache.h>
+
+/* Coremap and paging bounds from vm.c */
+extern struct coremap *cm;
+extern struct spinlock cm_spinlock;
+extern p_page_t first_alloc_page;
+extern p_page_t last_page;
+extern size_t free_high_pages;
+
+#define PC_HASH_SIZE     64
+#define PC_NUM_SECTORS   (PAGE_SIZE / PC_SECTOR_SIZE)
+
+/*
+A cached page. Entries are kept in a fixed array, and the index of an entry is stored in the
+coremap entry of its frame, so the clock can get from a frame back to the entry. All fields are
+protected by the coremap spinlock, except pc_valid, which belongs to the user of the busy page.
+*/
+struct pc_page {
+    struct vnode *pc_vnode;     /* NULL if the entry is unused */
+    off_t pc_offset;            /* Page aligned offset of the page in the file */
+    p_page_t pc_frame;
+    uint8_t pc_valid;           /* One bit per sector holding the file's data */
+    struct pc_page *pc_next;    /* Next page in the hash chain */
+};
+
+static struct pc_page pc_pages[PC_MAX_PAGES];
+static struct pc_page *pc_hash[PC_HASH_SIZE];
+static unsigned pc_limit;       /* Number of pages that may be cached, given the size of RAM */
+static unsigned pc_hand;        /* Clock hand over pc_pages for reusing cached pages */
+
+static
+unsigned
+pc_hashfn(struct vnode *vn, off_t offset)
+{
+    return (((uintptr_t) vn >> 4) ^ (unsigned) (offset / PAGE_SIZE)) % PC_HASH_SIZE;
+}
+
+/*
+Caps the cache at a quarter of the page frames, so it never crowds out process memory.
+Called once the coremap is set up.
+*/
+void
+pagecache_bootstrap()
+{
+    pc_limit = (last_page - first_alloc_page) / 4;
+    if (pc_limit > PC_MAX_PAGES) {
+        pc_limit = PC_MAX_PAGES;
+    }
+}
+
+static
+struct pc_page *
+pc_lookup(struct vnode *vn, off_t offset)
+{
+    struct pc_page *pg;
+
+    for (pg = pc_hash[pc_hashfn(vn, offset)]; pg != NULL; pg = pg->pc_next) {
+        if (pg->pc_vnode == vn && pg->pc_offset == offset) {
+            return pg;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+Takes a page out of the cache. Its frame is left allocated and is returned.
+*/
+static
+p_page_t
+pc_remove(struct pc_page *pg)
+{
+    KASSERT(spinlock_do_i_hold(&cm_spinlock));
+    KASSERT(pg->pc_vnode != NULL);
+    KASSERT(!(cm->cm_frames[pg->pc_frame].cf_entry & PP_BUSY));
+
+    struct pc_page **link = &pc_hash[pc_hashfn(pg->pc_vnode, pg->pc_offset)];
+    while (*link != pg) {
+        KASSERT(*link != NULL);
+        link = &(*link)->pc_next;
+    }
+    *link = pg->pc_next;
+
+    pg->pc_vnode = NULL;
+    pg->pc_next = NULL;
+
+    return pg->pc_frame;
+}
+
+static
+void
+pc_free_frame(p_page_t p_page)
+{
+    free_kpages(PADDR_TO_KVADDR(PAGE_TO_ADDR(p_page)));
+}
+
+/*
+Picks a cached page that was not used since the hand last passed it, like the clock in
+swap_out, so a full cache can take a new page without asking for another frame.
+*/
+static
+struct pc_page *
+pc_reclaim(void)
+{
+    for (unsigned i = 0; i < 2 * pc_limit; i++) {
+        struct pc_page *pg = &pc_pages[pc_hand];
+        pc_hand = (pc_hand + 1) % pc_limit;
+
+        if (pg->pc_vnode == NULL) {
+            continue;
+        }
+
+        cm_entry_t entry = cm->cm_frames[pg->pc_frame].cf_entry;
+        if (entry & PP_BUSY) {
+            continue;
+        }
+
+        if (cm->cm_frames[pg->pc_frame].cf_referenced) {
+            cm->cm_frames[pg->pc_frame].cf_referenced = 0;
+            continue;
+        }
+
+        return pg;
+    }
+
+    return NULL;
+}
+
+/*
+Gets the cached page of vn at offset, adding an empty one if it is not cached. Returns NULL if
+no frame can be spared for it, in which case the caller has to go to the disk itself.
+*/
+struct pc_page *
+pagecache_get(struct vnode *vn, off_t offset)
+{
+    KASSERT(offset % PAGE_SIZE == 0);
+
+    struct pc_page *pg;
+    p_page_t frame = 0;
+
+    if (pc_limit == 0) {
+        return NULL;
+    }
+
+    spinlock_acquire(&cm_spinlock);
+
+    pg = pc_lookup(vn, offset);
+    if (pg != NULL) {
+        KASSERT(!(cm->cm_frames[pg->pc_frame].cf_entry & PP_BUSY));
+        cm->cm_frames[pg->pc_frame].cf_entry = cm->cm_frames[pg->pc_frame].cf_entry | PP_BUSY;
+        cm->cm_frames[pg->pc_frame].cf_referenced = 1;
+
+        spinlock_release(&cm_spinlock);
+        return pg;
+    }
+
+    /* Only take a new frame while there are plenty free. */
+    if (vm_free_pages() > free_high_pages) {
+        for (unsigned i = 0; i < pc_limit; i++) {
+            if (pc_pages[i].pc_vnode == NULL) {
+                vaddr_t kvaddr = alloc_kpages(1);
+                if (kvaddr != 0) {
+                    pg = &pc_pages[i];
+                    frame = ADDR_TO_PAGE(KVADDR_TO_PADDR(kvaddr));
+                }
+                break;
+            }
+        }
+    }
+
+    if (pg == NULL) {
+        pg = pc_reclaim();
+        if (pg == NULL) {
+            spinlock_release(&cm_spinlock);
+            return NULL;
+        }
+
+        frame = pc_remove(pg);
+    }
+
+    unsigned hash = pc_hashfn(vn, offset);
+
+    pg->pc_vnode = vn;
+    pg->pc_offset = offset;
+    pg->pc_frame = frame;
+    pg->pc_valid = 0;
+    pg->pc_next = pc_hash[hash];
+    pc_hash[hash] = pg;
+
+    v_page_t v_page = VP_FILE_BASE + (pg - pc_pages);
+    cm->cm_frames[frame].cf_entry = (cm->cm_frames[frame].cf_entry & (~VP_MASK)) | v_page | PP_BUSY;
+    cm->cm_frames[frame].cf_referenced = 1;
+
+    spinlock_release(&cm_spinlock);
+
+    return pg;
+}
+
+void
+pagecache_put(struct pc_page *pg)
+{
+    spinlock_acquire(&cm_spinlock);
+
+    KASSERT(cm->cm_frames[pg->pc_frame].cf_entry & PP_BUSY);
+    cm->cm_frames[pg->pc_frame].cf_entry = cm->cm_frames[pg->pc_frame].cf_entry & (~PP_BUSY);
+
+    spinlock_release(&cm_spinlock);
+}
+
+void *
+pagecache_data(struct pc_page *pg)
+{
+    return (void *) PADDR_TO_KVADDR(PAGE_TO_ADDR(pg->pc_frame));
+}
+
+bool
+pagecache_valid(struct pc_page *pg, unsigned sector)
+{
+    KASSERT(sector < PC_NUM_SECTORS);
+
+    return pg->pc_valid & (1 << sector);
+}
+
+void
+pagecache_setvalid(struct pc_page *pg, unsigned sector, bool valid)
+{
+    KASSERT(sector < PC_NUM_SECTORS);
+
+    if (valid) {
+        pg->pc_valid = pg->pc_valid | (1 << sector);
+    } else {
+        pg->pc_valid = pg->pc_valid & (~(1 << sector));
+    }
+}
+
+/*
+Forgets the cached data of vn from offset on, for when the file is truncated or its vnode is
+reclaimed. A page that straddles offset keeps the sectors before it.
+*/
+void
+pagecache_purge(struct vnode *vn, off_t offset)
+{
+    spinlock_acquire(&cm_spinlock);
+
+    for (unsigned i = 0; i < pc_limit; i++) {
+        struct pc_page *pg = &pc_pages[i];
+
+        if (pg->pc_vnode != vn || pg->pc_offset + PAGE_SIZE <= offset) {
+            continue;
+        }
+
+        if (pg->pc_offset >= offset) {
+            pc_free_frame(pc_remove(pg));
+            continue;
+        }
+
+        unsigned first = (offset - pg->pc_offset + PC_SECTOR_SIZE - 1) / PC_SECTOR_SIZE;
+        for (unsigned sector = first; sector < PC_NUM_SECTORS; sector++) {
+            pagecache_setvalid(pg, sector, false);
+        }
+    }
+
+    spinlock_release(&cm_spinlock);
+}
+
+/*
+Checks if a page frame holds a cached file page.
+*/
+bool
+pagecache_frame(p_page_t p_page)
+{
+    KASSERT(spinlock_do_i_hold(&cm_spinlock));
+
+    cm_entry_t entry = cm->cm_frames[p_page].cf_entry;
+    v_page_t v_page = entry & VP_MASK;
+
+    return (entry & PP_USED) && VP_FILE_BASE <= v_page && v_page < VP_FILE_BASE + PC_MAX_PAGES;
+}
+
+/*
+Drops a cached file page to free its frame. Cached pages are always clean, so nothing is
+written. The frame must not be busy.
+*/
+void
+pagecache_drop_frame(p_page_t p_page)
+{
+    KASSERT(pagecache_frame(p_page));
+
+    struct pc_page *pg = &pc_pages[(cm->cm_frames[p_page].cf_entry & VP_MASK) - VP_FILE_BASE];
+    KASSERT(pg->pc_frame == p_page);
+
+    pc_free_frame(pc_remove(pg));
+}
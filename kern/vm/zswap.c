@@ -0,0 +1,456 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <vm.h>
+#include <zswap.h>
+
+/* Coremap and paging bounds from vm.c */
+extern struct spinlock cm_spinlock;
+extern struct lock *global_lock;
+extern p_page_t first_alloc_page;
+extern p_page_t last_page;
+extern p_page_t first_page_swap;
+extern size_t free_min_pages;
+
+#define ZS_WORDS         (PAGE_SIZE / sizeof(uint32_t))
+#define ZS_TAG_BYTES     (ZS_WORDS / 4)               /* Four 2 bit tags to a byte */
+
+#define ZS_TAG_ZERO      0    /* The word is zero */
+#define ZS_TAG_REPEAT    1    /* The word equals the word before it */
+#define ZS_TAG_HALF      2    /* The word fits in 16 bits, which follow */
+#define ZS_TAG_WORD      3    /* The whole word follows */
+
+/*
+A slot's entry in zs_map is 0 if the pool has nothing for it, ZS_ZERO for a page of zeros, and
+otherwise holds the frame of the pool (plus one), the first chunk and the number of chunks.
+*/
+#define ZS_ZERO              0x80000000
+#define ZS_ENTRY(pg, c, n)   ((((pg) + 1) << 16) | ((c) << 8) | (n))
+#define ZS_PAGE(entry)       (((entry) >> 16) - 1)
+#define ZS_CHUNK(entry)      (((entry) >> 8) & 0xff)
+#define ZS_NCHUNKS(entry)    ((entry) & 0xff)
+
+/*
+A frame of the pool. A bit of zp_free is set if its chunk is free.
+*/
+struct zs_page {
+    vaddr_t zp_kvaddr;          /* 0 if the entry is unused */
+    uint32_t zp_free;
+};
+
+static struct zs_page zs_pages[ZS_MAX_PAGES];
+static unsigned zs_limit;       /* Number of frames the pool may take, given the size of RAM */
+static unsigned zs_npages;      /* Number of frames the pool has */
+static unsigned zs_hand;        /* Next frame to write back when the pool is full */
+static size_t zs_nslots;
+static uint32_t *zs_map;        /* For each swap slot, where its page is in the pool */
+static uint8_t *zs_buf;         /* Compressed page being stored */
+static uint32_t *zs_wbuf;       /* Page being written back */
+
+/* Statistics */
+static unsigned zs_stored;      /* Pages in the pool now */
+static unsigned zs_stored_zero; /* Pages of zeros among them */
+static unsigned zs_chunks_used; /* Chunks they take */
+static unsigned zs_stores;      /* Pages taken, including pages of zeros */
+static unsigned zs_zero_stores; /* Pages of zeros taken */
+static unsigned zs_rejects;     /* Pages that did not compress well enough, or found no room */
+static unsigned zs_hits;        /* Pages brought in from the pool */
+static unsigned zs_misses;      /* Pages brought in from disk */
+static unsigned zs_writebacks;  /* Pages written back to disk to make room */
+
+/*
+Caps the pool at an eighth of the page frames, and allocates the slot map. Called once the swap
+disk is open.
+*/
+void
+zswap_bootstrap(size_t nslots)
+{
+    zs_limit = (last_page - first_alloc_page) / ZS_POOL_DIV;
+    if (zs_limit > ZS_MAX_PAGES) {
+        zs_limit = ZS_MAX_PAGES;
+    }
+
+    zs_nslots = nslots;
+    zs_map = kmalloc(nslots * sizeof(uint32_t));
+    zs_buf = kmalloc(ZS_MAX_SIZE);
+    zs_wbuf = kmalloc(PAGE_SIZE);
+    if (zs_map == NULL || zs_buf == NULL || zs_wbuf == NULL) {
+        panic("couldn't allocate the compressed swap pool\n");
+    }
+
+    bzero(zs_map, nslots * sizeof(uint32_t));
+}
+
+/*
+Compresses a page into dst, which holds ZS_MAX_SIZE bytes. Returns false if the page does not
+fit, and a size of 0 for a page of zeros.
+*/
+static
+bool
+zs_compress(const uint32_t *src, uint8_t *dst, size_t *size)
+{
+    uint8_t *out = dst + ZS_TAG_BYTES;
+    uint8_t *end = dst + ZS_MAX_SIZE;
+    uint32_t prev = 0;
+    bool zero = true;
+
+    bzero(dst, ZS_TAG_BYTES);
+
+    for (size_t i = 0; i < ZS_WORDS; i++) {
+        uint32_t word = src[i];
+        unsigned tag;
+
+        if (word == 0) {
+            tag = ZS_TAG_ZERO;
+        } else if (word == prev) {
+            tag = ZS_TAG_REPEAT;
+        } else if (word <= 0xffff) {
+            if (end - out < 2) {
+                return false;
+            }
+            tag = ZS_TAG_HALF;
+            out[0] = word >> 8;
+            out[1] = word;
+            out += 2;
+        } else {
+            if (end - out < 4) {
+                return false;
+            }
+            tag = ZS_TAG_WORD;
+            out[0] = word >> 24;
+            out[1] = word >> 16;
+            out[2] = word >> 8;
+            out[3] = word;
+            out += 4;
+        }
+
+        if (tag != ZS_TAG_ZERO) {
+            zero = false;
+        }
+
+        dst[i / 4] = dst[i / 4] | (tag << (2 * (i % 4)));
+        prev = word;
+    }
+
+    *size = zero ? 0 : (size_t) (out - dst);
+    return true;
+}
+
+static
+void
+zs_decompress(const uint8_t *src, uint32_t *dst)
+{
+    const uint8_t *in = src + ZS_TAG_BYTES;
+    uint32_t prev = 0;
+
+    for (size_t i = 0; i < ZS_WORDS; i++) {
+        unsigned tag = (src[i / 4] >> (2 * (i % 4))) & 3;
+
+        switch (tag) {
+        case ZS_TAG_ZERO:
+            dst[i] = 0;
+            break;
+        case ZS_TAG_REPEAT:
+            dst[i] = prev;
+            break;
+        case ZS_TAG_HALF:
+            dst[i] = ((uint32_t) in[0] << 8) | in[1];
+            in += 2;
+            break;
+        default:
+            dst[i] = ((uint32_t) in[0] << 24) | ((uint32_t) in[1] << 16) |
+                     ((uint32_t) in[2] << 8) | in[3];
+            in += 4;
+            break;
+        }
+
+        prev = dst[i];
+    }
+}
+
+/*
+Finds nchunks consecutive free chunks in a frame of the pool, first fit.
+*/
+static
+bool
+zs_alloc(unsigned nchunks, unsigned *page_ret, unsigned *chunk_ret)
+{
+    KASSERT(nchunks > 0 && nchunks < ZS_CHUNKS);
+
+    uint32_t run = (1U << nchunks) - 1;
+
+    for (unsigned pg = 0; pg < ZS_MAX_PAGES; pg++) {
+        uint32_t free = zs_pages[pg].zp_free;
+        if (zs_pages[pg].zp_kvaddr == 0 || free == 0) {
+            continue;
+        }
+
+        for (unsigned chunk = 0; chunk + nchunks <= ZS_CHUNKS; chunk++) {
+            if (((free >> chunk) & run) == run) {
+                zs_pages[pg].zp_free = free & ~(run << chunk);
+                *page_ret = pg;
+                *chunk_ret = chunk;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/*
+Adds a frame to the pool, unless the pool is at its limit or free frames are short.
+*/
+static
+bool
+zs_grow(void)
+{
+    KASSERT(spinlock_do_i_hold(&cm_spinlock));
+
+    if (zs_npages >= zs_limit || vm_free_pages() <= free_min_pages) {
+        return false;
+    }
+
+    for (unsigned pg = 0; pg < ZS_MAX_PAGES; pg++) {
+        if (zs_pages[pg].zp_kvaddr != 0) {
+            continue;
+        }
+
+        vaddr_t kvaddr = alloc_kpages(1);
+        if (kvaddr == 0) {
+            return false;
+        }
+
+        zs_pages[pg].zp_kvaddr = kvaddr;
+        zs_pages[pg].zp_free = ~0U;
+        zs_npages++;
+        return true;
+    }
+
+    return false;
+}
+
+/*
+Takes the page of a slot out of the pool. A frame left empty is given back if release is set.
+*/
+static
+void
+zs_remove(size_t idx, bool release)
+{
+    uint32_t entry = zs_map[idx];
+
+    if (entry == 0) {
+        return;
+    }
+
+    zs_map[idx] = 0;
+    zs_stored--;
+
+    if (entry == ZS_ZERO) {
+        zs_stored_zero--;
+        return;
+    }
+
+    struct zs_page *zp = &zs_pages[ZS_PAGE(entry)];
+    zp->zp_free = zp->zp_free | (((1U << ZS_NCHUNKS(entry)) - 1) << ZS_CHUNK(entry));
+    zs_chunks_used -= ZS_NCHUNKS(entry);
+
+    if (release && zp->zp_free == ~0U) {
+        free_kpages(zp->zp_kvaddr);
+        zp->zp_kvaddr = 0;
+        zs_npages--;
+    }
+}
+
+static
+void
+zs_copyout(uint32_t entry, void *page)
+{
+    if (entry == ZS_ZERO) {
+        bzero(page, PAGE_SIZE);
+        return;
+    }
+
+    struct zs_page *zp = &zs_pages[ZS_PAGE(entry)];
+    zs_decompress((const uint8_t *) (zp->zp_kvaddr + ZS_CHUNK(entry) * ZS_CHUNK_SIZE), page);
+}
+
+/*
+Makes room by writing the pages in the next frame of the pool back to their slots on disk, which
+leaves the frame empty for the page being stored. Called with the coremap spinlock held, which is dropped around each
+write. Slots can only be freed in the meantime, since storing needs the global paging lock.
+*/
+static
+bool
+zs_writeback(void)
+{
+    KASSERT(spinlock_do_i_hold(&cm_spinlock));
+
+    if (zs_npages == 0) {
+        return false;
+    }
+
+    while (zs_pages[zs_hand].zp_kvaddr == 0) {
+        zs_hand = (zs_hand + 1) % ZS_MAX_PAGES;
+    }
+
+    unsigned pg = zs_hand;
+    zs_hand = (zs_hand + 1) % ZS_MAX_PAGES;
+
+    for (size_t idx = 0; idx < zs_nslots && zs_pages[pg].zp_kvaddr != 0; idx++) {
+        uint32_t entry = zs_map[idx];
+        if (entry == 0 || entry == ZS_ZERO || ZS_PAGE(entry) != pg) {
+            continue;
+        }
+
+        zs_copyout(entry, zs_wbuf);
+
+        spinlock_release(&cm_spinlock);
+        int result = swap_write_kbuf(first_page_swap + idx, zs_wbuf);
+        spinlock_acquire(&cm_spinlock);
+
+        if (result) {
+            return false;
+        }
+
+        if (zs_map[idx] == entry) {
+            zs_remove(idx, false);
+            zs_writebacks++;
+        }
+    }
+
+    return true;
+}
+
+/*
+Stores a page under its slot. Any copy the pool already had for the slot is stale and is dropped
+whether or not the page is taken. Returns false if the page has to be written to disk instead.
+*/
+bool
+zswap_store(p_page_t slot, const void *page)
+{
+    KASSERT(lock_do_i_hold(global_lock));
+
+    size_t idx = slot - first_page_swap;
+    KASSERT(idx < zs_nslots);
+
+    size_t size;
+    bool fits = zs_compress(page, zs_buf, &size);
+
+    spinlock_acquire(&cm_spinlock);
+
+    zs_remove(idx, true);
+
+    if (!fits) {
+        zs_rejects++;
+        spinlock_release(&cm_spinlock);
+        return false;
+    }
+
+    if (size == 0) {
+        zs_map[idx] = ZS_ZERO;
+        zs_stored++;
+        zs_stored_zero++;
+        zs_stores++;
+        zs_zero_stores++;
+        spinlock_release(&cm_spinlock);
+        return true;
+    }
+
+    /* A frame emptied by a write back always has room, so at most one is written back. */
+    unsigned nchunks = DIVROUNDUP(size, ZS_CHUNK_SIZE);
+    unsigned pg;
+    unsigned chunk;
+    bool wrote_back = false;
+    while (!zs_alloc(nchunks, &pg, &chunk)) {
+        if (zs_grow()) {
+            continue;
+        }
+
+        if (wrote_back || !zs_writeback()) {
+            zs_rejects++;
+            spinlock_release(&cm_spinlock);
+            return false;
+        }
+        wrote_back = true;
+    }
+
+    memcpy((void *) (zs_pages[pg].zp_kvaddr + chunk * ZS_CHUNK_SIZE), zs_buf, size);
+    zs_map[idx] = ZS_ENTRY(pg, chunk, nchunks);
+    zs_stored++;
+    zs_stores++;
+    zs_chunks_used += nchunks;
+
+    spinlock_release(&cm_spinlock);
+    return true;
+}
+
+/*
+Copies the page of a slot out of the pool, if it is there. The pool keeps it until zswap_drop,
+so the caller can still fall back on it if something else goes wrong.
+*/
+bool
+zswap_load(p_page_t slot, void *page)
+{
+    KASSERT(spinlock_do_i_hold(&cm_spinlock));
+    KASSERT(lock_do_i_hold(global_lock));
+
+    size_t idx = slot - first_page_swap;
+    KASSERT(idx < zs_nslots);
+
+    uint32_t entry = zs_map[idx];
+    if (entry == 0) {
+        zs_misses++;
+        return false;
+    }
+
+    zs_copyout(entry, page);
+    zs_hits++;
+    return true;
+}
+
+/*
+Forgets the page of a slot, when the slot is freed or its page has been brought back in.
+*/
+void
+zswap_drop(p_page_t slot)
+{
+    KASSERT(spinlock_do_i_hold(&cm_spinlock));
+
+    size_t idx = slot - first_page_swap;
+    KASSERT(idx < zs_nslots);
+
+    zs_remove(idx, true);
+}
+
+void
+zswap_printstats(void)
+{
+    spinlock_acquire(&cm_spinlock);
+    unsigned stored = zs_stored;
+    unsigned zero = zs_stored_zero;
+    unsigned chunks = zs_chunks_used;
+    unsigned npages = zs_npages;
+    unsigned stores = zs_stores;
+    unsigned zero_stores = zs_zero_stores;
+    unsigned rejects = zs_rejects;
+    unsigned hits = zs_hits;
+    unsigned misses = zs_misses;
+    unsigned writebacks = zs_writebacks;
+    spinlock_release(&cm_spinlock);
+
+    /* In hundredths; pages of zeros take no space, so they are left out of the ratio. */
+    unsigned ratio = chunks == 0 ? 0 : (stored - zero) * ZS_CHUNKS * 100 / chunks;
+    unsigned total = hits + misses;
+    unsigned hit_rate = total == 0 ? 0 : total < 100 ? hits * 100 / total : hits / (total / 100);
+
+    kprintf("Compressed swap pool:\n");
+    kprintf("    %u pages stored (%u zero) in %u of at most %u frames\n",
+            stored, zero, npages, zs_limit);
+    kprintf("    compression ratio %u.%02u:1\n", ratio / 100, ratio % 100);
+    kprintf("    %u pages taken (%u zero), %u sent to disk, %u written back\n",
+            stores, zero_stores, rejects, writebacks);
+    kprintf("    %u pages brought in from the pool, %u from disk: hit rate %u%%\n",
+            hits, misses, hit_rate);
+}
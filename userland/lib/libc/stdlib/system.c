@@ -74,7 +74,7 @@ system(const char *cmd)
 
 	argv[nargs] = NULL;
 
-	pid = fork();
+	pid = vfork();
 	switch (pid) {
 	    case -1:
 		return -1;
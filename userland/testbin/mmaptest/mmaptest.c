@@ -0,0 +1,390 @@
+/*
+ * mmaptest.c
+ *
+ * Tests mmap and munmap with anonymous and file mappings, and the
+ * calls that act on mapped pages: msync, madvise, mincore, mlock and
+ * munlock.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <err.h>
+
+#define PAGESIZE  4096
+#define NPAGES    16
+#define PTSPAN    (4 * 1024 * 1024)   /* Memory mapped by one l1 page table */
+#define DATAFILE  "mmaptest.dat"
+
+/*
+ * Maps npages of zeroed private memory.
+ */
+static
+char *
+map_anon(unsigned npages)
+{
+	void *p;
+
+	p = mmap(NULL, npages * PAGESIZE, PROT_READ|PROT_WRITE,
+		 MAP_PRIVATE|MAP_ANON, -1, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap anonymous");
+	}
+	return p;
+}
+
+/*
+ * Checks that mincore reports every page of the range as resident,
+ * or every page as not resident.
+ */
+static
+void
+check_resident(char *p, unsigned npages, int expected, const char *what)
+{
+	unsigned char vec[NPAGES];
+	unsigned i;
+
+	if (mincore(p, npages * PAGESIZE, vec) < 0) {
+		err(1, "%s: mincore", what);
+	}
+	for (i=0; i<npages; i++) {
+		if (vec[i] != expected) {
+			errx(1, "%s: mincore says page %u is %s", what, i,
+			     vec[i] ? "resident" : "not resident");
+		}
+	}
+}
+
+/*
+ * Waits for a child and returns the signal that killed it, or 0.
+ */
+static
+int
+waitsig(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (WIFSIGNALED(status)) {
+		return WTERMSIG(status);
+	}
+	if (WEXITSTATUS(status) != 0) {
+		errx(1, "child exited with %d", WEXITSTATUS(status));
+	}
+	return 0;
+}
+
+static
+void
+test_anon(void)
+{
+	char *p;
+	unsigned i;
+	pid_t pid;
+
+	p = map_anon(NPAGES);
+	check_resident(p, NPAGES, 0, "untouched");
+
+	for (i=0; i<NPAGES * PAGESIZE; i++) {
+		if (p[i] != 0) {
+			errx(1, "anonymous mapping not zeroed at byte %u", i);
+		}
+	}
+	for (i=0; i<NPAGES * PAGESIZE; i++) {
+		p[i] = (char)(i * 7);
+	}
+	check_resident(p, NPAGES, 1, "touched");
+
+	/* A forked child gets its own copy of a private mapping. */
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		memset(p, 0x55, NPAGES * PAGESIZE);
+		_exit(0);
+	}
+	if (waitsig(pid) != 0) {
+		errx(1, "child writing the private mapping was killed");
+	}
+	for (i=0; i<NPAGES * PAGESIZE; i++) {
+		if (p[i] != (char)(i * 7)) {
+			errx(1, "child's write reached the parent at byte %u", i);
+		}
+	}
+
+	if (munmap(p, NPAGES * PAGESIZE) < 0) {
+		err(1, "munmap");
+	}
+
+	/* The range is gone: touching it must kill the process. */
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		p[0] = 1;
+		_exit(0);
+	}
+	if (waitsig(pid) != SIGSEGV) {
+		errx(1, "access to an unmapped page did not fault");
+	}
+
+	printf("mmaptest: anonymous mappings passed\n");
+}
+
+static
+void
+test_file(void)
+{
+	char buf[2 * PAGESIZE];
+	char *p;
+	unsigned i;
+	int fd;
+
+	for (i=0; i<sizeof(buf); i++) {
+		buf[i] = (char)(i % 251);
+	}
+
+	fd = open(DATAFILE, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: open", DATAFILE);
+	}
+	if (write(fd, buf, sizeof(buf)) != (int)sizeof(buf)) {
+		err(1, "%s: write", DATAFILE);
+	}
+
+	/* A shared mapping writes back to the file, even once fd is closed. */
+	p = mmap(NULL, sizeof(buf), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap shared");
+	}
+	close(fd);
+
+	if (memcmp(p, buf, sizeof(buf))) {
+		errx(1, "shared mapping does not match the file");
+	}
+	p[0] = 'S';
+	p[PAGESIZE + 1] = 'T';
+
+	fd = open(DATAFILE, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s: reopen", DATAFILE);
+	}
+
+	/* msync makes the writes visible to read without unmapping. */
+	if (msync(p, sizeof(buf), MS_SYNC) < 0) {
+		err(1, "msync");
+	}
+	if (read(fd, buf, sizeof(buf)) != (int)sizeof(buf)) {
+		err(1, "%s: read", DATAFILE);
+	}
+	if (buf[0] != 'S' || buf[PAGESIZE + 1] != 'T') {
+		errx(1, "msync did not write the shared mapping to the file");
+	}
+	if (msync(p, sizeof(buf), MS_SYNC|MS_ASYNC) >= 0 || errno != EINVAL) {
+		errx(1, "msync with both flags did not fail with EINVAL");
+	}
+
+	/* What is left dirty is written back by munmap. */
+	p[1] = 'U';
+	if (munmap(p, sizeof(buf)) < 0) {
+		err(1, "munmap shared");
+	}
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		err(1, "%s: lseek", DATAFILE);
+	}
+	if (read(fd, buf, 2) != 2) {
+		err(1, "%s: read", DATAFILE);
+	}
+	if (buf[1] != 'U') {
+		errx(1, "munmap did not write the shared mapping to the file");
+	}
+
+	/* A private mapping keeps its writes to itself. */
+	p = mmap(NULL, sizeof(buf), PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap private");
+	}
+	p[0] = 'P';
+	if (munmap(p, sizeof(buf)) < 0) {
+		err(1, "munmap private");
+	}
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		err(1, "%s: lseek", DATAFILE);
+	}
+	if (read(fd, buf, 1) != 1) {
+		err(1, "%s: read", DATAFILE);
+	}
+	if (buf[0] != 'S') {
+		errx(1, "write to a private mapping reached the file");
+	}
+
+	close(fd);
+	remove(DATAFILE);
+
+	printf("mmaptest: file mappings passed\n");
+}
+
+static
+void
+test_madvise(void)
+{
+	char *p;
+	unsigned i;
+
+	p = map_anon(NPAGES);
+	memset(p, 0xaa, NPAGES * PAGESIZE);
+
+	if (madvise(p, NPAGES * PAGESIZE, MADV_SEQUENTIAL) < 0) {
+		err(1, "madvise MADV_SEQUENTIAL");
+	}
+	if (madvise(p, NPAGES * PAGESIZE, MADV_WILLNEED) < 0) {
+		err(1, "madvise MADV_WILLNEED");
+	}
+	check_resident(p, NPAGES, 1, "after MADV_WILLNEED");
+
+	/* Dropped pages come back zeroed. */
+	if (madvise(p, NPAGES * PAGESIZE, MADV_DONTNEED) < 0) {
+		err(1, "madvise MADV_DONTNEED");
+	}
+	check_resident(p, NPAGES, 0, "after MADV_DONTNEED");
+	for (i=0; i<NPAGES * PAGESIZE; i++) {
+		if (p[i] != 0) {
+			errx(1, "page not zeroed after MADV_DONTNEED at byte %u", i);
+		}
+	}
+
+	if (madvise(p, PAGESIZE, 12345) >= 0 || errno != EINVAL) {
+		errx(1, "madvise with bad advice did not fail with EINVAL");
+	}
+
+	munmap(p, NPAGES * PAGESIZE);
+	if (madvise(p, PAGESIZE, MADV_NORMAL) >= 0 || errno != ENOMEM) {
+		errx(1, "madvise of an unmapped range did not fail with ENOMEM");
+	}
+
+	printf("mmaptest: madvise passed\n");
+}
+
+static
+void
+test_mlock(void)
+{
+	char *p;
+
+	/* Locking faults the pages in. */
+	p = map_anon(NPAGES);
+	if (mlock(p, NPAGES * PAGESIZE) < 0) {
+		err(1, "mlock");
+	}
+	check_resident(p, NPAGES, 1, "after mlock");
+	if (munlock(p, NPAGES * PAGESIZE) < 0) {
+		err(1, "munlock");
+	}
+
+	/* Unmapping a locked range drops the locks. */
+	if (mlock(p, NPAGES * PAGESIZE) < 0) {
+		err(1, "mlock");
+	}
+	if (munmap(p, NPAGES * PAGESIZE) < 0) {
+		err(1, "munmap of a locked range");
+	}
+	if (mlock(p, PAGESIZE) >= 0 || errno != ENOMEM) {
+		errx(1, "mlock of an unmapped range did not fail with ENOMEM");
+	}
+
+	printf("mmaptest: mlock passed\n");
+}
+
+/*
+ * Shrinking the heap back across an l1 page table boundary must not
+ * take a mapping placed right above the break with it.
+ */
+static
+void
+test_sbrk(void)
+{
+	char *brk, *p;
+	unsigned i;
+	size_t grow;
+
+	brk = sbrk(0);
+	grow = ((size_t)brk + PTSPAN) / PTSPAN * PTSPAN - (size_t)brk + PAGESIZE;
+	if (sbrk(grow) == (void *)-1) {
+		warnx("no room to grow the heap %u bytes; skipping the sbrk test",
+		      (unsigned)grow);
+		return;
+	}
+
+	p = mmap(brk + grow, PAGESIZE, PROT_READ|PROT_WRITE,
+		 MAP_PRIVATE|MAP_ANON|MAP_FIXED, -1, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap at the break");
+	}
+	for (i=0; i<PAGESIZE; i++) {
+		p[i] = (char)(i * 3);
+	}
+
+	if (sbrk(-grow) == (void *)-1) {
+		err(1, "sbrk shrink");
+	}
+	for (i=0; i<PAGESIZE; i++) {
+		if (p[i] != (char)(i * 3)) {
+			errx(1, "mapping above the break lost at byte %u "
+			     "when the heap shrank", i);
+		}
+	}
+
+	if (munmap(p, PAGESIZE) < 0) {
+		err(1, "munmap");
+	}
+
+	printf("mmaptest: sbrk below a mapping passed\n");
+}
+
+static
+void
+test_errors(void)
+{
+	void *p;
+
+	p = mmap(NULL, 0, PROT_READ, MAP_PRIVATE|MAP_ANON, -1, 0);
+	if (p != MAP_FAILED || errno != EINVAL) {
+		errx(1, "mmap of length 0 did not fail with EINVAL");
+	}
+
+	p = mmap(NULL, PAGESIZE, PROT_READ, MAP_SHARED|MAP_PRIVATE|MAP_ANON, -1, 0);
+	if (p != MAP_FAILED || errno != EINVAL) {
+		errx(1, "mmap both shared and private did not fail with EINVAL");
+	}
+
+	p = mmap(NULL, PAGESIZE, PROT_READ, MAP_PRIVATE|MAP_ANON, -1, 100);
+	if (p != MAP_FAILED || errno != EINVAL) {
+		errx(1, "mmap at an unaligned offset did not fail with EINVAL");
+	}
+
+	if (munmap((void *)(PAGESIZE + 1), PAGESIZE) >= 0 || errno != EINVAL) {
+		errx(1, "munmap of an unaligned address did not fail with EINVAL");
+	}
+
+	printf("mmaptest: errors passed\n");
+}
+
+int
+main(void)
+{
+	test_anon();
+	test_file();
+	test_madvise();
+	test_mlock();
+	test_sbrk();
+	test_errors();
+
+	printf("mmaptest: passed\n");
+	return 0;
+}
@@ -0,0 +1,266 @@
+/*
+ * rlimittest.c
+ *
+ * Tests getrlimit and setrlimit, the RLIMIT_STACK and RLIMIT_RSS
+ * limits the VM system enforces, and getrusage.
+ *
+ * The RLIMIT_RSS test pushes pages of this process out to swap, so it
+ * needs a swap disk to show anything; without one it only checks that
+ * the memory survives.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <err.h>
+
+#define PAGESIZE   4096
+#define RSS_PAGES  64     /* RLIMIT_RSS for the RSS test, in pages */
+#define RSS_TOUCH  512    /* Pages the RSS test writes */
+#define FAULT_PAGES 32    /* Pages the getrusage test touches */
+
+/*
+ * Uses about 1k of stack per level. The result depends on every
+ * frame, so the recursion cannot be turned into a loop.
+ */
+static
+int
+recurse(int depth)
+{
+	volatile char buf[1000];
+
+	buf[0] = (char)depth;
+	buf[sizeof(buf) - 1] = (char)depth;
+	if (depth == 0) {
+		return 0;
+	}
+	return recurse(depth - 1) + buf[0] - buf[sizeof(buf) - 1] + 1;
+}
+
+/*
+ * Waits for a child and returns the signal that killed it, or 0.
+ */
+static
+int
+waitsig(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (WIFSIGNALED(status)) {
+		return WTERMSIG(status);
+	}
+	if (WEXITSTATUS(status) != 0) {
+		errx(1, "child exited with %d", WEXITSTATUS(status));
+	}
+	return 0;
+}
+
+static
+void
+test_limits(void)
+{
+	struct rlimit rl, old;
+	pid_t pid;
+
+	if (getrlimit(RLIMIT_STACK, &old) < 0) {
+		err(1, "getrlimit RLIMIT_STACK");
+	}
+	if (old.rlim_cur == 0 || old.rlim_cur > old.rlim_max) {
+		errx(1, "RLIMIT_STACK: bad soft limit %lu, hard %lu",
+		     (unsigned long)old.rlim_cur, (unsigned long)old.rlim_max);
+	}
+
+	if (getrlimit(__RLIMIT_NUM, &rl) >= 0 || errno != EINVAL) {
+		errx(1, "getrlimit of a bad resource did not fail with EINVAL");
+	}
+
+	rl.rlim_cur = 2;
+	rl.rlim_max = 1;
+	if (setrlimit(RLIMIT_DATA, &rl) >= 0 || errno != EINVAL) {
+		errx(1, "setrlimit above the hard limit did not fail with EINVAL");
+	}
+
+	/* A lowered hard limit cannot be raised again; do it in a child. */
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		rl.rlim_cur = 4096;
+		rl.rlim_max = 8192;
+		if (setrlimit(RLIMIT_DATA, &rl) < 0) {
+			err(1, "setrlimit lowering RLIMIT_DATA");
+		}
+		if (getrlimit(RLIMIT_DATA, &rl) < 0) {
+			err(1, "getrlimit RLIMIT_DATA");
+		}
+		if (rl.rlim_cur != 4096 || rl.rlim_max != 8192) {
+			errx(1, "RLIMIT_DATA did not read back");
+		}
+		rl.rlim_max = 16384;
+		if (setrlimit(RLIMIT_DATA, &rl) >= 0 || errno != EPERM) {
+			errx(1, "raising a hard limit did not fail with EPERM");
+		}
+		_exit(0);
+	}
+	if (waitsig(pid) != 0) {
+		errx(1, "limits child was killed");
+	}
+
+	printf("rlimittest: limits passed\n");
+}
+
+static
+void
+test_stack(void)
+{
+	struct rlimit rl;
+	pid_t pid;
+
+	/* 256k of stack is well within the default limit. */
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		_exit(recurse(256) == 256 ? 0 : 1);
+	}
+	if (waitsig(pid) != 0) {
+		errx(1, "256k of stack did not fit in the default limit");
+	}
+
+	/* With a 64k limit the same recursion must fault. */
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		if (getrlimit(RLIMIT_STACK, &rl) < 0) {
+			err(1, "getrlimit RLIMIT_STACK");
+		}
+		rl.rlim_cur = 64 * 1024;
+		if (setrlimit(RLIMIT_STACK, &rl) < 0) {
+			err(1, "setrlimit RLIMIT_STACK");
+		}
+		recurse(256);
+		_exit(0);
+	}
+	if (waitsig(pid) != SIGSEGV) {
+		errx(1, "growing the stack past RLIMIT_STACK did not fault");
+	}
+
+	printf("rlimittest: stack limit passed\n");
+}
+
+static
+void
+test_rss(void)
+{
+	struct rlimit rl;
+	struct rusage ru;
+	char *p;
+	unsigned i;
+
+	rl.rlim_cur = RSS_PAGES * PAGESIZE;
+	rl.rlim_max = RLIM_INFINITY;
+	if (setrlimit(RLIMIT_RSS, &rl) < 0) {
+		err(1, "setrlimit RLIMIT_RSS");
+	}
+
+	p = sbrk(RSS_TOUCH * PAGESIZE);
+	if (p == (void *)-1) {
+		err(1, "sbrk");
+	}
+	for (i=0; i<RSS_TOUCH; i++) {
+		memset(p + i * PAGESIZE, (char)i, PAGESIZE);
+	}
+	for (i=0; i<RSS_TOUCH * PAGESIZE; i++) {
+		if (p[i] != (char)(i / PAGESIZE)) {
+			errx(1, "byte %u lost while over RLIMIT_RSS", i);
+		}
+	}
+
+	if (getrusage(RUSAGE_SELF, &ru) < 0) {
+		err(1, "getrusage");
+	}
+	if (ru.ru_nswap == 0) {
+		warnx("no pages went to swap; skipping the RSS check");
+	}
+	/* Eviction can fall behind the faults by a batch. */
+	else if (ru.ru_maxrss > 2 * RSS_PAGES * (PAGESIZE / 1024)) {
+		errx(1, "peak RSS %luk is far over the %uk limit",
+		     (unsigned long)ru.ru_maxrss, RSS_PAGES * (PAGESIZE / 1024));
+	}
+
+	if (sbrk(-RSS_TOUCH * PAGESIZE) == (void *)-1) {
+		err(1, "sbrk shrink");
+	}
+	rl.rlim_cur = RLIM_INFINITY;
+	if (setrlimit(RLIMIT_RSS, &rl) < 0) {
+		err(1, "setrlimit RLIMIT_RSS");
+	}
+
+	printf("rlimittest: RSS limit passed\n");
+}
+
+static
+void
+test_rusage(void)
+{
+	struct rusage before, after;
+	char *p;
+	unsigned i;
+
+	if (getrusage(RUSAGE_CHILDREN, &before) >= 0 || errno != EINVAL) {
+		errx(1, "getrusage of children did not fail with EINVAL");
+	}
+
+	if (getrusage(RUSAGE_SELF, &before) < 0) {
+		err(1, "getrusage");
+	}
+
+	/* Each new heap page takes a fault on its first write. */
+	p = sbrk(FAULT_PAGES * PAGESIZE);
+	if (p == (void *)-1) {
+		err(1, "sbrk");
+	}
+	for (i=0; i<FAULT_PAGES; i++) {
+		p[i * PAGESIZE] = 1;
+	}
+
+	if (getrusage(RUSAGE_SELF, &after) < 0) {
+		err(1, "getrusage");
+	}
+	if ((after.ru_minflt + after.ru_majflt) -
+	    (before.ru_minflt + before.ru_majflt) < FAULT_PAGES) {
+		errx(1, "%u new pages counted only %lu faults", FAULT_PAGES,
+		     (unsigned long)((after.ru_minflt + after.ru_majflt) -
+				     (before.ru_minflt + before.ru_majflt)));
+	}
+	if (after.ru_maxrss < before.ru_maxrss ||
+	    after.ru_maxrss < FAULT_PAGES * (PAGESIZE / 1024)) {
+		errx(1, "peak RSS %luk does not cover the %u pages touched",
+		     (unsigned long)after.ru_maxrss, FAULT_PAGES);
+	}
+
+	sbrk(-FAULT_PAGES * PAGESIZE);
+
+	printf("rlimittest: getrusage passed\n");
+}
+
+int
+main(void)
+{
+	test_limits();
+	test_stack();
+	test_rss();
+	test_rusage();
+
+	printf("rlimittest: passed\n");
+	return 0;
+}
@@ -0,0 +1,194 @@
+/*
+ * spawntest.c
+ *
+ * Tests spawn and its file actions. The test spawns itself with "-c"
+ * to get a child that reports what it was given: its stdout is
+ * redirected to a file with SPAWN_DUP2, and the descriptor it came
+ * from is closed with SPAWN_CLOSE.
+ *
+ * Expects to be installed as /testbin/spawntest.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#define PROG     "/testbin/spawntest"
+#define OUTFILE  "spawntest.out"
+#define MESSAGE  "spawned child writing to stdout\n"
+
+/*
+ * Child side: write the message to stdout, and check that the
+ * descriptor named on the command line was closed.
+ */
+static
+int
+child(int closedfd)
+{
+	int result;
+
+	result = write(STDOUT_FILENO, MESSAGE, strlen(MESSAGE));
+	if (result != (int)strlen(MESSAGE)) {
+		return 2;
+	}
+
+	result = write(closedfd, "x", 1);
+	if (result >= 0 || errno != EBADF) {
+		return 3;
+	}
+
+	return 0;
+}
+
+/*
+ * Waits for a child and returns its exit status.
+ */
+static
+int
+waitexit(pid_t pid, const char *what)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "%s: waitpid", what);
+	}
+	if (WIFSIGNALED(status)) {
+		errx(1, "%s: child got signal %d", what, WTERMSIG(status));
+	}
+	return WEXITSTATUS(status);
+}
+
+/*
+ * Spawn a child with its stdout redirected to a file, and check the
+ * file holds what it wrote.
+ */
+static
+void
+test_actions(void)
+{
+	struct spawn_action actions[2];
+	char fdstr[16];
+	char buf[128];
+	char *args[4];
+	pid_t pid;
+	int fd, len, status;
+
+	fd = open(OUTFILE, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: open", OUTFILE);
+	}
+
+	snprintf(fdstr, sizeof(fdstr), "%d", fd);
+	args[0] = (char *)"spawntest";
+	args[1] = (char *)"-c";
+	args[2] = fdstr;
+	args[3] = NULL;
+
+	actions[0].sa_op = SPAWN_DUP2;
+	actions[0].sa_fd = fd;
+	actions[0].sa_newfd = STDOUT_FILENO;
+	actions[1].sa_op = SPAWN_CLOSE;
+	actions[1].sa_fd = fd;
+	actions[1].sa_newfd = 0;
+
+	pid = spawn(PROG, args, actions, 2);
+	if (pid < 0) {
+		err(1, "spawn");
+	}
+	close(fd);
+
+	status = waitexit(pid, "actions");
+	if (status != 0) {
+		errx(1, "child exited with %d", status);
+	}
+
+	fd = open(OUTFILE, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open for read", OUTFILE);
+	}
+	len = read(fd, buf, sizeof(buf) - 1);
+	if (len < 0) {
+		err(1, "%s: read", OUTFILE);
+	}
+	close(fd);
+	buf[len] = 0;
+
+	if (strcmp(buf, MESSAGE)) {
+		errx(1, "%s holds \"%s\", expected \"%s\"", OUTFILE, buf, MESSAGE);
+	}
+
+	remove(OUTFILE);
+
+	printf("spawntest: file actions passed\n");
+}
+
+/*
+ * Errors in the arguments come back from spawn itself; a file that
+ * opens but does not load makes the child exit with 127.
+ */
+static
+void
+test_errors(void)
+{
+	struct spawn_action actions[SPAWN_ACTIONS_MAX + 1];
+	char *args[2];
+	pid_t pid;
+	int fd;
+
+	args[0] = (char *)"spawntest";
+	args[1] = NULL;
+
+	pid = spawn("/testbin/no-such-program", args, NULL, 0);
+	if (pid >= 0 || errno != ENOENT) {
+		errx(1, "spawn of a missing program: got %d, errno %d", pid, errno);
+	}
+
+	actions[0].sa_op = SPAWN_CLOSE;
+	actions[0].sa_fd = 99;
+	actions[0].sa_newfd = 0;
+	pid = spawn(PROG, args, actions, 1);
+	if (pid >= 0 || errno != EBADF) {
+		errx(1, "spawn closing a bad fd: got %d, errno %d", pid, errno);
+	}
+
+	pid = spawn(PROG, args, actions, SPAWN_ACTIONS_MAX + 1);
+	if (pid >= 0 || errno != EINVAL) {
+		errx(1, "spawn with too many actions: got %d, errno %d", pid, errno);
+	}
+
+	fd = open(OUTFILE, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: open", OUTFILE);
+	}
+	write(fd, "not a program\n", 14);
+	close(fd);
+
+	pid = spawn(OUTFILE, args, NULL, 0);
+	if (pid < 0) {
+		err(1, "spawn of a non-program");
+	}
+	if (waitexit(pid, "non-program") != 127) {
+		errx(1, "spawn of a non-program did not exit with 127");
+	}
+
+	remove(OUTFILE);
+
+	printf("spawntest: errors passed\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	if (argc == 3 && !strcmp(argv[1], "-c")) {
+		return child(atoi(argv[2]));
+	}
+
+	test_actions();
+	test_errors();
+
+	printf("spawntest: passed\n");
+	return 0;
+}
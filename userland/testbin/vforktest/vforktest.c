@@ -0,0 +1,149 @@
+/*
+ * vforktest.c
+ *
+ * Tests vfork. The child runs on the parent's address space, and the
+ * parent does not run again until the child has called execv or
+ * _exit, so anything the child writes before then is seen by the
+ * parent.
+ *
+ * The child must only call _exit or execv; returning from the
+ * function that called vfork, or calling exit, would corrupt the
+ * parent.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+static volatile int shared;
+
+/*
+ * Waits for a child and checks that it exited with the given status.
+ */
+static
+void
+checkexit(pid_t pid, int expected, const char *what)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "%s: waitpid", what);
+	}
+	if (WIFSIGNALED(status)) {
+		errx(1, "%s: child got signal %d", what, WTERMSIG(status));
+	}
+	if (WEXITSTATUS(status) != expected) {
+		errx(1, "%s: child exited with %d, expected %d",
+		     what, WEXITSTATUS(status), expected);
+	}
+}
+
+/*
+ * The child's writes to memory are seen by the parent, which is held
+ * until the child exits.
+ */
+static
+void
+test_shared(void)
+{
+	pid_t pid;
+
+	shared = 0;
+
+	pid = vfork();
+	if (pid < 0) {
+		err(1, "vfork");
+	}
+	if (pid == 0) {
+		shared = getpid();
+		_exit(7);
+	}
+
+	if (shared != pid) {
+		errx(1, "parent saw %d after vfork, expected the child's pid %d",
+		     shared, pid);
+	}
+	checkexit(pid, 7, "shared");
+
+	printf("vforktest: shared memory passed\n");
+}
+
+/*
+ * After the child execs a new program, the parent resumes with its
+ * memory as it left it.
+ */
+static
+void
+test_exec(void)
+{
+	char buf[256];
+	char *args[2];
+	pid_t pid;
+	unsigned i;
+
+	for (i=0; i<sizeof(buf); i++) {
+		buf[i] = (char)i;
+	}
+
+	args[0] = (char *)"true";
+	args[1] = NULL;
+
+	pid = vfork();
+	if (pid < 0) {
+		err(1, "vfork");
+	}
+	if (pid == 0) {
+		execv("/bin/true", args);
+		_exit(1);
+	}
+
+	for (i=0; i<sizeof(buf); i++) {
+		if (buf[i] != (char)i) {
+			errx(1, "parent stack changed at byte %u after exec", i);
+		}
+	}
+	checkexit(pid, 0, "exec");
+
+	printf("vforktest: exec passed\n");
+}
+
+/*
+ * Many children in a row, to catch leaks of the parent's address
+ * space or of the child processes.
+ */
+static
+void
+test_many(void)
+{
+	pid_t pid;
+	int i;
+
+	for (i=0; i<100; i++) {
+		pid = vfork();
+		if (pid < 0) {
+			err(1, "vfork %d", i);
+		}
+		if (pid == 0) {
+			shared = i;
+			_exit(0);
+		}
+		if (shared != i) {
+			errx(1, "child %d: parent saw %d", i, shared);
+		}
+		checkexit(pid, 0, "many");
+	}
+
+	printf("vforktest: repeated vfork passed\n");
+}
+
+int
+main(void)
+{
+	test_shared();
+	test_exec();
+	test_many();
+
+	printf("vforktest: passed\n");
+	return 0;
+}